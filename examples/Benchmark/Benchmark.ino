@@ -0,0 +1,266 @@
+/*
+  SD card benchmark
+
+ This example measures the SD card and file system performance:
+ * sequential write and read throughput for several buffer sizes
+ * random 512 B and 4 KB reads and writes per second
+ * file open/close, directory scan, mkdir and remove rates
+ * flush latency
+
+ Results are printed on the serial line in CSV ("test,size,value,unit")
+ or JSON lines. Progress and errors are CSV comment lines ("# ...") or
+ JSON objects ({"status":...} or {"error":...}), so the whole output can be
+ parsed. The files of the benchmark are removed at the end.
+ The same sketch runs on the host build with an emulated card, see
+ extras/host/README.md.
+
+ The circuit:
+ * SD card attached
+
+ This example code is in the public domain.
+
+ */
+
+#include <STM32SD.h>
+
+// If SD card slot has no detect pin then define it as SD_DETECT_NONE
+// to ignore it. One other option is to call 'SD.begin()' without parameter.
+#ifndef SD_DETECT_PIN
+#define SD_DETECT_PIN SD_DETECT_NONE
+#endif
+
+// Output format: false for CSV, true for JSON lines
+const bool jsonOutput = false;
+// Size of the sequential file in bytes
+const uint32_t fileSize = 4UL * 1024 * 1024;
+// Buffer sizes of the sequential tests
+const uint32_t bufferSizes[] = { 512, 4096, 32768 };
+// Number of random operations, of files and of flushes
+const uint32_t randomOps = 500;
+const uint32_t fileCount = 100;
+const uint32_t flushCount = 100;
+
+const char *seqFile = "bench.bin";
+const char *dirName = "benchdir";
+
+static uint8_t buffer[32768];
+static uint32_t randomState = 1;
+
+uint32_t nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+void printResult(const char *test, uint32_t size, double value, const char *unit) {
+  if (jsonOutput) {
+    Serial.print("{\"test\":\"");
+    Serial.print(test);
+    Serial.print("\",\"size\":");
+    Serial.print(size);
+    Serial.print(",\"value\":");
+    Serial.print(value, 3);
+    Serial.print(",\"unit\":\"");
+    Serial.print(unit);
+    Serial.println("\"}");
+  } else {
+    Serial.print(test);
+    Serial.print(',');
+    Serial.print(size);
+    Serial.print(',');
+    Serial.print(value, 3);
+    Serial.print(',');
+    Serial.println(unit);
+  }
+}
+
+// Progress and errors: a JSON object, or a CSV comment line
+void printEvent(const char *key, const char *message) {
+  if (jsonOutput) {
+    Serial.print("{\"");
+    Serial.print(key);
+    Serial.print("\":\"");
+    Serial.print(message);
+    Serial.println("\"}");
+  } else {
+    Serial.print("# ");
+    Serial.println(message);
+  }
+}
+
+// Operations per second of count operations done in us
+double rate(uint32_t count, uint32_t us) {
+  return (us == 0) ? 0.0 : (count * 1e6 / us);
+}
+
+void sequential(uint32_t size) {
+  uint32_t start, us;
+  File file;
+
+  SD.remove(seqFile);
+  file = SD.open(seqFile, FILE_WRITE);
+  if (!file) {
+    printEvent("error", "error opening bench.bin");
+    return;
+  }
+  start = micros();
+  for (uint32_t n = 0; n < fileSize; n += size) {
+    if (file.write(buffer, size) != size) {
+      printEvent("error", "write error");
+      break;
+    }
+  }
+  file.close();
+  us = micros() - start;
+  printResult("seq_write", size, (double)fileSize / us, "MB/s");
+
+  file = SD.open(seqFile);
+  start = micros();
+  while (file.read(buffer, size) > 0) {
+  }
+  file.close();
+  us = micros() - start;
+  printResult("seq_read", size, (double)fileSize / us, "MB/s");
+}
+
+void randomAccess(uint32_t size) {
+  uint32_t blocks = fileSize / size;
+  uint32_t start, us;
+  File file = SD.open(seqFile, FA_READ | FA_WRITE);
+
+  if (!file) {
+    printEvent("error", "error opening bench.bin");
+    return;
+  }
+  start = micros();
+  for (uint32_t i = 0; i < randomOps; i++) {
+    file.seek((nextRandom() % blocks) * size);
+    file.read(buffer, size);
+  }
+  us = micros() - start;
+  printResult("random_read", size, rate(randomOps, us), "IOPS");
+
+  start = micros();
+  for (uint32_t i = 0; i < randomOps; i++) {
+    file.seek((nextRandom() % blocks) * size);
+    file.write(buffer, size);
+    file.flush();
+  }
+  us = micros() - start;
+  file.close();
+  printResult("random_write", size, rate(randomOps, us), "IOPS");
+}
+
+void metadata() {
+  char path[32];
+  uint32_t start, us, entries = 0;
+  File file, dir, entry;
+
+  SD.mkdir(dirName);
+  start = micros();
+  for (uint32_t i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/f%lu.txt", dirName, (unsigned long)i);
+    file = SD.open(path, FILE_WRITE);
+    file.close();
+  }
+  us = micros() - start;
+  printResult("create", 0, rate(fileCount, us), "files/s");
+
+  start = micros();
+  for (uint32_t i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/f%lu.txt", dirName, (unsigned long)(nextRandom() % fileCount));
+    file = SD.open(path);
+    file.close();
+  }
+  us = micros() - start;
+  printResult("open_close", 0, rate(fileCount, us), "files/s");
+
+  dir = SD.open(dirName);
+  start = micros();
+  while ((entry = dir.openNextFile())) {
+    entry.close();
+    entries++;
+  }
+  us = micros() - start;
+  dir.close();
+  printResult("dir_scan", 0, rate(entries, us), "entries/s");
+
+  start = micros();
+  for (uint32_t i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/f%lu.txt", dirName, (unsigned long)i);
+    SD.remove(path);
+  }
+  us = micros() - start;
+  printResult("unlink", 0, rate(fileCount, us), "files/s");
+
+  start = micros();
+  for (uint32_t i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/d%lu", dirName, (unsigned long)i);
+    SD.mkdir(path);
+  }
+  us = micros() - start;
+  printResult("mkdir", 0, rate(fileCount, us), "dirs/s");
+
+  start = micros();
+  for (uint32_t i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/d%lu", dirName, (unsigned long)i);
+    SD.rmdir(path);
+  }
+  us = micros() - start;
+  printResult("rmdir", 0, rate(fileCount, us), "dirs/s");
+  SD.rmdir(dirName);
+}
+
+void flushLatency() {
+  uint32_t minUs = UINT32_MAX, maxUs = 0, total = 0;
+  File file = SD.open(seqFile, FILE_WRITE);
+
+  if (!file) {
+    printEvent("error", "error opening bench.bin");
+    return;
+  }
+  for (uint32_t i = 0; i < flushCount; i++) {
+    file.write(buffer, 512);
+    uint32_t start = micros();
+    file.flush();
+    uint32_t us = micros() - start;
+    minUs = (us < minUs) ? us : minUs;
+    maxUs = (us > maxUs) ? us : maxUs;
+    total += us;
+  }
+  file.close();
+  printResult("flush_min", 512, minUs, "us");
+  printResult("flush_avg", 512, (double)total / flushCount, "us");
+  printResult("flush_max", 512, maxUs, "us");
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) {
+    ;
+  }
+
+  printEvent("status", "initializing SD card");
+  while (!SD.begin(SD_DETECT_PIN)) {
+    delay(10);
+  }
+  printEvent("status", "initialization done");
+  memset(buffer, 0x55, sizeof(buffer));
+
+  if (!jsonOutput) {
+    Serial.println("test,size,value,unit");
+  }
+  for (uint32_t i = 0; i < sizeof(bufferSizes) / sizeof(bufferSizes[0]); i++) {
+    sequential(bufferSizes[i]);
+  }
+  randomAccess(512);
+  randomAccess(4096);
+  metadata();
+  flushLatency();
+  SD.remove(seqFile);
+  printEvent("status", "done");
+}
+
+void loop() {
+}
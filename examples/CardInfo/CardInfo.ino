@@ -88,6 +88,8 @@ void setup() {
   Serial.print("Volume size (Mbytes): ");
   volumesize /= 1024;
   Serial.println(volumesize);
+  Serial.print("Free space (Mbytes): ");
+  Serial.println(fatFs.freeBytes() / (1024 * 1024));
 
 
   Serial.println("\nFiles found on the card (name, date and size in bytes): ");
@@ -0,0 +1,152 @@
+/**
+  ******************************************************************************
+  * @file    Arduino.cpp
+  * @brief   Host build: Arduino API used by the library
+  ******************************************************************************
+  */
+#include <stdarg.h>
+#include "Arduino.h"
+#include "sd_emu.h"
+
+HardwareSerial Serial;
+
+uint32_t millis(void)
+{
+  return (uint32_t)(SD_Emu_Time() / 1000U);
+}
+
+uint32_t micros(void)
+{
+  return (uint32_t)SD_Emu_Time();
+}
+
+void delay(uint32_t ms)
+{
+  SD_Emu_Delay((uint64_t)ms * 1000U);
+}
+
+void yield(void)
+{
+}
+
+uint32_t HAL_GetTick(void)
+{
+  return millis();
+}
+
+void Error_Handler(void)
+{
+  fprintf(stderr, "Error_Handler\n");
+  abort();
+}
+
+PinName digitalPinToPinName(uint32_t p)
+{
+  return (p < NUM_DIGITAL_PINS) ? (PinName)p : NC;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(const char *str)
+{
+  return write(str);
+}
+
+size_t Print::print(char c)
+{
+  return write((uint8_t)c);
+}
+
+size_t Print::print(int n, int base)
+{
+  return print((long long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base)
+{
+  return print((unsigned long long)n, base);
+}
+
+size_t Print::print(long n, int base)
+{
+  return print((long long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  return print((unsigned long long)n, base);
+}
+
+size_t Print::print(long long n, int base)
+{
+  if ((n < 0) && (base == DEC)) {
+    return print('-') + print((unsigned long long)(-n), base);
+  }
+  return print((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned long long n, int base)
+{
+  char buf[8 * sizeof(n) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+
+  if (base < 2) {
+    base = DEC;
+  }
+  *str = '\0';
+  do {
+    char c = n % base;
+    n /= base;
+    *--str = (c < 10) ? (c + '0') : (c + 'A' - 10);
+  } while (n != 0);
+  return write(str);
+}
+
+size_t Print::print(double n, int digits)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t Print::println(void)
+{
+  return write("\r\n");
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buf[256];
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) {
+    return 0;
+  }
+  return write((const uint8_t *)buf, ((size_t)len < sizeof(buf)) ? (size_t)len : (sizeof(buf) - 1));
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return (fputc(c, stdout) == EOF) ? 0 : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  return fwrite(buffer, 1, size, stdout);
+}
+
+void HardwareSerial::flush(void)
+{
+  fflush(stdout);
+}
@@ -0,0 +1,111 @@
+/**
+  ******************************************************************************
+  * @file    Arduino.h
+  * @brief   Host build: Arduino API used by the library, the time being the
+  *          emulated clock of the card emulator
+  ******************************************************************************
+  */
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stm32_def.h"
+#include "PinNames.h"
+#include "variant.h"
+#include "wiring_constants.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void yield(void);
+
+#ifdef __cplusplus
+}
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+  public:
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str)
+    {
+      return (str == NULL) ? 0 : write((const uint8_t *)str, strlen(str));
+    }
+    virtual void flush(void) {}
+
+    size_t print(const char *str);
+    size_t print(char c);
+    size_t print(int n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(long long n, int base = DEC);
+    size_t print(unsigned long long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println(void);
+    template <typename T> size_t println(T value)
+    {
+      size_t n = print(value);
+      return n + println();
+    }
+    template <typename T> size_t println(T value, int format)
+    {
+      size_t n = print(value, format);
+      return n + println();
+    }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+};
+
+/* Serial prints to the standard output */
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud)
+    {
+      (void)baud;
+    }
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    virtual int available(void)
+    {
+      return 0;
+    }
+    virtual int read(void)
+    {
+      return -1;
+    }
+    virtual int peek(void)
+    {
+      return -1;
+    }
+    virtual void flush(void);
+    operator bool()
+    {
+      return true;
+    }
+};
+
+extern HardwareSerial Serial;
+
+#endif /* __cplusplus */
+
+#endif /* Arduino_h */
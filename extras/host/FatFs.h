@@ -0,0 +1,22 @@
+/**
+  ******************************************************************************
+  * @file    FatFs.h
+  * @brief   Host build: FatFs with the SD driver of the card emulator
+  ******************************************************************************
+  */
+#ifndef _FATFS_H
+#define _FATFS_H
+
+#include "ff_gen_drv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const Diskio_drvTypeDef SD_Driver;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FATFS_H */
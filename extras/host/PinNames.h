@@ -0,0 +1,27 @@
+/**
+  ******************************************************************************
+  * @file    PinNames.h
+  * @brief   Host build: pin names, no pin is used
+  ******************************************************************************
+  */
+#ifndef _PINNAMES_H
+#define _PINNAMES_H
+
+#include <stdint.h>
+
+typedef enum {
+  PA_0 = 0x00,
+  NC = (int)0xFFFFFFFF
+} PinName;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PinName digitalPinToPinName(uint32_t p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PINNAMES_H */
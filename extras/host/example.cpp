@@ -0,0 +1,59 @@
+/*
+  Host example: sequential write then read of a file on an emulated card,
+  timed with the emulated clock (host time plus modeled card time).
+
+  Usage: example <image> [megabytes]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "STM32SD.h"
+#include "sd_emu.h"
+
+#define BUFFER_SIZE 32768
+
+static uint8_t buffer[BUFFER_SIZE];
+
+int main(int argc, char **argv)
+{
+  const char *image = (argc > 1) ? argv[1] : "card.img";
+  uint32_t size = ((argc > 2) ? atoi(argv[2]) : 16) * 1024UL * 1024UL;
+  SD_EmuStats_t stats;
+  uint64_t start, elapsed;
+  File file;
+
+  if (SD_Emu_Open(0, image, 0) != 0) {
+    fprintf(stderr, "Cannot open %s\n", image);
+    return 1;
+  }
+  if (!SD.begin()) {
+    fprintf(stderr, "No FAT volume on %s\n", image);
+    return 1;
+  }
+  memset(buffer, 0x55, sizeof(buffer));
+
+  file = SD.open("bench.bin", FILE_WRITE);
+  start = SD_Emu_Time();
+  for (uint32_t n = 0; n < size; n += BUFFER_SIZE) {
+    file.write(buffer, BUFFER_SIZE);
+  }
+  file.close();
+  elapsed = SD_Emu_Time() - start;
+  printf("write: %.2f MB/s\n", (double)size / elapsed);
+
+  SD_Emu_ResetStats(0);
+  file = SD.open("bench.bin");
+  start = SD_Emu_Time();
+  while (file.read(buffer, BUFFER_SIZE) > 0) {
+  }
+  file.close();
+  elapsed = SD_Emu_Time() - start;
+  printf("read: %.2f MB/s\n", (double)size / elapsed);
+
+  SD_Emu_GetStats(0, &stats);
+  printf("read commands: %u, sectors: %llu\n", stats.read_cmds,
+         (unsigned long long)stats.sectors_read);
+  SD.remove("bench.bin");
+  SD.end();
+  SD_Emu_Close(0);
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+  Host test of the volume consistency under write faults: files are written
+  while CRC errors, data timeouts, busy stalls, torn writes (power loss while
+  programming) and card removals are injected, the volume is remounted after
+  each fault and all the files written so far are read back. A file has to
+  hold the data of its last successful flush or more, never other data. A
+  busy stall is not an error: the file has to be fully written. The image is
+  then to be checked with "fsck.vfat -n <image>".
+
+  Usage: faults <image> [rounds] [seed]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "STM32SD.h"
+#include "sd_emu.h"
+
+#define FILE_SIZE (256UL * 1024UL)
+#define CHUNK_SIZE 4096
+#define FLUSH_SIZE (4 * CHUNK_SIZE)
+
+static uint32_t buffer[CHUNK_SIZE / 4];
+static uint32_t check[CHUNK_SIZE / 4];
+static uint32_t flushed[64];
+static int failures;
+
+static void fail(const char *what, uint32_t index)
+{
+  printf("FAIL: %s %u\n", what, (unsigned)index);
+  failures++;
+}
+
+/* Fill a chunk with a pattern identifying the file and the offset */
+static void stamp(uint32_t *buf, uint32_t index, uint32_t pos)
+{
+  for (uint32_t i = 0; i < (CHUNK_SIZE / 4); i++) {
+    buf[i] = (index << 24) ^ (((pos / 4) + i) * 0x9E3779B9UL);
+  }
+}
+
+static void fileName(char *name, uint32_t index)
+{
+  sprintf(name, "f%u.bin", (unsigned)index);
+}
+
+/* Write a file by chunks, flushed every FLUSH_SIZE bytes, until a write
+   fails. Return the size of the last successful flush */
+static uint32_t writeFile(uint32_t index)
+{
+  char name[16];
+  File file;
+  uint32_t pos, size = 0;
+
+  fileName(name, index);
+  file = SD.open(name, FILE_WRITE);
+  if (!file) {
+    return 0;
+  }
+  for (pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+    stamp(buffer, index, pos);
+    if (file.write((const uint8_t *)buffer, CHUNK_SIZE) != CHUNK_SIZE) {
+      break;
+    }
+    if (((pos + CHUNK_SIZE) % FLUSH_SIZE) == 0) {
+      /* File::flush() does not return the result */
+      if (f_sync(file._fil) != FR_OK) {
+        break;
+      }
+      size = pos + CHUNK_SIZE;
+    }
+  }
+  file.close();
+  return size;
+}
+
+/* Read a file back: at least the flushed size, with the data written */
+static void checkFile(uint32_t index)
+{
+  char name[16];
+  File file;
+  uint32_t pos, size;
+
+  fileName(name, index);
+  file = SD.open(name);
+  if (!file) {
+    if (flushed[index] != 0) {
+      fail("file lost", index);
+    }
+    return;
+  }
+  size = file.size();
+  if ((size < flushed[index]) || (size > FILE_SIZE)) {
+    fail("file size", index);
+  }
+  for (pos = 0; pos < size; pos += CHUNK_SIZE) {
+    uint32_t n = ((size - pos) < CHUNK_SIZE) ? (size - pos) : CHUNK_SIZE;
+    stamp(buffer, index, pos);
+    if ((file.read(check, n) != (int)n) || (memcmp(buffer, check, n) != 0)) {
+      fail("file data", index);
+      break;
+    }
+  }
+  file.close();
+}
+
+int main(int argc, char **argv)
+{
+  /* Fault type, param (timeout and stall in us, sectors of a torn write) */
+  static const struct {
+    uint8_t type;
+    uint32_t param;
+    const char *name;
+  } faults[5] = {
+    { SD_EMU_FAULT_CRC, 0, "crc" },
+    { SD_EMU_FAULT_TIMEOUT, 100000, "timeout" },
+    { SD_EMU_FAULT_BUSY, 200000, "busy" },
+    { SD_EMU_FAULT_TORN, 1, "torn" },
+    { SD_EMU_FAULT_REMOVAL, 0, "removal" },
+  };
+  const char *image = (argc > 1) ? argv[1] : "card.img";
+  uint32_t rounds = (argc > 2) ? atoi(argv[2]) : 30;
+  SD_EmuStats_t stats;
+
+  if (rounds > (sizeof(flushed) / sizeof(flushed[0]))) {
+    rounds = sizeof(flushed) / sizeof(flushed[0]);
+  }
+  SD_Emu_Seed((argc > 3) ? atoi(argv[3]) : 1234);
+  if (SD_Emu_Open(0, image, 0) != 0) {
+    fprintf(stderr, "Cannot open %s\n", image);
+    return 1;
+  }
+  if (!SD.begin()) {
+    fprintf(stderr, "No FAT volume on %s\n", image);
+    return 1;
+  }
+  for (uint32_t round = 0; round < rounds; round++) {
+    /* One fault on a random write command, 1 in 16 */
+    uint8_t f = round % 5;
+    SD_EmuFault_t fault = { faults[f].type, SD_EMU_OP_WRITE, 0, 0, 4096, 1, faults[f].param };
+    SD_Emu_ResetStats(0);
+    SD_Emu_AddFault(0, &fault);
+    flushed[round] = writeFile(round);
+    SD_Emu_GetStats(0, &stats);
+    SD_Emu_ClearFaults(0);
+    SD_Emu_Insert(0, 1);
+    SD.end();
+    if (!SD.begin()) {
+      fail("remount after round", round);
+      break;
+    }
+    printf("round %u: %s fault %s, %u bytes flushed\n", (unsigned)round, faults[f].name,
+           stats.faults ? "injected" : "not injected", (unsigned)flushed[round]);
+    /* A stall only delays the write */
+    if ((faults[f].type == SD_EMU_FAULT_BUSY) && (flushed[round] != FILE_SIZE)) {
+      fail("write with a busy stall", round);
+    }
+    for (uint32_t i = 0; i <= round; i++) {
+      checkFile(i);
+    }
+  }
+  SD.end();
+  SD_Emu_Close(0);
+  printf("%s, check the volume with fsck.vfat -n %s\n", failures ? "FAILED" : "passed", image);
+  return failures ? 1 : 0;
+}
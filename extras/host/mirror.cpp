@@ -0,0 +1,258 @@
+/*
+  Host test of a mirrored volume (RAID-1) on two emulated cards: the second
+  card is copied from the first one by resyncStep() while the volume is read
+  and written, a card failing a write is left out (degraded mode) without
+  failing the volume, and a resynchronization makes both cards equal again.
+
+  The first card is the FAT volume image (e.g. made by mkfs.vfat), checked
+  at the end by "fsck.vfat -n <volume>". The second card image is created
+  if missing. Built with -DSD_MAX_DEVICES=2.
+
+  Usage: mirror <volume> <image1>
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "STM32SD.h"
+#include "sd_emu.h"
+
+#define TEST_SIZE (512UL * 1024UL)
+#define CHUNK_SECTORS 64
+
+static uint32_t buffer[CHUNK_SECTORS * SD_BLOCK_SIZE / 4];
+static uint32_t check[CHUNK_SECTORS * SD_BLOCK_SIZE / 4];
+static uint32_t saved[SD_BLOCK_SIZE / 4];
+static int failures;
+
+static void fail(const char *what)
+{
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+/* Fill blocks with a pattern identifying each block */
+static void stamp(uint32_t *buf, uint32_t block, uint32_t count)
+{
+  for (uint32_t i = 0; i < count * (SD_BLOCK_SIZE / 4); i++) {
+    buf[i] = (block + (i / (SD_BLOCK_SIZE / 4))) ^ ((i % (SD_BLOCK_SIZE / 4)) * 0x9E3779B9UL);
+  }
+}
+
+/* Check that both cards hold the same blocks */
+static bool sameCards(Sd2Card *card0, Sd2Card *card1, uint32_t count)
+{
+  for (uint32_t block = 0; block < count; block += CHUNK_SECTORS) {
+    uint32_t n = ((count - block) < CHUNK_SECTORS) ? (count - block) : CHUNK_SECTORS;
+    if (!card0->readBlocks((uint8_t *)buffer, block, n) ||
+        !card1->readBlocks((uint8_t *)check, block, n) ||
+        (memcmp(buffer, check, n * SD_BLOCK_SIZE) != 0)) {
+      printf("cards differ at block %u\n", (unsigned)block);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Write a block through the mirror and check it on the cards written, then
+   restore it */
+static bool writeBlock(SdMirrorDevice *mirror, Sd2Card *card[2], uint32_t block, uint8_t mask)
+{
+  bool status;
+
+  if (!mirror->readBlocks((uint8_t *)saved, block, 1)) {
+    return false;
+  }
+  stamp(buffer, block, 1);
+  status = mirror->writeBlocks((const uint8_t *)buffer, block, 1);
+  for (uint8_t i = 0; status && (i < 2); i++) {
+    if (mask & (1 << i)) {
+      status = card[i]->readBlocks((uint8_t *)check, block, 1) &&
+               (memcmp(buffer, check, SD_BLOCK_SIZE) == 0);
+    }
+  }
+  return mirror->writeBlocks((const uint8_t *)saved, block, 1) && status;
+}
+
+/* Copy the second card from the first one: the blocks not yet copied are
+   read from the first card, blocks written go to both cards */
+static void testResync(SdMirrorDevice *mirror, Sd2Card *card[2], uint32_t count)
+{
+  uint32_t copied = 0;
+  int res;
+
+  if (!mirror->resyncStart(card[1]) || !mirror->resyncing()) {
+    fail("resync start");
+    return;
+  }
+  do {
+    uint32_t block = rand() % count;
+    if (!mirror->readBlocks((uint8_t *)buffer, block, 1) ||
+        !card[0]->readBlocks((uint8_t *)check, block, 1) ||
+        (memcmp(buffer, check, SD_BLOCK_SIZE) != 0)) {
+      fail("read while resynchronized");
+      mirror->resyncAbort();
+      return;
+    }
+    if (!writeBlock(mirror, card, block, 3)) {
+      fail("write while resynchronized");
+      mirror->resyncAbort();
+      return;
+    }
+    res = mirror->resyncStep();
+    copied += SD_RESYNC_STEP;
+  } while ((res == 1) && (copied <= count));
+  if ((res != 0) || mirror->resyncing() || mirror->degraded()) {
+    fail("resync");
+  } else if (!sameCards(card[0], card[1], count)) {
+    fail("cards after the resync");
+  }
+}
+
+/* Fail the writes of the second card: the mirror goes on with the first one */
+static void testDegraded(SdMirrorDevice *mirror, Sd2Card *card[2], const SD_EmuFault_t *fault)
+{
+  SD_Emu_AddFault(1, fault);
+  if (!writeBlock(mirror, card, 1, 1) || !mirror->degraded()) {
+    fail("write in degraded mode");
+  }
+  SD_Emu_ClearFaults(1);
+  SD_Emu_Insert(1, 1);
+  /* The card left out is no longer written */
+  if (!writeBlock(mirror, card, 2, 1)) {
+    fail("write in degraded mode");
+  }
+}
+
+/* Write a file and check its content */
+static bool writeFile(const char *path)
+{
+  File file = SD.open(path, FILE_WRITE);
+  uint32_t pos;
+
+  for (pos = 0; file && (pos < TEST_SIZE); pos += sizeof(buffer)) {
+    stamp(buffer, pos / SD_BLOCK_SIZE, CHUNK_SECTORS);
+    if (file.write((const uint8_t *)buffer, sizeof(buffer)) != sizeof(buffer)) {
+      break;
+    }
+  }
+  if (file) {
+    file.close();
+  }
+  return pos == TEST_SIZE;
+}
+
+static bool checkFile(const char *path)
+{
+  File file = SD.open(path);
+  uint32_t pos = 0;
+
+  if (!file) {
+    return false;
+  }
+  while (pos < TEST_SIZE) {
+    stamp(buffer, pos / SD_BLOCK_SIZE, CHUNK_SECTORS);
+    if (file.read(check, sizeof(check)) != (int)sizeof(check) ||
+        (memcmp(buffer, check, sizeof(check)) != 0)) {
+      break;
+    }
+    pos += sizeof(check);
+  }
+  file.close();
+  return pos == TEST_SIZE;
+}
+
+/* Write a file with a fault on the second card: the volume goes on in
+   degraded mode, then the card is resynchronized by SD.poll() */
+static void testVolume(Sd2Card *card1, const SD_EmuFault_t *fault, const char *path)
+{
+  SD_Emu_AddFault(1, fault);
+  if (!writeFile(path) || !SD.degraded()) {
+    fail("file write in degraded mode");
+  }
+  SD_Emu_ClearFaults(1);
+  SD_Emu_Insert(1, 1);
+  if (!checkFile(path)) {
+    fail("file read in degraded mode");
+  }
+  if (!SD.resync(card1)) {
+    fail("volume resync start");
+    return;
+  }
+  while (SD.resyncing()) {
+    if (SD.poll() != 0) {
+      fail("volume resync");
+      return;
+    }
+  }
+  if (SD.degraded() || !checkFile(path)) {
+    fail("volume resync");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Sd2Card card0(0), card1(1);
+  Sd2Card *card[2] = { &card0, &card1 };
+  SdMirrorDevice mirror(&card0, &card1);
+  uint32_t count;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: mirror <volume> <image1>\n");
+    return 1;
+  }
+  srand(1234);
+  if (SD_Emu_Open(0, argv[1], 0) != 0) {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  if (!card0.init() || ((count = card0.blockCount()) == 0) ||
+      (SD_Emu_Open(1, argv[2], count) != 0) || !card1.init()) {
+    fprintf(stderr, "Cannot initialize the cards\n");
+    return 1;
+  }
+  /* Second card content different from the first one */
+  for (uint32_t block = 0; block < count; block += CHUNK_SECTORS) {
+    uint32_t n = ((count - block) < CHUNK_SECTORS) ? (count - block) : CHUNK_SECTORS;
+    stamp(buffer, ~block, n);
+    card1.writeBlocks((const uint8_t *)buffer, block, n);
+  }
+  if (!mirror.initialize()) {
+    fprintf(stderr, "Cannot initialize the mirror\n");
+    return 1;
+  }
+
+  testResync(&mirror, card, count);
+  SD_EmuFault_t crc = { SD_EMU_FAULT_CRC, SD_EMU_OP_WRITE, 0, 0, 0, 0, 0 };
+  testDegraded(&mirror, card, &crc);
+  testResync(&mirror, card, count);
+  SD_EmuFault_t removal = { SD_EMU_FAULT_REMOVAL, SD_EMU_OP_WRITE, 0, 0, 0, 1, 0 };
+  testDegraded(&mirror, card, &removal);
+  testResync(&mirror, card, count);
+  card0.deinit();
+  card1.deinit();
+
+  SD.setMirror(&card1);
+  if (!SD.begin()) {
+    fprintf(stderr, "No FAT volume on %s\n", argv[1]);
+    return 1;
+  }
+  if (!writeFile("mirror.bin") || SD.degraded() || !checkFile("mirror.bin")) {
+    fail("file");
+  }
+  testVolume(&card1, &crc, "crc.bin");
+  testVolume(&card1, &removal, "removal.bin");
+  if (!checkFile("mirror.bin")) {
+    fail("file after the faults");
+  }
+  SD.remove("mirror.bin");
+  SD.remove("crc.bin");
+  SD.remove("removal.bin");
+  SD.end();
+
+  if (!card0.init() || !card1.init() || !sameCards(&card0, &card1, count)) {
+    fail("cards at the end");
+  }
+  SD_Emu_Close(0);
+  SD_Emu_Close(1);
+  printf("%s, check the volume with fsck.vfat -n %s\n", failures ? "FAILED" : "passed", argv[1]);
+  return failures ? 1 : 0;
+}
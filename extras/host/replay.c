@@ -0,0 +1,241 @@
+/*
+  Host tool: replay a block I/O trace saved by SD.traceSave() against an
+  emulated card, to compare the card time of other settings.
+
+  Usage: replay [options] <image> <trace.csv>
+    -c sectors  read cache of the given number of sectors
+    -p sectors  read ahead of the given number of sectors on cache misses
+    -m sectors  merge contiguous writes up to the given number of sectors
+    -a sectors  allocation unit size of the card timing model
+    -g writes   garbage collection period of the card timing model
+    -i          keep the idle time between the traced operations
+
+  The image is written: use a copy of the card image or a scratch file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sd_emu.h"
+
+typedef struct {
+  uint32_t *tags;     /* Sector cached in each slot, UINT32_MAX if none */
+  uint32_t size;
+  uint32_t hits;
+  uint32_t misses;
+} Replay_Cache_t;
+
+/* Largest traced command and read ahead, 65536 sectors each */
+static uint32_t Replay_buffer[2 * 65536 * (512 / sizeof(uint32_t))];
+static Replay_Cache_t Replay_cache;
+static uint32_t Replay_readAhead = 0;
+static uint32_t Replay_mergeMax = 0;
+static uint32_t Replay_mergeSector, Replay_mergeCount = 0;
+static uint32_t Replay_errors = 0;
+static uint32_t Replay_sectors;
+
+static void Replay_Wait(void)
+{
+  while (BSP_SD_GetCardState() != SD_TRANSFER_OK) {
+  }
+}
+
+static void Replay_CacheSet(uint32_t sector, uint32_t count, uint8_t valid)
+{
+  for (uint32_t i = 0; (Replay_cache.size != 0) && (i < count); i++) {
+    uint32_t *tag = &Replay_cache.tags[(sector + i) % Replay_cache.size];
+    if (valid) {
+      *tag = sector + i;
+    } else if (*tag == (sector + i)) {
+      *tag = UINT32_MAX;
+    }
+  }
+}
+
+static void Replay_Write(uint32_t sector, uint32_t count)
+{
+  Replay_Wait();
+  if (BSP_SD_WriteBlocks(Replay_buffer, sector, count, SD_DATATIMEOUT) != MSD_OK) {
+    Replay_errors++;
+  }
+  Replay_CacheSet(sector, count, 1);
+}
+
+static void Replay_Flush(void)
+{
+  if (Replay_mergeCount != 0) {
+    Replay_Write(Replay_mergeSector, Replay_mergeCount);
+    Replay_mergeCount = 0;
+  }
+}
+
+static void Replay_Read(uint32_t sector, uint32_t count)
+{
+  uint32_t miss = 0;
+
+  if (Replay_cache.size == 0) {
+    miss = count;
+  } else {
+    /* Read from the first sector missing in the cache */
+    for (uint32_t i = 0; i < count; i++) {
+      if (Replay_cache.tags[(sector + i) % Replay_cache.size] != (sector + i)) {
+        miss = count - i;
+        sector += i;
+        break;
+      }
+    }
+    Replay_cache.hits += count - miss;
+    Replay_cache.misses += miss;
+  }
+  if (miss != 0) {
+    miss += Replay_readAhead;
+    if (miss > (Replay_sectors - sector)) {
+      miss = (sector < Replay_sectors) ? (Replay_sectors - sector) : 1;
+    }
+    Replay_Wait();
+    if (BSP_SD_ReadBlocks(Replay_buffer, sector, miss, SD_DATATIMEOUT) != MSD_OK) {
+      Replay_errors++;
+    }
+    Replay_CacheSet(sector, miss, 1);
+  }
+}
+
+static void Replay_Op(char op, uint32_t sector, uint32_t count)
+{
+  switch (op) {
+    case SD_TRACE_READ:
+      Replay_Flush();
+      Replay_Read(sector, count);
+      break;
+    case SD_TRACE_WRITE:
+      if ((Replay_mergeCount != 0) && (sector == (Replay_mergeSector + Replay_mergeCount)) &&
+          ((Replay_mergeCount + count) <= Replay_mergeMax)) {
+        Replay_mergeCount += count;
+      } else {
+        Replay_Flush();
+        if (count < Replay_mergeMax) {
+          Replay_mergeSector = sector;
+          Replay_mergeCount = count;
+        } else {
+          Replay_Write(sector, count);
+        }
+      }
+      break;
+    case SD_TRACE_ERASE:
+      Replay_Flush();
+      Replay_Wait();
+      if (BSP_SD_Erase(sector, sector + count - 1) != MSD_OK) {
+        Replay_errors++;
+      }
+      Replay_CacheSet(sector, count, 0);
+      break;
+    default:
+      break;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  SD_EmuTiming_t timing = SD_EmuDefaultTiming;
+  uint8_t idle = 0;
+  uint32_t records = 0;
+  uint32_t traceStart = 0, traceEnd = 0, lastEnd = 0;
+  uint64_t start;
+  SD_EmuStats_t stats;
+  BSP_SD_CardInfo info;
+  char line[128];
+  FILE *trace;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:p:m:a:g:i")) != -1) {
+    switch (opt) {
+      case 'c':
+        Replay_cache.size = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        Replay_readAhead = strtoul(optarg, NULL, 0);
+        break;
+      case 'm':
+        Replay_mergeMax = strtoul(optarg, NULL, 0);
+        break;
+      case 'a':
+        timing.au_sectors = strtoul(optarg, NULL, 0);
+        break;
+      case 'g':
+        timing.gc_period = strtoul(optarg, NULL, 0);
+        break;
+      case 'i':
+        idle = 1;
+        break;
+      default:
+        return 2;
+    }
+  }
+  if ((argc - optind) != 2) {
+    fprintf(stderr, "Usage: %s [-c sectors] [-p sectors] [-m sectors] [-a sectors] [-g writes] [-i] "
+            "<image> <trace.csv>\n", argv[0]);
+    return 2;
+  }
+  if ((Replay_readAhead > 65536) || (Replay_mergeMax > 65536)) {
+    fprintf(stderr, "Read ahead and merged writes are limited to 65536 sectors\n");
+    return 2;
+  }
+  if (Replay_cache.size != 0) {
+    Replay_cache.tags = malloc(Replay_cache.size * sizeof(uint32_t));
+    if (Replay_cache.tags == NULL) {
+      return 1;
+    }
+    memset(Replay_cache.tags, 0xFF, Replay_cache.size * sizeof(uint32_t));
+  }
+  if (SD_Emu_Open(0, argv[optind], 0) != 0) {
+    fprintf(stderr, "Cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  trace = fopen(argv[optind + 1], "r");
+  if (trace == NULL) {
+    fprintf(stderr, "Cannot open %s\n", argv[optind + 1]);
+    return 1;
+  }
+  SD_Emu_SetTiming(0, &timing);
+  if ((BSP_SD_Init() != MSD_OK) || !BSP_SD_GetCardInfo(&info)) {
+    fprintf(stderr, "Card init failed\n");
+    return 1;
+  }
+  Replay_sectors = info.LogBlockNbr;
+
+  /* All the traced devices are replayed on the card */
+  start = SD_Emu_Time();
+  while (fgets(line, sizeof(line), trace) != NULL) {
+    char op;
+    unsigned device, count, failed;
+    uint32_t sector, opStart, opEnd;
+    if (sscanf(line, "%c,%u,%u,%u,%u,%u,%u", &op, &device, &sector, &count,
+               &opStart, &opEnd, &failed) != 7) {
+      continue;  /* Header */
+    }
+    if (records++ == 0) {
+      traceStart = opStart;
+    } else if (idle && ((int32_t)(opStart - lastEnd) > 0)) {
+      SD_Emu_Delay(opStart - lastEnd);
+    }
+    lastEnd = opEnd;
+    traceEnd = opEnd;
+    Replay_Op(op, sector, count);
+  }
+  Replay_Flush();
+  Replay_Wait();
+  fclose(trace);
+
+  SD_Emu_GetStats(0, &stats);
+  printf("records: %u, errors: %u\n", records, Replay_errors);
+  printf("traced time: %.3f s, replayed time: %.3f s\n", (traceEnd - traceStart) / 1e6,
+         (SD_Emu_Time() - start) / 1e6);
+  printf("card: %u commands, %llu sectors read, %llu sectors written, %u gc stalls\n",
+         stats.commands, (unsigned long long)stats.sectors_read,
+         (unsigned long long)stats.sectors_written, stats.gc_stalls);
+  if (Replay_cache.size != 0) {
+    printf("cache: %u sector hits, %u misses\n", Replay_cache.hits, Replay_cache.misses);
+  }
+  SD_Emu_Close(0);
+  return 0;
+}
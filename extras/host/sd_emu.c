@@ -0,0 +1,901 @@
+/**
+  ******************************************************************************
+  * @file    sd_emu.c
+  * @brief   File-backed SD card emulator for host builds: BSP SD functions
+  *          and FatFs SD driver working on a disk image, with a timing model
+  ******************************************************************************
+  */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd_emu.h"
+#include "ff_gen_drv.h"
+
+#define SD_EMU_SECTOR_SIZE 512U
+/* Command without data on the bus, in us */
+#define SD_EMU_CMD_TIME    2U
+/* Performance enhancement extension register */
+#define SD_EMU_PERF_REG    SD_EXT_REG(2, 0, 0)
+
+/* Sector number type of the FatFs driver */
+#if (_FATFS == 80286)
+  typedef LBA_t SD_EmuSector_t;
+#else
+  typedef DWORD SD_EmuSector_t;
+#endif
+
+typedef struct {
+  FILE *img;
+  uint32_t sectors;
+  uint8_t present;
+  uint8_t init_step;
+  uint32_t error;
+  uint64_t busy_until;     /* Emulated time the card is busy until */
+  uint32_t last_au;
+  uint32_t au_moves;
+  SD_EmuTiming_t timing;
+  SD_EmuStats_t stats;
+  SD_PinName_t pins;
+  void (*detect_callback)(void);
+  SD_EmuFault_t faults[SD_EMU_MAX_FAULTS];
+  uint8_t fault_count;
+  uint8_t perf[SD_EMU_SECTOR_SIZE];
+  uint32_t cache_reg;
+  uint32_t cache_sectors;  /* Sectors written in the cache */
+  uint64_t cache_busy;     /* Programming time of the cached sectors */
+  uint8_t queue_depth;
+  uint32_t queue_tasks;
+  uint32_t queue_reads;
+  uint32_t queue_sector[SD_QUEUE_DEPTH];
+  uint16_t queue_count[SD_QUEUE_DEPTH];
+  uint64_t queue_ready[SD_QUEUE_DEPTH]; /* Emulated time the task is ready at */
+} SD_EmuCard_t;
+
+const SD_EmuTiming_t SD_EmuDefaultTiming = {
+  .cmd_latency = 100,
+  .read_sector = 41,
+  .write_sector = 41,
+  .program = 250,
+  .program_sector = 10,
+  .erase = 2000,
+  .au_sectors = 8192,
+  .gc_period = 16,
+  .gc_stall = 100000,
+  .realtime = 0,
+};
+
+static SD_EmuCard_t SD_cards[SD_MAX_DEVICES];
+static SD_EmuCard_t *SD_card = &SD_cards[0];
+static uint8_t SD_device = 0;
+static uint64_t SD_start = 0;   /* Host time at first use */
+static uint64_t SD_offset = 0;  /* Modeled time added to the host time */
+static uint32_t SD_random = 1;  /* Random faults state (xorshift32) */
+
+static uint64_t SD_Emu_HostTime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000U) + ((uint64_t)ts.tv_nsec / 1000U);
+}
+
+/**
+  * @brief  Emulated clock: host time since first use plus the modeled time
+  * @retval time in us
+  */
+uint64_t SD_Emu_Time(void)
+{
+  uint64_t now = SD_Emu_HostTime();
+  if (SD_start == 0) {
+    SD_start = now;
+  }
+  return now - SD_start + SD_offset;
+}
+
+void SD_Emu_Delay(uint64_t us)
+{
+  SD_offset += us;
+}
+
+/**
+  * @brief  Spend modeled card time
+  */
+static void SD_Emu_Spend(uint64_t us)
+{
+  SD_card->stats.busy_us += us;
+  if (SD_card->timing.realtime) {
+    struct timespec ts = { (time_t)(us / 1000000U), (long)((us % 1000000U) * 1000U) };
+    nanosleep(&ts, NULL);
+  } else {
+    SD_offset += us;
+  }
+}
+
+/**
+  * @brief  Wait for the end of the card busy state (programming, erase, GC)
+  */
+static void SD_Emu_WaitReady(void)
+{
+  uint64_t now = SD_Emu_Time();
+  if (SD_card->busy_until > now) {
+    SD_Emu_Spend(SD_card->busy_until - now);
+  }
+}
+
+static uint8_t SD_Emu_Ready(void)
+{
+  return (SD_card->img != NULL) && SD_card->present && (SD_card->init_step == SD_INIT_DONE);
+}
+
+static uint32_t SD_Emu_Random(void)
+{
+  SD_random ^= SD_random << 13;
+  SD_random ^= SD_random >> 17;
+  SD_random ^= SD_random << 5;
+  return SD_random;
+}
+
+/**
+  * @brief  Find the fault injected on a command, if any
+  * @param  op: SD_EMU_OP_* of the command
+  * @param  addr: first sector
+  * @param  count: number of sectors
+  * @retval fault, NULL if none
+  */
+static SD_EmuFault_t *SD_Emu_Fault(uint8_t op, uint32_t addr, uint32_t count)
+{
+  for (uint8_t i = 0; i < SD_card->fault_count; i++) {
+    SD_EmuFault_t *f = &SD_card->faults[i];
+    if ((f->type == 0) || !(f->ops & op)) {
+      continue;
+    }
+    if ((f->sectors != 0) && ((addr >= (f->sector + f->sectors)) || ((addr + count) <= f->sector))) {
+      continue;
+    }
+    if ((f->probability != 0) && ((SD_Emu_Random() & 0xFFFFU) >= f->probability)) {
+      continue;
+    }
+    if ((f->count != 0) && (--f->count == 0)) {
+      /* Last injection */
+      SD_EmuFault_t *last = &SD_card->faults[SD_card->fault_count - 1];
+      static SD_EmuFault_t once;
+      once = *f;
+      *f = *last;
+      SD_card->fault_count--;
+      f = &once;
+    }
+    SD_card->stats.faults++;
+    return f;
+  }
+  return NULL;
+}
+
+/**
+  * @brief  Inject the faults stopping a command before its data transfer
+  * @retval MSD_OK if the command goes on, MSD_ERROR on fault
+  */
+static uint8_t SD_Emu_Inject(const SD_EmuFault_t *f)
+{
+  if (f == NULL) {
+    return MSD_OK;
+  }
+  switch (f->type) {
+    case SD_EMU_FAULT_CRC:
+      SD_card->error = HAL_SD_ERROR_DATA_CRC_FAIL;
+      return MSD_ERROR;
+    case SD_EMU_FAULT_TIMEOUT:
+      SD_Emu_Spend(f->param);
+      SD_card->error = HAL_SD_ERROR_DATA_TIMEOUT;
+      return MSD_ERROR;
+    case SD_EMU_FAULT_REMOVAL:
+      SD_Emu_Insert(SD_device, 0);
+      SD_card->error = HAL_SD_ERROR_TIMEOUT;
+      return MSD_ERROR;
+    default:
+      return MSD_OK;
+  }
+}
+
+/**
+  * @brief  Check a command can be sent and model its latency
+  * @retval MSD_OK or MSD_ERROR
+  */
+static uint8_t SD_Emu_Read(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks);
+static uint8_t SD_Emu_Write(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks);
+
+static uint8_t SD_Emu_Command(uint32_t addr, uint32_t count)
+{
+  if (!SD_Emu_Ready()) {
+    SD_card->error = HAL_SD_ERROR_TIMEOUT;
+    return MSD_ERROR;
+  }
+  if ((count == 0) || (addr >= SD_card->sectors) || (count > (SD_card->sectors - addr))) {
+    SD_card->error = HAL_SD_ERROR_ADDR_OUT_OF_RANGE;
+    return MSD_ERROR;
+  }
+  SD_Emu_WaitReady();
+  SD_card->stats.commands++;
+  SD_card->error = HAL_SD_ERROR_NONE;
+  SD_Emu_Spend(SD_card->timing.cmd_latency);
+  return MSD_OK;
+}
+
+int SD_Emu_Open(uint8_t device, const char *path, uint32_t sectors)
+{
+  SD_EmuCard_t *card;
+  long size;
+
+  if (device >= SD_MAX_DEVICES) {
+    return -1;
+  }
+  card = &SD_cards[device];
+  SD_Emu_Close(device);
+  card->img = fopen(path, "r+b");
+  if ((card->img == NULL) && (sectors != 0)) {
+    card->img = fopen(path, "w+b");
+  }
+  if (card->img == NULL) {
+    return -1;
+  }
+  fseek(card->img, 0, SEEK_END);
+  size = ftell(card->img);
+  if ((sectors != 0) && ((uint64_t)size < ((uint64_t)sectors * SD_EMU_SECTOR_SIZE))) {
+    /* Extend the image, read as zeroes */
+    fseek(card->img, ((long)sectors * SD_EMU_SECTOR_SIZE) - 1, SEEK_SET);
+    fputc(0, card->img);
+    size = (long)sectors * SD_EMU_SECTOR_SIZE;
+  }
+  card->sectors = (uint32_t)(size / SD_EMU_SECTOR_SIZE);
+  card->present = 1;
+  card->init_step = SD_INIT_IDLE;
+  card->busy_until = 0;
+  card->last_au = UINT32_MAX;
+  card->au_moves = 0;
+  card->timing = SD_EmuDefaultTiming;
+  memset(&card->stats, 0, sizeof(card->stats));
+  card->fault_count = 0;
+  /* A2 card with a command queue of 32 tasks and a cache */
+  memset(card->perf, 0, sizeof(card->perf));
+  card->perf[SD_PERF_CACHE_SUPPORT] = 0x01;
+  card->perf[SD_PERF_QUEUE_DEPTH] = 31;
+  card->cache_reg = 0;
+  card->cache_sectors = 0;
+  card->cache_busy = 0;
+  card->queue_depth = 0;
+  card->queue_tasks = 0;
+  return 0;
+}
+
+void SD_Emu_Close(uint8_t device)
+{
+  if ((device < SD_MAX_DEVICES) && (SD_cards[device].img != NULL)) {
+    fclose(SD_cards[device].img);
+    SD_cards[device].img = NULL;
+    SD_cards[device].present = 0;
+    SD_cards[device].init_step = SD_INIT_IDLE;
+  }
+}
+
+void SD_Emu_SetTiming(uint8_t device, const SD_EmuTiming_t *timing)
+{
+  if (device < SD_MAX_DEVICES) {
+    SD_cards[device].timing = *timing;
+  }
+}
+
+void SD_Emu_GetStats(uint8_t device, SD_EmuStats_t *stats)
+{
+  if (device < SD_MAX_DEVICES) {
+    *stats = SD_cards[device].stats;
+  }
+}
+
+void SD_Emu_ResetStats(uint8_t device)
+{
+  if (device < SD_MAX_DEVICES) {
+    memset(&SD_cards[device].stats, 0, sizeof(SD_EmuStats_t));
+  }
+}
+
+int SD_Emu_AddFault(uint8_t device, const SD_EmuFault_t *fault)
+{
+  SD_EmuCard_t *card;
+
+  if ((device >= SD_MAX_DEVICES) || (SD_cards[device].fault_count >= SD_EMU_MAX_FAULTS)) {
+    return -1;
+  }
+  card = &SD_cards[device];
+  card->faults[card->fault_count] = *fault;
+  return card->fault_count++;
+}
+
+void SD_Emu_ClearFaults(uint8_t device)
+{
+  if (device < SD_MAX_DEVICES) {
+    SD_cards[device].fault_count = 0;
+  }
+}
+
+void SD_Emu_Seed(uint32_t seed)
+{
+  SD_random = (seed != 0) ? seed : 1;
+}
+
+void SD_Emu_Insert(uint8_t device, uint8_t present)
+{
+  SD_EmuCard_t *card;
+
+  if (device >= SD_MAX_DEVICES) {
+    return;
+  }
+  card = &SD_cards[device];
+  if (card->present == present) {
+    return;
+  }
+  card->present = present;
+  if (!present) {
+    /* A removed card has to be identified again */
+    card->init_step = SD_INIT_IDLE;
+  }
+  if (card->detect_callback != NULL) {
+    card->detect_callback();
+  }
+}
+
+/* BSP SD functions ----------------------------------------------------------*/
+uint8_t BSP_SD_SelectDevice(uint8_t device)
+{
+  if (device >= SD_MAX_DEVICES) {
+    return MSD_ERROR;
+  }
+  SD_device = device;
+  SD_card = &SD_cards[device];
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_GetDevice(void)
+{
+  return SD_device;
+}
+
+SD_PinName_t *BSP_SD_GetPinNames(uint8_t device)
+{
+  return &SD_cards[(device < SD_MAX_DEVICES) ? device : 0].pins;
+}
+
+uint8_t BSP_SD_Init(void)
+{
+  if ((SD_card->img == NULL) || !SD_card->present) {
+    SD_card->init_step = SD_INIT_IDLE;
+    return MSD_ERROR_SD_NOT_PRESENT;
+  }
+  if (SD_card->init_step != SD_INIT_DONE) {
+    /* Power up, ready wait and identification */
+    SD_Emu_Spend(20 * (uint64_t)SD_card->timing.cmd_latency);
+    SD_card->init_step = SD_INIT_DONE;
+  }
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_DeInit(void)
+{
+  SD_card->init_step = SD_INIT_IDLE;
+  /* The cache and the command queue are disabled by the next identification */
+  SD_card->perf[SD_PERF_CACHE_ENABLE] = 0;
+  SD_card->perf[SD_PERF_QUEUE_ENABLE] = 0;
+  SD_card->cache_reg = 0;
+  SD_card->cache_sectors = 0;
+  SD_card->cache_busy = 0;
+  SD_card->queue_depth = 0;
+  SD_card->queue_tasks = 0;
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_Suspend(void)
+{
+  /* Card stays identified */
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_InitStart(void)
+{
+  if ((SD_card->img == NULL) || !SD_card->present) {
+    SD_card->init_step = SD_INIT_IDLE;
+    return MSD_ERROR_SD_NOT_PRESENT;
+  }
+  if (SD_card->init_step == SD_INIT_DONE) {
+    return MSD_OK;
+  }
+  SD_card->init_step = SD_INIT_POWER;
+  return MSD_BUSY;
+}
+
+uint8_t BSP_SD_InitPoll(void)
+{
+  switch (SD_card->init_step) {
+    case SD_INIT_POWER:
+    case SD_INIT_VOLTAGE:
+      SD_Emu_Spend(5 * (uint64_t)SD_card->timing.cmd_latency);
+      SD_card->init_step++;
+      return MSD_BUSY;
+    case SD_INIT_IDENTIFY:
+      SD_Emu_Spend(10 * (uint64_t)SD_card->timing.cmd_latency);
+      SD_card->init_step = SD_INIT_DONE;
+      return MSD_OK;
+    case SD_INIT_DONE:
+      return MSD_OK;
+    default:
+      return MSD_ERROR;
+  }
+}
+
+uint8_t BSP_SD_InitStep(void)
+{
+  return SD_card->init_step;
+}
+
+uint8_t BSP_SD_DetectPin(PinName p, uint32_t level)
+{
+  UNUSED(p);
+  UNUSED(level);
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_DetectITConfig(void (*callback)(void))
+{
+  SD_card->detect_callback = callback;
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_IsDetected(void)
+{
+  return SD_card->present ? SD_PRESENT : SD_NOT_PRESENT;
+}
+
+uint8_t BSP_SD_ReadBlocks(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks, uint32_t Timeout)
+{
+  UNUSED(Timeout);
+  if (SD_Emu_Command(ReadAddr, NumOfBlocks) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  return SD_Emu_Read(pData, ReadAddr, NumOfBlocks);
+}
+
+uint8_t BSP_SD_WriteBlocks(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks, uint32_t Timeout)
+{
+  UNUSED(Timeout);
+  if (SD_Emu_Command(WriteAddr, NumOfBlocks) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  return SD_Emu_Write(pData, WriteAddr, NumOfBlocks);
+}
+
+/**
+  * @brief  Data transfer of a read command
+  * @retval MSD_OK or MSD_ERROR
+  */
+static uint8_t SD_Emu_Read(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks)
+{
+  SD_EmuFault_t *fault;
+
+  fault = SD_Emu_Fault(SD_EMU_OP_READ, ReadAddr, NumOfBlocks);
+  if (SD_Emu_Inject(fault) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  if ((fault != NULL) && (fault->type == SD_EMU_FAULT_BUSY)) {
+    SD_Emu_Spend(fault->param);
+  }
+  SD_Emu_Spend((uint64_t)NumOfBlocks * SD_card->timing.read_sector);
+  fseek(SD_card->img, (long)ReadAddr * SD_EMU_SECTOR_SIZE, SEEK_SET);
+  if (fread(pData, SD_EMU_SECTOR_SIZE, NumOfBlocks, SD_card->img) != NumOfBlocks) {
+    SD_card->error = HAL_SD_ERROR_DATA_CRC_FAIL;
+    return MSD_ERROR;
+  }
+  SD_card->stats.read_cmds++;
+  SD_card->stats.sectors_read += NumOfBlocks;
+  return MSD_OK;
+}
+
+/**
+  * @brief  Data transfer and programming of a write command
+  * @retval MSD_OK or MSD_ERROR
+  */
+static uint8_t SD_Emu_Write(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks)
+{
+  const SD_EmuTiming_t *t = &SD_card->timing;
+  SD_EmuFault_t *fault;
+  uint64_t busy;
+
+  fault = SD_Emu_Fault(SD_EMU_OP_WRITE, WriteAddr, NumOfBlocks);
+  if (SD_Emu_Inject(fault) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  SD_Emu_Spend((uint64_t)NumOfBlocks * t->write_sector);
+  fseek(SD_card->img, (long)WriteAddr * SD_EMU_SECTOR_SIZE, SEEK_SET);
+  if ((fault != NULL) && (fault->type == SD_EMU_FAULT_TORN)) {
+    /* Power loss while programming: first sectors and half the next one */
+    uint32_t n = (fault->param < NumOfBlocks) ? fault->param : (NumOfBlocks - 1);
+    fwrite(pData, SD_EMU_SECTOR_SIZE, n, SD_card->img);
+    fwrite((const uint8_t *)pData + (n * SD_EMU_SECTOR_SIZE), SD_EMU_SECTOR_SIZE / 2, 1, SD_card->img);
+    SD_card->stats.sectors_written += n;
+    SD_card->error = HAL_SD_ERROR_TX_UNDERRUN;
+    return MSD_ERROR;
+  }
+  if (fwrite(pData, SD_EMU_SECTOR_SIZE, NumOfBlocks, SD_card->img) != NumOfBlocks) {
+    SD_card->error = HAL_SD_ERROR_TX_UNDERRUN;
+    return MSD_ERROR;
+  }
+  SD_card->stats.write_cmds++;
+  SD_card->stats.sectors_written += NumOfBlocks;
+  /* Programming, with a garbage collection stall every gc_period writes
+     moving to another allocation unit */
+  busy = t->program + ((uint64_t)NumOfBlocks * t->program_sector);
+  if ((fault != NULL) && (fault->type == SD_EMU_FAULT_BUSY)) {
+    busy += fault->param;
+  }
+  if (t->au_sectors != 0) {
+    uint32_t au = WriteAddr / t->au_sectors;
+    if (au != SD_card->last_au) {
+      SD_card->last_au = au;
+      SD_card->au_moves++;
+      if ((t->gc_period != 0) && ((SD_card->au_moves % t->gc_period) == 0)) {
+        busy += t->gc_stall;
+        SD_card->stats.gc_stalls++;
+      }
+    }
+  }
+  if ((SD_card->perf[SD_PERF_CACHE_ENABLE] & 0x01) &&
+      ((SD_card->cache_sectors + NumOfBlocks) <= SD_EMU_CACHE_SECTORS)) {
+    /* Programmed at the next cache flush */
+    SD_card->cache_sectors += NumOfBlocks;
+    SD_card->cache_busy += busy;
+    busy = 0;
+  }
+  SD_card->busy_until = SD_Emu_Time() + busy;
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr)
+{
+  static const uint8_t zero[SD_EMU_SECTOR_SIZE];
+  uint64_t sector;
+  SD_EmuFault_t *fault;
+
+  if ((EndAddr < StartAddr) || (SD_Emu_Command((uint32_t)StartAddr, (uint32_t)(EndAddr - StartAddr + 1)) != MSD_OK)) {
+    return MSD_ERROR;
+  }
+  fault = SD_Emu_Fault(SD_EMU_OP_ERASE, (uint32_t)StartAddr, (uint32_t)(EndAddr - StartAddr + 1));
+  if ((SD_Emu_Inject(fault) != MSD_OK) || ((fault != NULL) && (fault->type == SD_EMU_FAULT_TORN))) {
+    return MSD_ERROR;
+  }
+  /* Erased sectors read as zeroes */
+  fseek(SD_card->img, (long)StartAddr * SD_EMU_SECTOR_SIZE, SEEK_SET);
+  for (sector = StartAddr; sector <= EndAddr; sector++) {
+    fwrite(zero, SD_EMU_SECTOR_SIZE, 1, SD_card->img);
+  }
+  SD_card->busy_until = SD_Emu_Time() + SD_card->timing.erase;
+  if ((fault != NULL) && (fault->type == SD_EMU_FAULT_BUSY)) {
+    SD_card->busy_until += fault->param;
+  }
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_GetCardState(void)
+{
+  if (!SD_Emu_Ready()) {
+    return SD_TRANSFER_BUSY;
+  }
+  /* Polling until ready: skip to the end of the busy state */
+  SD_Emu_WaitReady();
+  return SD_TRANSFER_OK;
+}
+
+bool BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo)
+{
+  if (!SD_Emu_Ready()) {
+    return false;
+  }
+  memset(CardInfo, 0, sizeof(HAL_SD_CardInfoTypeDef));
+  CardInfo->CardType = CARD_SDHC_SDXC;
+  CardInfo->CardVersion = CARD_V2_X;
+  CardInfo->Class = 0x5B5;
+  CardInfo->RelCardAdd = 1;
+  CardInfo->BlockNbr = SD_card->sectors;
+  CardInfo->BlockSize = SD_EMU_SECTOR_SIZE;
+  CardInfo->LogBlockNbr = SD_card->sectors;
+  CardInfo->LogBlockSize = SD_EMU_SECTOR_SIZE;
+  return true;
+}
+
+uint32_t BSP_SD_GetError(void)
+{
+  return SD_card->error;
+}
+
+uint8_t BSP_SD_GetSDStatus(uint8_t *status)
+{
+  uint32_t au = SD_card->timing.au_sectors;
+  uint8_t code = 0;
+
+  if (!SD_Emu_Ready()) {
+    return MSD_ERROR;
+  }
+  /* AU_SIZE code of the modeled AU, up to 4 MB (9) */
+  while ((au >= 32U) && (code < 9U)) {
+    au >>= 1;
+    code++;
+  }
+  memset(status, 0, 64);
+  status[0] = 0x80;          /* 4 bits bus */
+  status[8] = 4;             /* Class 10 */
+  status[10] = code << 4;
+  status[12] = 1;            /* 1 AU erased */
+  status[13] = (1 << 2) | 1; /* in 1 s, offset 1 s */
+  status[14] = 0x10 | code;  /* U1 */
+  status[15] = 10;           /* V10 */
+  status[21] = 2;            /* A2 */
+  SD_Emu_Spend(SD_card->timing.cmd_latency + (64U / 4U));
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_GetSCR(uint8_t *scr)
+{
+  if (!SD_Emu_Ready()) {
+    return MSD_ERROR;
+  }
+  memset(scr, 0, 8);
+  scr[0] = 0x02;  /* SD_SPEC 2 */
+  scr[1] = 0x05;  /* 1 and 4 bits bus */
+  scr[2] = 0x84;  /* SD_SPEC3, SD_SPEC4 */
+  scr[3] = 0x07;  /* CMD20, CMD23, CMD48/49 */
+  SD_Emu_Spend(SD_card->timing.cmd_latency);
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_ReadExtension(uint32_t reg, uint8_t *data, uint16_t length)
+{
+  uint32_t perf = SD_EMU_PERF_REG;
+
+  if (!SD_Emu_Ready() || (length == 0) || (length > SD_EMU_SECTOR_SIZE)) {
+    return MSD_ERROR;
+  }
+  SD_Emu_WaitReady();
+  memset(data, 0, SD_EMU_SECTOR_SIZE);
+  if (reg == SD_EXT_REG(0, 0, 0)) {
+    /* General information: the performance enhancement extension only */
+    data[2] = 16 + 48;
+    data[4] = 1;
+    data[16] = SD_FUNC_PERFORMANCE;
+    data[16 + 42] = 1;
+    memcpy(&data[16 + 44], &perf, 4);
+  } else if ((reg >= perf) && (reg < (perf + SD_EMU_SECTOR_SIZE))) {
+    uint32_t offset = reg - perf;
+    memcpy(data, &SD_card->perf[offset], ((offset + length) <= SD_EMU_SECTOR_SIZE) ? length : (SD_EMU_SECTOR_SIZE - offset));
+  }
+  SD_card->stats.commands++;
+  SD_Emu_Spend(SD_card->timing.cmd_latency + SD_card->timing.read_sector);
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_WriteExtension(uint32_t reg, uint8_t value)
+{
+  uint32_t perf = SD_EMU_PERF_REG;
+
+  if (!SD_Emu_Ready()) {
+    return MSD_ERROR;
+  }
+  SD_Emu_WaitReady();
+  if ((reg >= perf) && (reg < (perf + SD_EMU_SECTOR_SIZE))) {
+    SD_card->perf[reg - perf] = value;
+  }
+  SD_card->stats.commands++;
+  SD_Emu_Spend(SD_card->timing.cmd_latency + SD_card->timing.write_sector);
+  SD_card->busy_until = SD_Emu_Time() + SD_card->timing.program;
+  if ((reg == (perf + SD_PERF_CACHE_FLUSH)) && (value & 0x01)) {
+    /* Flush: programming of the cached sectors, the bit then cleared */
+    SD_card->busy_until += SD_card->cache_busy;
+    SD_card->cache_sectors = 0;
+    SD_card->cache_busy = 0;
+    SD_card->perf[SD_PERF_CACHE_FLUSH] = 0;
+  }
+  return MSD_OK;
+}
+
+void BSP_SD_CacheSetRegister(uint32_t reg)
+{
+  SD_card->cache_reg = reg;
+}
+
+bool BSP_SD_CacheEnabled(void)
+{
+  return SD_card->cache_reg != 0;
+}
+
+uint8_t BSP_SD_CacheFlush(uint32_t Timeout)
+{
+  UNUSED(Timeout);
+  if (SD_card->cache_reg == 0) {
+    return MSD_OK;
+  }
+  if (BSP_SD_WriteExtension(SD_card->cache_reg + SD_PERF_CACHE_FLUSH, 0x01) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  SD_Emu_WaitReady();
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_QueueSetDepth(uint8_t depth)
+{
+  if (SD_card->queue_tasks != 0) {
+    return MSD_BUSY;
+  }
+  SD_card->queue_depth = (depth > SD_QUEUE_DEPTH) ? SD_QUEUE_DEPTH : depth;
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_QueueDepth(void)
+{
+  return SD_card->queue_depth;
+}
+
+uint32_t BSP_SD_QueueTasks(void)
+{
+  return SD_card->queue_tasks;
+}
+
+int8_t BSP_SD_QueueSubmit(bool read, uint32_t sector, uint32_t count)
+{
+  uint64_t start;
+  uint8_t task;
+
+  if (!SD_Emu_Ready() || (count == 0) || (count > UINT16_MAX) ||
+      (sector >= SD_card->sectors) || (count > (SD_card->sectors - sector))) {
+    return -1;
+  }
+  for (task = 0; (task < SD_card->queue_depth) && (SD_card->queue_tasks & (1UL << task)); task++) {
+  }
+  if (task >= SD_card->queue_depth) {
+    return -1;
+  }
+  SD_card->stats.commands += 2;
+  SD_Emu_Spend(2 * SD_EMU_CMD_TIME);
+  /* The card fetches the data of the queued reads in parallel, once the
+     programming is done */
+  start = SD_Emu_Time();
+  if (SD_card->busy_until > start) {
+    start = SD_card->busy_until;
+  }
+  SD_card->queue_ready[task] = read ? (start + SD_card->timing.cmd_latency) : start;
+  SD_card->queue_sector[task] = sector;
+  SD_card->queue_count[task] = (uint16_t)count;
+  SD_card->queue_tasks |= 1UL << task;
+  if (read) {
+    SD_card->queue_reads |= 1UL << task;
+  } else {
+    SD_card->queue_reads &= ~(1UL << task);
+  }
+  return (int8_t)task;
+}
+
+uint8_t BSP_SD_QueueStatus(uint32_t *ready)
+{
+  uint64_t now;
+
+  if (!SD_Emu_Ready()) {
+    return MSD_ERROR;
+  }
+  SD_card->stats.commands++;
+  SD_Emu_Spend(SD_EMU_CMD_TIME);
+  now = SD_Emu_Time();
+  *ready = 0;
+  for (uint8_t task = 0; task < SD_card->queue_depth; task++) {
+    if ((SD_card->queue_tasks & (1UL << task)) && (SD_card->queue_ready[task] <= now)) {
+      *ready |= 1UL << task;
+    }
+  }
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_QueueExecute(uint8_t task, uint32_t *pData, uint32_t Timeout)
+{
+  uint64_t now = SD_Emu_Time();
+
+  if (!SD_Emu_Ready() || (task >= SD_QUEUE_DEPTH) || !(SD_card->queue_tasks & (1UL << task))) {
+    return MSD_ERROR;
+  }
+  if ((Timeout == 0) && (SD_card->busy_until > now)) {
+    return MSD_BUSY;
+  }
+  SD_Emu_WaitReady();
+  now = SD_Emu_Time();
+  if (SD_card->queue_ready[task] > now) {
+    SD_Emu_Spend(SD_card->queue_ready[task] - now);
+  }
+  SD_card->queue_tasks &= ~(1UL << task);
+  SD_card->stats.commands++;
+  SD_card->error = HAL_SD_ERROR_NONE;
+  SD_Emu_Spend(SD_EMU_CMD_TIME);
+  if (SD_card->queue_reads & (1UL << task)) {
+    return SD_Emu_Read(pData, SD_card->queue_sector[task], SD_card->queue_count[task]);
+  }
+  return SD_Emu_Write(pData, SD_card->queue_sector[task], SD_card->queue_count[task]);
+}
+
+uint8_t BSP_SD_QueueAbort(void)
+{
+  SD_card->queue_tasks = 0;
+  return SD_Emu_Ready() ? MSD_OK : MSD_ERROR;
+}
+
+/* FatFs SD driver, as the one of the FatFs library ---------------------------*/
+static DSTATUS SD_Emu_DiskInitialize(BYTE lun)
+{
+  UNUSED(lun);
+  return (BSP_SD_Init() == MSD_OK) ? 0 : STA_NOINIT;
+}
+
+static DSTATUS SD_Emu_DiskStatus(BYTE lun)
+{
+  UNUSED(lun);
+  return (BSP_SD_GetCardState() == SD_TRANSFER_OK) ? 0 : STA_NOINIT;
+}
+
+static DRESULT SD_Emu_DiskRead(BYTE lun, BYTE *buff, SD_EmuSector_t sector, UINT count)
+{
+  UNUSED(lun);
+  if (BSP_SD_ReadBlocks((uint32_t *)buff, (uint32_t)sector, count, SD_DATATIMEOUT) != MSD_OK) {
+    return RES_ERROR;
+  }
+  return (BSP_SD_GetCardState() == SD_TRANSFER_OK) ? RES_OK : RES_ERROR;
+}
+
+#if _USE_WRITE == 1
+static DRESULT SD_Emu_DiskWrite(BYTE lun, const BYTE *buff, SD_EmuSector_t sector, UINT count)
+{
+  UNUSED(lun);
+  if (BSP_SD_WriteBlocks((uint32_t *)buff, (uint32_t)sector, count, SD_DATATIMEOUT) != MSD_OK) {
+    return RES_ERROR;
+  }
+  return (BSP_SD_GetCardState() == SD_TRANSFER_OK) ? RES_OK : RES_ERROR;
+}
+#endif
+
+#if _USE_IOCTL == 1
+static DRESULT SD_Emu_DiskIoctl(BYTE lun, BYTE cmd, void *buff)
+{
+  HAL_SD_CardInfoTypeDef info;
+
+  UNUSED(lun);
+  if (!BSP_SD_GetCardInfo(&info)) {
+    return RES_NOTRDY;
+  }
+  switch (cmd) {
+    case CTRL_SYNC:
+      return RES_OK;
+    case GET_SECTOR_COUNT:
+      *(SD_EmuSector_t *)buff = info.LogBlockNbr;
+      return RES_OK;
+    case GET_SECTOR_SIZE:
+      *(WORD *)buff = (WORD)info.LogBlockSize;
+      return RES_OK;
+    case GET_BLOCK_SIZE:
+      *(DWORD *)buff = info.LogBlockSize / SD_EMU_SECTOR_SIZE;
+      return RES_OK;
+    default:
+      return RES_PARERR;
+  }
+}
+#endif
+
+const Diskio_drvTypeDef SD_Driver = {
+  SD_Emu_DiskInitialize,
+  SD_Emu_DiskStatus,
+  SD_Emu_DiskRead,
+#if _USE_WRITE == 1
+  SD_Emu_DiskWrite,
+#endif
+#if _USE_IOCTL == 1
+  SD_Emu_DiskIoctl,
+#endif
+};
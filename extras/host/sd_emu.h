@@ -0,0 +1,104 @@
+/**
+  ******************************************************************************
+  * @file    sd_emu.h
+  * @brief   File-backed SD card emulator for host builds: BSP SD functions
+  *          and FatFs SD driver working on a disk image, with a timing model
+  ******************************************************************************
+  */
+#ifndef __SD_EMU_H
+#define __SD_EMU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "bsp_sd.h"
+
+/* Card timing model, times in us. The emulated clock (SD_Emu_Time(), used
+   by millis() and micros()) is the host time plus the modeled card time. */
+typedef struct {
+  uint32_t cmd_latency;    /* Each command, up to the first data block */
+  uint32_t read_sector;    /* Transfer of one sector read */
+  uint32_t write_sector;   /* Transfer of one sector written */
+  uint32_t program;        /* Card busy after each write command */
+  uint32_t program_sector; /* Card busy for each sector written */
+  uint32_t erase;          /* Card busy after each erase command */
+  uint32_t au_sectors;     /* Allocation unit size in sectors, 0: no stalls */
+  uint32_t gc_period;      /* Writes moving to another AU before a stall */
+  uint32_t gc_stall;       /* Garbage collection stall, card busy */
+  uint8_t realtime;        /* Sleep for the modeled time instead of adding it */
+} SD_EmuTiming_t;
+
+/* Fault injection */
+#define SD_EMU_FAULT_CRC       1 /* Data CRC error, nothing written */
+#define SD_EMU_FAULT_TIMEOUT   2 /* Data timeout after param us, nothing written */
+#define SD_EMU_FAULT_BUSY      3 /* Card busy for param us more, no error */
+#define SD_EMU_FAULT_TORN      4 /* param sectors and half the next one written */
+#define SD_EMU_FAULT_REMOVAL   5 /* Card removed before the command */
+
+#define SD_EMU_OP_READ         0x01
+#define SD_EMU_OP_WRITE        0x02
+#define SD_EMU_OP_ERASE        0x04
+
+/* Maximum number of faults of a card */
+#ifndef SD_EMU_MAX_FAULTS
+  #define SD_EMU_MAX_FAULTS    8
+#endif
+
+/* Size of the card volatile write cache in sectors */
+#ifndef SD_EMU_CACHE_SECTORS
+  #define SD_EMU_CACHE_SECTORS 2048
+#endif
+
+/* A fault injected on commands of the given operations, when they access the
+   given sectors or with the given probability */
+typedef struct {
+  uint8_t type;            /* SD_EMU_FAULT_* */
+  uint8_t ops;             /* Mask of SD_EMU_OP_* */
+  uint32_t sector;         /* First sector */
+  uint32_t sectors;        /* Number of sectors, 0: any sector */
+  uint32_t probability;    /* Per matching command, in 1/65536, 0: always */
+  uint32_t count;          /* Number of injections, 0: unlimited */
+  uint32_t param;          /* See SD_EMU_FAULT_* */
+} SD_EmuFault_t;
+
+/* Counters of an emulated card */
+typedef struct {
+  uint32_t commands;
+  uint32_t read_cmds;
+  uint32_t write_cmds;
+  uint64_t sectors_read;
+  uint64_t sectors_written;
+  uint32_t gc_stalls;
+  uint32_t faults;         /* Faults injected */
+  uint64_t busy_us;        /* Modeled card time */
+} SD_EmuStats_t;
+
+/* Default timing: a class 10 card at 25 MHz, 4 MB AU */
+extern const SD_EmuTiming_t SD_EmuDefaultTiming;
+
+/* Open (or create with the given size in sectors if not 0) the image of a
+   device, the card is then inserted */
+int SD_Emu_Open(uint8_t device, const char *path, uint32_t sectors);
+void SD_Emu_Close(uint8_t device);
+void SD_Emu_SetTiming(uint8_t device, const SD_EmuTiming_t *timing);
+void SD_Emu_GetStats(uint8_t device, SD_EmuStats_t *stats);
+void SD_Emu_ResetStats(uint8_t device);
+/* Card removal and insertion, calling the detect interrupt callback */
+void SD_Emu_Insert(uint8_t device, uint8_t present);
+/* Add a fault to a card, return its index or -1 if full */
+int SD_Emu_AddFault(uint8_t device, const SD_EmuFault_t *fault);
+void SD_Emu_ClearFaults(uint8_t device);
+/* Seed of the random faults, the same seed giving the same faults */
+void SD_Emu_Seed(uint32_t seed);
+/* Emulated clock in us */
+uint64_t SD_Emu_Time(void);
+/* Advance the emulated clock, e.g. for modeled CPU time */
+void SD_Emu_Delay(uint64_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SD_EMU_H */
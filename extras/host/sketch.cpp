@@ -0,0 +1,32 @@
+/*
+  Host harness: run a sketch of the library on an emulated card, e.g. the
+  Benchmark example built with "-x c++ examples/Benchmark/Benchmark.ino".
+  setup() is called once, then loop() the given number of times.
+
+  Usage: sketch <image> [loops]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "sd_emu.h"
+
+void setup(void);
+void loop(void);
+
+int main(int argc, char **argv)
+{
+  const char *image = (argc > 1) ? argv[1] : "card.img";
+  long loops = (argc > 2) ? atol(argv[2]) : 1;
+
+  if (SD_Emu_Open(0, image, 0) != 0) {
+    fprintf(stderr, "Cannot open %s\n", image);
+    return 1;
+  }
+  setup();
+  while (loops-- > 0) {
+    loop();
+  }
+  Serial.flush();
+  SD_Emu_Close(0);
+  return 0;
+}
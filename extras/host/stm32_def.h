@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file    stm32_def.h
+  * @brief   Host build: HAL definitions used by the library
+  ******************************************************************************
+  */
+#ifndef _STM32_DEF_
+#define _STM32_DEF_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Core above the versions checked by the library, no SDMMC instance, the
+   SD module being the card emulator */
+#define STM32_CORE_VERSION  0x02070000
+#define HAL_SD_MODULE_ENABLED
+
+#ifndef __weak
+  #define __weak __attribute__((weak))
+#endif
+#ifndef UNUSED
+  #define UNUSED(x) ((void)(x))
+#endif
+#define __IO volatile
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  HAL_OK = 0x00U,
+  HAL_ERROR = 0x01U,
+  HAL_BUSY = 0x02U,
+  HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef struct {
+  uint32_t MODER;
+} GPIO_TypeDef;
+
+typedef struct {
+  uint32_t CardType;
+  uint32_t CardVersion;
+  uint32_t Class;
+  uint32_t RelCardAdd;
+  uint32_t BlockNbr;
+  uint32_t BlockSize;
+  uint32_t LogBlockNbr;
+  uint32_t LogBlockSize;
+  uint32_t CardSpeed;
+} HAL_SD_CardInfoTypeDef;
+
+typedef struct {
+  HAL_SD_CardInfoTypeDef SdCard;
+  uint32_t ErrorCode;
+} SD_HandleTypeDef;
+
+#define CARD_SDSC                        0x00000000U
+#define CARD_SDHC_SDXC                   0x00000001U
+#define CARD_SECURED                     0x00000003U
+#define CARD_V1_X                        0x00000000U
+#define CARD_V2_X                        0x00000001U
+
+#define HAL_SD_ERROR_NONE                0x00000000U
+#define HAL_SD_ERROR_DATA_CRC_FAIL       0x00000002U
+#define HAL_SD_ERROR_DATA_TIMEOUT        0x00000008U
+#define HAL_SD_ERROR_TX_UNDERRUN         0x00000010U
+#define HAL_SD_ERROR_ADDR_OUT_OF_RANGE   0x00000080U
+#define HAL_SD_ERROR_TIMEOUT             0x80000000U
+
+uint32_t HAL_GetTick(void);
+void Error_Handler(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _STM32_DEF_ */
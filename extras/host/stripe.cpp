@@ -0,0 +1,216 @@
+/*
+  Host test of a striped volume (RAID-0) on two emulated cards: stripe k of
+  the volume is on card k % 2 at block (k / 2) * stripe, and a write fault
+  or a removal of a card makes the volume operations fail without damaging
+  the volume, checked by remounting it.
+
+  The FAT volume is given as an image (e.g. made by mkfs.vfat): it is split
+  on both cards, then joined back at the end, to be checked by
+  "fsck.vfat -n <volume>". Built with -DSD_MAX_DEVICES=2.
+
+  Usage: stripe <volume> <image0> <image1> [stripe sectors]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "STM32SD.h"
+#include "sd_emu.h"
+
+#define TEST_FILE "stripe.bin"
+#define TEST_SIZE (1024UL * 1024UL)
+#define CHUNK_SECTORS 64
+
+static uint32_t buffer[CHUNK_SECTORS * SD_BLOCK_SIZE / 4];
+static uint32_t check[CHUNK_SECTORS * SD_BLOCK_SIZE / 4];
+static int failures;
+
+static void fail(const char *what)
+{
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+/* Fill blocks with a pattern identifying each block */
+static void stamp(uint32_t *buf, uint32_t block, uint32_t count)
+{
+  for (uint32_t i = 0; i < count * (SD_BLOCK_SIZE / 4); i++) {
+    buf[i] = (block + (i / (SD_BLOCK_SIZE / 4))) ^ ((i % (SD_BLOCK_SIZE / 4)) * 0x9E3779B9UL);
+  }
+}
+
+/* Write a pattern on the first stripes through the striped device, starting
+   and ending in the middle of a stripe, then read it from each card */
+static void testLayout(SdStripeDevice *stripe, Sd2Card *card[2], uint32_t sectors)
+{
+  uint32_t start = sectors / 2;
+  uint32_t end = start + (9 * sectors);
+
+  for (uint32_t block = start; block < end; block += CHUNK_SECTORS) {
+    uint32_t n = ((end - block) < CHUNK_SECTORS) ? (end - block) : CHUNK_SECTORS;
+    stamp(buffer, block, n);
+    if (!stripe->writeBlocks((uint8_t *)buffer, block, n)) {
+      fail("striped write");
+      return;
+    }
+  }
+  if (!stripe->syncBlocks()) {
+    fail("striped sync");
+  }
+  for (uint32_t block = start; block < end; block++) {
+    uint32_t k = block / sectors;
+    stamp(buffer, block, 1);
+    if (!card[k % 2]->readBlocks((uint8_t *)check, ((k / 2) * sectors) + (block % sectors), 1) ||
+        (memcmp(buffer, check, SD_BLOCK_SIZE) != 0)) {
+      printf("block %u of stripe %u not on card %u\n", (unsigned)block, (unsigned)k,
+             (unsigned)(k % 2));
+      fail("stripe layout");
+      return;
+    }
+  }
+  for (uint32_t block = start; (block + 3) <= end; block += 7) {
+    stamp(buffer, block, 3);
+    if (!stripe->readBlocks((uint8_t *)check, block, 3) ||
+        (memcmp(buffer, check, 3 * SD_BLOCK_SIZE) != 0)) {
+      fail("striped read");
+      return;
+    }
+  }
+}
+
+/* Copy the volume image to the striped device or back */
+static bool copyVolume(SdStripeDevice *stripe, FILE *volume, uint32_t count, bool split)
+{
+  fseek(volume, 0, SEEK_SET);
+  for (uint32_t block = 0; block < count; block += CHUNK_SECTORS) {
+    uint32_t n = ((count - block) < CHUNK_SECTORS) ? (count - block) : CHUNK_SECTORS;
+    if (split) {
+      if ((fread(buffer, SD_BLOCK_SIZE, n, volume) != n) ||
+          !stripe->writeBlocks((uint8_t *)buffer, block, n)) {
+        return false;
+      }
+    } else if (!stripe->readBlocks((uint8_t *)buffer, block, n) ||
+               (fwrite(buffer, SD_BLOCK_SIZE, n, volume) != n)) {
+      return false;
+    }
+  }
+  return stripe->syncBlocks();
+}
+
+/* Check the content of the test file */
+static bool checkFile(void)
+{
+  File file = SD.open(TEST_FILE);
+  uint32_t pos = 0;
+
+  if (!file) {
+    return false;
+  }
+  while (pos < TEST_SIZE) {
+    stamp(buffer, pos / SD_BLOCK_SIZE, CHUNK_SECTORS);
+    if (file.read(check, sizeof(check)) != (int)sizeof(check) ||
+        (memcmp(buffer, check, sizeof(check)) != 0)) {
+      break;
+    }
+    pos += sizeof(check);
+  }
+  file.close();
+  return pos == TEST_SIZE;
+}
+
+/* Write a file while a fault is injected on the second card: a write has to
+   fail, then the volume is remounted and the test file checked */
+static void testFault(const SD_EmuFault_t *fault, const char *what)
+{
+  File file = SD.open("fault.bin", FILE_WRITE);
+  bool failed = !file;
+
+  SD_Emu_AddFault(1, fault);
+  for (uint32_t pos = 0; !failed && (pos < TEST_SIZE); pos += sizeof(buffer)) {
+    stamp(buffer, pos / SD_BLOCK_SIZE, CHUNK_SECTORS);
+    failed = file.write((const uint8_t *)buffer, sizeof(buffer)) != sizeof(buffer);
+  }
+  if (file) {
+    file.close();
+  }
+  SD_Emu_ClearFaults(1);
+  SD_Emu_Insert(1, 1);
+  if (!failed) {
+    fail(what);
+  }
+  SD.end();
+  if (!SD.begin()) {
+    fail("remount");
+  } else if (!checkFile()) {
+    fail("test file after a fault");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t sectors = (argc > 4) ? atoi(argv[4]) : SD_STRIPE_SECTORS;
+  Sd2Card card0(0), card1(1);
+  Sd2Card *card[2] = { &card0, &card1 };
+  SdStripeDevice stripe(&card0, &card1, sectors);
+  uint32_t count, cardSectors;
+  FILE *volume;
+
+  if ((argc < 4) || (sectors == 0)) {
+    fprintf(stderr, "Usage: stripe <volume> <image0> <image1> [stripe sectors]\n");
+    return 1;
+  }
+  volume = fopen(argv[1], "r+b");
+  if (volume == NULL) {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  fseek(volume, 0, SEEK_END);
+  count = ftell(volume) / SD_BLOCK_SIZE;
+  /* Whole stripes on each card */
+  cardSectors = ((count + (2 * sectors) - 1) / (2 * sectors)) * sectors;
+  if ((SD_Emu_Open(0, argv[2], cardSectors) != 0) || (SD_Emu_Open(1, argv[3], cardSectors) != 0)) {
+    fprintf(stderr, "Cannot open the card images\n");
+    return 1;
+  }
+  if (!stripe.initialize() || (stripe.blockCount() < count)) {
+    fprintf(stderr, "Cannot initialize the cards\n");
+    return 1;
+  }
+
+  testLayout(&stripe, card, sectors);
+  if (!copyVolume(&stripe, volume, count, true)) {
+    fprintf(stderr, "Cannot split %s\n", argv[1]);
+    return 1;
+  }
+  card0.deinit();
+  card1.deinit();
+
+  SD.setStripe(&card1, sectors);
+  if (!SD.begin()) {
+    fprintf(stderr, "No FAT volume on %s\n", argv[1]);
+    return 1;
+  }
+  File file = SD.open(TEST_FILE, FILE_WRITE);
+  for (uint32_t pos = 0; file && (pos < TEST_SIZE); pos += sizeof(buffer)) {
+    stamp(buffer, pos / SD_BLOCK_SIZE, CHUNK_SECTORS);
+    file.write((const uint8_t *)buffer, sizeof(buffer));
+  }
+  file.close();
+  if (!checkFile()) {
+    fail("test file");
+  }
+
+  SD_EmuFault_t crc = { SD_EMU_FAULT_CRC, SD_EMU_OP_WRITE, 0, 0, 0, 0, 0 };
+  testFault(&crc, "write with CRC errors on a card");
+  SD_EmuFault_t removal = { SD_EMU_FAULT_REMOVAL, SD_EMU_OP_WRITE, 0, 0, 0, 1, 0 };
+  testFault(&removal, "write with a card removed");
+
+  SD.remove("fault.bin");
+  SD.end();
+  if (!stripe.initialize() || !copyVolume(&stripe, volume, count, false)) {
+    fail("join of the volume");
+  }
+  fclose(volume);
+  SD_Emu_Close(0);
+  SD_Emu_Close(1);
+  printf("%s, check the volume with fsck.vfat -n %s\n", failures ? "FAILED" : "passed", argv[1]);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+/**
+  ******************************************************************************
+  * @file    variant.h
+  * @brief   Host build: board definitions
+  ******************************************************************************
+  */
+#ifndef _VARIANT_HOST_
+#define _VARIANT_HOST_
+
+#define NUM_DIGITAL_PINS  64
+#define PNUM_NOT_DEFINED  NUM_DIGITAL_PINS
+
+#endif /* _VARIANT_HOST_ */
@@ -0,0 +1,13 @@
+/**
+  ******************************************************************************
+  * @file    wiring_constants.h
+  * @brief   Host build: Arduino constants
+  ******************************************************************************
+  */
+#ifndef _WIRING_CONSTANTS_
+#define _WIRING_CONSTANTS_
+
+#define LOW   0x0
+#define HIGH  0x1
+
+#endif /* _WIRING_CONSTANTS_ */
@@ -24,6 +24,7 @@
 
    * Calls to `open` can supply a full path name including parent
      directories which simplifies interacting with files in subdirectories.
+     Relative paths are resolved from the directory set by `chdir`.
 
    * Utility methods are provided to determine whether a file exists
      and to create a directory hierarchy.
@@ -34,16 +35,15 @@
 
   Implementation Notes
 
-  In order to handle multi-directory path traversal, functionality that
-  requires this ability is implemented as callback functions.
+  Multi-directory path traversal is done by FatFs. To avoid walking the
+  parent chain from the root directory at each call, `SdFatFs` caches the
+  start cluster of recently used directories: `lookup` sets the FatFs current
+  directory to the cached parent and only the last path component is
+  resolved.
 
-  Individual methods call the `walkPath` function which performs the actual
-  directory traversal (swapping between two different directory/file handles
-  along the way) and at each level calls the supplied callback function.
-
-  Some types of functionality will take an action at each level (e.g. exists
-  or make directory) which others will only take an action at the bottom
-  level (e.g. open).
+  Some types of functionality will take an action at each level (e.g. make
+  directory hierarchy, `SdFatFs::mkdir`) which others will only take an
+  action at the bottom level (e.g. open).
 
  */
 
@@ -56,6 +56,52 @@ extern "C" {
 #include "STM32SD.h"
 SDClass SD;
 
+/* f_sync() of a file, timed in the latency histograms and counted in the
+   I/O counters */
+static inline FRESULT syncFile(File *file)
+{
+  FRESULT res;
+#if SD_LATENCY_STATS
+  uint32_t start = micros();
+#endif
+#if SD_IO_STATS
+  file->volume()->fatFs()->ioBegin(&file->_stats);
+#endif
+  res = f_sync(file->_fil);
+#if SD_IO_STATS
+  file->volume()->fatFs()->ioEnd(SD_IO_SYNC, 0);
+#endif
+#if SD_LATENCY_STATS
+  BSP_SD_LatencyRecord(SD_LATENCY_SYNC, 0, micros() - start);
+#endif
+  return res;
+}
+
+SDClass *SDClass::_devices[SD_MAX_DEVICES] = {};
+void (*const SDClass::_detectIRQ[SD_MAX_DEVICES])(void) = {
+  [](void) {
+    detectIRQ(0);
+  },
+#if SD_MAX_DEVICES > 1
+  [](void) {
+    detectIRQ(1);
+  },
+#endif
+};
+
+/**
+  * @brief  Constructor
+  * @param  device: BSP SD device index (default 0), each device uses its
+  *         own SDMMC instance, pins and FatFs volume
+  */
+SDClass::SDClass(uint8_t device) : _card(device), _fatFs(&_card)
+{
+  /* An invalid index gives a card which can't be initialized */
+  if (_card.device() < SD_MAX_DEVICES) {
+    _devices[_card.device()] = this;
+  }
+}
+
 /**
   * @brief  Link SD, register the file system object to the FatFs mode and configure
   *         relatives SD IOs including SD Detect Pin and level if any
@@ -67,12 +113,163 @@ bool SDClass::begin(uint32_t detect, uint32_t level)
 {
   bool status = false;
   /*##-1- Initializes SD IOs #############################################*/
-  if (_card.init(detect, level)) {
+  if (((_blockDev != NULL) || _card.init(detect, level)) && initDevice()) {
     status = _fatFs.init();
   }
+  _beginStep = status ? SD_INIT_DONE : SD_INIT_IDLE;
+  armDetect(detect, level);
   return status;
 }
 
+/**
+  * @brief  Start the SD initialization without blocking. poll() has to be
+  *         called from loop() until it does not return 1, before any other
+  *         SD access.
+  * @param  detect: detect pin number (default SD_DETECT_NONE)
+  * @param  level: detect pin level (default SD_DETECT_LEVEL)
+  * @retval true if started, false on error
+  */
+bool SDClass::beginAsync(uint32_t detect, uint32_t level)
+{
+  _beginStep = SD_INIT_IDLE;
+  if (_blockDev != NULL) {
+    /* Initialized by the block device at mount */
+    _beginStep = SD_INIT_MOUNT;
+    return true;
+  }
+  if (!_card.initStart(detect, level)) {
+    armDetect(detect, level);
+    return false;
+  }
+  armDetect(detect, level);
+  _notify = _hotPlug;
+  _beginStep = _card.initStep();
+  if (_beginStep == SD_INIT_DONE) {
+    /* Card already initialized, get its info and mount */
+    _beginStep = SD_INIT_IDENTIFY;
+  }
+  return true;
+}
+
+/**
+  * @brief  Run the next step of the initialization started by beginAsync():
+  *         card power up, card ready wait, identification and volume mount.
+  *         Not to be called from an interrupt: the mount and the hot-plug
+  *         handling run blocking FatFs and card operations.
+  * @retval 1 while in progress, 0 once done, -1 on error
+  *         (see card()->errorCode() for card errors)
+  */
+int SDClass::poll(void)
+{
+  int res = -1;
+  if (_hotPlug && _detectPending && ((millis() - _detectTick) >= SD_DETECT_DEBOUNCE)) {
+    cardDetect();
+  }
+  switch (_beginStep) {
+    case SD_INIT_DONE:
+      if (_mirror.resyncing()) {
+        _mirror.resyncStep();
+      }
+      if (_fatFs.scanning()) {
+        /* Free clusters map started at mount */
+        _fatFs.freeScan();
+      }
+      res = 0;
+      break;
+    case SD_INIT_MOUNT:
+      if (initDevice() && _fatFs.init()) {
+        _beginStep = SD_INIT_DONE;
+        res = 0;
+        if (_notify && (_detectCallback != NULL)) {
+          _detectCallback(true);
+        }
+        _notify = false;
+      } else {
+        _beginStep = SD_INIT_IDLE;
+      }
+      break;
+    case SD_INIT_IDLE:
+      break;
+    default:
+      res = _card.initPoll();
+      if (res == 0) {
+        /* Mount on next call */
+        _beginStep = SD_INIT_MOUNT;
+        res = 1;
+      } else if (res > 0) {
+        _beginStep = _card.initStep();
+      } else {
+        _beginStep = SD_INIT_IDLE;
+      }
+      break;
+  }
+  return res;
+}
+
+/**
+  * @brief  Enable the detect pin interrupt if hot-plug is enabled
+  * @param  detect: detect pin number
+  * @param  level: detect pin level
+  */
+void SDClass::armDetect(uint32_t detect, uint32_t level)
+{
+  if (!_hotPlug || (detect == SD_DETECT_NONE) || (_card.device() >= SD_MAX_DEVICES)) {
+    return;
+  }
+  _detect = detect;
+  _level = level;
+  _detectPending = false;
+  if (_card.attachDetect(_detectIRQ[_card.device()])) {
+    _present = _card.isDetected();
+  }
+}
+
+/**
+  * @brief  Detect pin interrupt: the card change is handled by poll() once
+  *         the pin is stable for SD_DETECT_DEBOUNCE ms
+  */
+void SDClass::detectIRQ(uint8_t device)
+{
+  SDClass *sd = _devices[device];
+  if (sd != NULL) {
+    sd->_detectTick = millis();
+    sd->_detectPending = true;
+  }
+}
+
+/**
+  * @brief  Handle a card removal or insertion. On removal, the buffered
+  *         writes are dropped and the volume unmounted, so open files become
+  *         invalid (their operations fail). On insertion, the card is
+  *         initialized and mounted by next poll() calls.
+  */
+void SDClass::cardDetect(void)
+{
+  bool present;
+
+  _detectPending = false;
+  present = _card.isDetected();
+  if (present == _present) {
+    return;
+  }
+  _present = present;
+  if (!present) {
+    _notify = false;
+    _beginStep = SD_INIT_IDLE;
+    _fatFs.discard();
+    _fatFs.deinit();
+    _card.deinit();
+    if (_pairCard != NULL) {
+      _pairCard->deinit();
+    }
+    if (_detectCallback != NULL) {
+      _detectCallback(false);
+    }
+  } else {
+    beginAsync(_detect, _level);
+  }
+}
+
 /**
   * @brief  UnLink SD, unregister the file system object and unconfigure
   *         relatives SD IOs including SD Detect Pin and level if any
@@ -82,12 +279,68 @@ bool SDClass::end(void)
 {
   bool status = false;
   /*##-1- DeInitializes SD IOs ###########################################*/
-  if (_fatFs.deinit()) {
-    status = _card.deinit();
+  _beginStep = SD_INIT_IDLE;
+  if (_hotPlug) {
+    _card.attachDetect(NULL);
+    _present = false;
+    _detectPending = false;
+  }
+  /* A failed write of the buffered sectors fails the end, the cards are
+     still deinitialized */
+  status = _fatFs.deinit();
+  status = _card.deinit() && status;
+  if (_pairCard != NULL) {
+    status = _pairCard->deinit() && status;
   }
   return status;
 }
 
+/**
+  * @brief  Set the block device of the volume: the card, the block device
+  *         given to setBlockDevice() or both cards of a striped or mirrored
+  *         volume, the second card being initialized.
+  * @retval true on success. A mirrored volume runs with one card, the other
+  *         one being left out.
+  */
+bool SDClass::initDevice(void)
+{
+  if (_blockDev != NULL) {
+    _fatFs.setDevice(_blockDev);
+    return true;
+  }
+  if (_pairCard == NULL) {
+    _fatFs.setDevice(&_card);
+    return true;
+  }
+  if (_pairMirror) {
+    _mirror.setDevices(&_card, _pairCard);
+    _fatFs.setDevice(&_mirror);
+    _pairCard->init();
+    return true;
+  }
+  _stripe.setDevices(&_card, _pairCard, _stripeSectors);
+  _fatFs.setDevice(&_stripe);
+  return _pairCard->init();
+}
+
+/**
+  * @brief  Resynchronize a card of a mirrored volume, e.g. once replaced.
+  *         The card is initialized again, then poll() copies it from the
+  *         other card by SD_RESYNC_STEP sectors while the volume is used.
+  * @param  card: card of this SD or the one given to setMirror()
+  * @retval true if started
+  */
+bool SDClass::resync(Sd2Card *card)
+{
+  if (!_pairMirror || (_beginStep != SD_INIT_DONE) ||
+      ((card != &_card) && (card != _pairCard))) {
+    return false;
+  }
+  _mirror.resyncAbort();
+  card->deinit();
+  return _mirror.resyncStart(card);
+}
+
 /**
   * @brief  Check if a file or folder exist on the SD disk
   * @param  filename: File name
@@ -96,31 +349,91 @@ bool SDClass::end(void)
 bool SDClass::exists(const char *filepath)
 {
   FILINFO fno;
-
-  return (f_stat(filepath, &fno) != FR_OK) ? false : true;
+  FRESULT res = f_stat(_fatFs.lookup(filepath), &fno);
+  _fatFs.release();
+  return (res != FR_OK) ? false : true;
 }
 
 /**
-  * @brief  Create directory on the SD disk
+  * @brief  Create directory on the SD disk, including missing parents
   * @param  filename: File name
   * @retval true if created or existing else false
   */
 bool SDClass::mkdir(const char *filepath)
 {
-  FRESULT res = f_mkdir(filepath);
+  FRESULT res = _fatFs.mkdir(filepath);
   return ((res != FR_OK) && (res != FR_EXIST)) ? false : true;
 }
 
 /**
   * @brief  Remove directory on the SD disk
   * @param  filename: File name
+  * @param  recursive: remove also the directory content
   * @retval true or false
   */
-bool SDClass::rmdir(const char *filepath)
+bool SDClass::rmdir(const char *filepath, bool recursive)
 {
-  return (f_unlink(filepath) != FR_OK) ? false : true;
+  FRESULT res = FR_OK;
+#if SD_FS_RPATH
+  if (recursive) {
+    if (rmdirStart(filepath)) {
+      int status;
+      do {
+        status = rmdirStep(SD_RMDIR_STEP);
+      } while (status > 0);
+      return (status == 0) ? true : false;
+    }
+  }
+#else
+  UNUSED(recursive);
+#endif
+  res = f_unlink(_fatFs.lookup(filepath));
+  _fatFs.release();
+  if (res == FR_OK) {
+    _fatFs.invalidate(filepath);
+  }
+  return (res != FR_OK) ? false : true;
 }
 
+#if SD_FS_RPATH
+/**
+  * @brief  Start the removal of a directory and all its content. The removal
+  *         is then done by calling rmdirStep() until it does not return 1,
+  *         so it can be interleaved with other work.
+  * @param  dirpath: Directory path
+  * @retval true if the directory is opened else false
+  */
+bool SDClass::rmdirStart(const char *dirpath)
+{
+  return (_fatFs.removeStart(dirpath) != FR_OK) ? false : true;
+}
+
+/**
+  * @brief  Run a part of the removal started by rmdirStart()
+  * @param  count: maximum number of directory entries to process
+  * @retval 1 if in progress, 0 once the directory is removed, -1 on error
+  */
+int SDClass::rmdirStep(uint32_t count)
+{
+  bool done = false;
+  if (_fatFs.removeStep(count, &done) != FR_OK) {
+    return -1;
+  }
+  return done ? 0 : 1;
+}
+
+/**
+  * @brief  Change the current directory used to resolve relative paths
+  * @param  dirpath: Directory path
+  * @retval true or false
+  */
+bool SDClass::chdir(const char *dirpath)
+{
+  _fatFs.select();
+  return (f_chdir(dirpath) != FR_OK) ? false : true;
+}
+#endif
+
 /**
   * @brief  Open a file on the SD disk, if not existing it's created
   * @param  filename: File name
@@ -130,6 +443,7 @@ bool SDClass::rmdir(const char *filepath)
 File SDClass::open(const char *filepath, uint8_t mode /* = FA_READ */)
 {
   File file = File();
+  file._sd = this;
 
   file._name = (char *)malloc(strlen(filepath) + 1);
   if (file._name == NULL) {
@@ -150,20 +464,22 @@ File SDClass::open(const char *filepath, uint8_t mode /* = FA_READ */)
   file._dir.fs = 0;
 #endif
 
-  if ((mode == FILE_WRITE) && (!SD.exists(filepath))) {
+  if ((mode == FILE_WRITE) && (!exists(filepath))) {
     mode = mode | FA_CREATE_ALWAYS;
   }
 
-  file._res = f_open(file._fil, filepath, mode);
+  const TCHAR *path = _fatFs.lookup(filepath);
+  file._res = f_open(file._fil, path, mode);
   if (file._res != FR_OK) {
     free(file._fil);
     file._fil = NULL;
-    file._res = f_opendir(&file._dir, filepath);
+    file._res = f_opendir(&file._dir, path);
     if (file._res != FR_OK) {
       free(file._name);
       file._name = NULL;
     }
   }
+  _fatFs.release();
   return file;
 }
 
@@ -174,9 +490,74 @@ File SDClass::open(const char *filepath, uint8_t mode /* = FA_READ */)
   */
 bool SDClass::remove(const char *filepath)
 {
-  return (f_unlink(filepath) != FR_OK) ? false : true;
+  FRESULT res = f_unlink(_fatFs.lookup(filepath));
+  _fatFs.release();
+  if (res == FR_OK) {
+    _fatFs.invalidate(filepath);
+  }
+  return (res != FR_OK) ? false : true;
 }
 
+/**
+  * @brief  Get the sizes and alignments for the fastest transfers: reads and
+  *         writes of clusters at cluster aligned file offsets are done by
+  *         FatFs directly from or to the buffer, without copy
+  * @param  hints: sizes and alignments in bytes
+  * @retval true if the volume is mounted
+  */
+bool SDClass::ioHints(SdIoHints *hints)
+{
+  SdCardFeatures features;
+  uint32_t csize = _fatFs.blocksPerCluster();
+
+  if (csize == 0) {
+    return false;
+  }
+  hints->sectorSize = SD_BLOCK_SIZE;
+  hints->clusterSize = csize * SD_BLOCK_SIZE;
+  hints->auSize = 0;
+  hints->auOffset = 0;
+  hints->bufferAlign = SD_BUFFER_ALIGN;
+  if (_card.features(&features) && (features.auSectors != 0)) {
+    hints->auSize = features.auSectors * SD_BLOCK_SIZE;
+    hints->auOffset = (_fatFs.dataStart() % features.auSectors) * SD_BLOCK_SIZE;
+  }
+  return true;
+}
+
+#if SD_TRACE_SIZE > 0
+/**
+  * @brief  Stop the block I/O trace and save its records in a CSV file, one
+  *         "op,device,sector,count,start,end,failed" line per record, times
+  *         in us. Records are kept so they can be saved on another volume.
+  * @param  filepath: File path, overwritten
+  * @retval true or false
+  */
+bool SDClass::traceSave(const char *filepath)
+{
+  SD_TraceRecord_t record;
+  char line[64];
+  bool ok;
+  File file;
+
+  BSP_SD_TraceStop();
+  file = open(filepath, FA_WRITE | FA_CREATE_ALWAYS);
+  if (!file) {
+    return false;
+  }
+  ok = (file.print("op,device,sector,count,start,end,failed\n") > 0);
+  for (uint32_t i = 0; ok && BSP_SD_TraceGet(i, &record); i++) {
+    int len = snprintf(line, sizeof(line), "%c,%u,%" PRIu32 ",%u,%" PRIu32 ",%" PRIu32 ",%u\n",
+                       (char)record.op, (unsigned)(record.device & ~SD_TRACE_FAILED),
+                       record.sector, (unsigned)record.count, record.start, record.end,
+                       (record.device & SD_TRACE_FAILED) ? 1U : 0U);
+    ok = (file.write(line, (size_t)len) == (size_t)len);
+  }
+  file.close();
+  return ok;
+}
+#endif
+
 File SDClass::openRoot(void)
 {
   return open(_fatFs.getRoot());
@@ -189,6 +570,15 @@ File::File(FRESULT result /* = FR_OK */)
   _res = result;
 }
 
+/**
+  * @brief  Get the SD volume of the file
+  * @retval SDClass object which opened the file (SD by default)
+  */
+SDClass *File::volume(void)
+{
+  return (_sd != NULL) ? _sd : &SD;
+}
+
 /** List directory contents to Serial.
  *
  * \param[in] flags The inclusive OR of
@@ -258,7 +648,7 @@ void File::ls(uint8_t flags, uint8_t indent)
         fullPath = (char *)malloc(strlen(_name) + 1 + strlen(fn) + 1);
         if (fullPath != NULL) {
           sprintf(fullPath, "%s/%s", _name, fn);
-          File filtmp = SD.open(fullPath);
+          File filtmp = volume()->open(fullPath);
 
           if (filtmp) {
             Serial.println();
@@ -328,9 +718,8 @@ void File::printTwoDigits(uint8_t v)
   */
 int File::read()
 {
-  UINT byteread;
   int8_t data;
-  return (f_read(_fil, (void *)&data, 1, (UINT *)&byteread) == FR_OK) ? data : -1;
+  return (read(&data, 1) >= 0) ? data : -1;
 }
 
 /**
@@ -341,8 +730,19 @@ int File::read()
   */
 int File::read(void *buf, size_t len)
 {
-  UINT bytesread;
-  return (f_read(_fil, buf, len, (UINT *)&bytesread) == FR_OK) ? bytesread : -1;
+  SD_PROBE_SCOPE(SD_PROBE_FILE_READ);
+  UINT bytesread = 0;
+  FRESULT res;
+#if SD_IO_STATS
+  volume()->_fatFs.ioBegin(&_stats);
+#endif
+  SD_PROBE_START(SD_PROBE_F_READ);
+  res = f_read(_fil, buf, len, (UINT *)&bytesread);
+  SD_PROBE_STOP(SD_PROBE_F_READ);
+#if SD_IO_STATS
+  volume()->_fatFs.ioEnd(SD_IO_READ, bytesread);
+#endif
+  return (res == FR_OK) ? bytesread : -1;
 }
 
 /**
@@ -361,7 +761,7 @@ void File::close()
       if (_fil->fs != 0) {
 #endif
         /* Flush the file before close */
-        f_sync(_fil);
+        syncFile(this);
 
         /* Close the file */
         f_close(_fil);
@@ -391,7 +791,7 @@ void File::close()
   */
 void File::flush()
 {
-  f_sync(_fil);
+  syncFile(this);
 }
 
 /**
@@ -419,6 +819,28 @@ uint32_t File::position()
   return filepos;
 }
 
+/**
+  * @brief  Get the size of the next read or write for the fastest transfers:
+  *         up to the next cluster boundary, then whole clusters
+  * @param  None
+  * @retval size in bytes, 0 if the file is not opened
+  */
+uint32_t File::ioSize(void)
+{
+#if (_FATFS == 68300) || (_FATFS == 80286)
+  FATFS *fs = (_fil != NULL) ? _fil->obj.fs : NULL;
+#else
+  FATFS *fs = (_fil != NULL) ? _fil->fs : NULL;
+#endif
+  uint32_t cluster;
+
+  if (fs == NULL) {
+    return 0;
+  }
+  cluster = (uint32_t)fs->csize * SD_BLOCK_SIZE;
+  return cluster - (f_tell(_fil) % cluster);
+}
+
 /**
   * @brief  Seek to a new position in the file
   * @param  pos: The position to which to seek
@@ -472,8 +894,18 @@ size_t File::write(uint8_t data)
   */
 size_t File::write(const char *buf, size_t size)
 {
-  size_t byteswritten;
-  f_write(_fil, (const void *)buf, size, (UINT *)&byteswritten);
+  SD_PROBE_SCOPE(SD_PROBE_FILE_WRITE);
+  UINT byteswritten = 0;
+  volume()->_fatFs.allocHint();
+#if SD_IO_STATS
+  volume()->_fatFs.ioBegin(&_stats);
+#endif
+  SD_PROBE_START(SD_PROBE_F_WRITE);
+  f_write(_fil, (const void *)buf, size, &byteswritten);
+  SD_PROBE_STOP(SD_PROBE_F_WRITE);
+#if SD_IO_STATS
+  volume()->_fatFs.ioEnd(SD_IO_WRITE, byteswritten);
+#endif
   return byteswritten;
 }
 
@@ -575,7 +1007,7 @@ File File::openNextFile(uint8_t mode)
         } else {
           sprintf(fullPath, "%s/%s", _name, fn);
         }
-        filtmp = SD.open(fullPath, mode);
+        filtmp = volume()->open(fullPath, mode);
         free(fullPath);
         found = true;
       } else {
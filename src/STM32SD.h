@@ -34,6 +34,29 @@ uint8_t const LS_SIZE = 2;
 /** ls() flag for recursive list of subdirectories */
 uint8_t const LS_R = 4;
 
+/* Could be redefined in variant.h or using build_opt.h */
+/* Number of directory entries processed by each rmdirStep() by default */
+#ifndef SD_RMDIR_STEP
+  #define SD_RMDIR_STEP 16
+#endif
+/* Time in ms the detect pin has to be stable before handling a card change */
+#ifndef SD_DETECT_DEBOUNCE
+  #define SD_DETECT_DEBOUNCE 50
+#endif
+
+class SDClass;
+
+/* Sizes and alignments in bytes for the fastest transfers (SD.ioHints()) */
+typedef struct {
+  uint32_t sectorSize;   /* Transfer unit of the card */
+  uint32_t clusterSize;  /* Largest transfer of FatFs, file offsets and
+                            sizes multiple of it avoid copies and splits */
+  uint32_t auSize;       /* Allocation unit of the card, 0 if unknown */
+  uint32_t auOffset;     /* Offset of the first cluster in its AU, 0 if
+                            the clusters are aligned on the AUs */
+  uint32_t bufferAlign;  /* Memory alignment of the buffers */
+} SdIoHints;
+
 class File : public Stream {
   public:
     File(FRESULT res = FR_OK);
@@ -48,6 +71,8 @@ class File : public Stream {
     int read(void *buf, size_t len);
     bool seek(uint32_t pos);
     uint32_t position();
+    /* Size of the next read or write to end on a cluster boundary */
+    uint32_t ioSize(void);
     uint32_t size();
     void close();
     operator bool();
@@ -72,11 +97,25 @@ class File : public Stream {
     FIL *_fil = NULL; // underlying file object structure pointer
     DIR _dir = {}; // init all fields to 0
     FRESULT _res = FR_OK;
+    SDClass *_sd = NULL; // volume of the file
+    SDClass *volume(void);
 
     FRESULT getErrorstate(void)
     {
       return _res;
     }
+
+#if SD_IO_STATS
+    SD_IoStats_t _stats = {}; // I/O counters of the file
+    const SD_IoStats_t *ioStats(void) const
+    {
+      return &_stats;
+    }
+    void resetIoStats(void)
+    {
+      _stats = {};
+    }
+#endif
     using Print::println;
     using Print::print;
 
@@ -85,11 +124,73 @@ class File : public Stream {
 class SDClass {
 
   public:
+    SDClass(uint8_t device = 0);
+
     /* Initialize the SD peripheral */
     bool begin(uint32_t detect = SD_DETECT_NONE, uint32_t level = SD_DETECT_LEVEL);
     /* Call this when a card is removed. It will allow to insert and initialise a new card. */
     bool end(void);
 
+    /* Non-blocking begin(): poll(), called from loop() and not from an
+       interrupt, runs the next step and returns 1 while in progress, 0 once
+       done and -1 on error. beginStep() gives the progress */
+    bool beginAsync(uint32_t detect = SD_DETECT_NONE, uint32_t level = SD_DETECT_LEVEL);
+    int poll(void);
+    uint8_t beginStep(void) const
+    {
+      return _beginStep;
+    }
+
+    /* Hot-plug with the detect pin given to begin() or beginAsync(): poll()
+       unmounts on removal and mounts on insertion. Callback is called with
+       true once mounted and false on removal. Has to be called before begin() */
+    void setHotPlug(bool enable, void (*callback)(bool present) = NULL)
+    {
+      _hotPlug = enable;
+      _detectCallback = callback;
+    }
+    bool isPresent(void) const
+    {
+      return _present;
+    }
+
+    /* Stripe the volume over the card of this SD and another card (RAID-0),
+       alternating stripes of the given number of sectors. The other card is
+       initialized by begin() and its pins have to be set. NULL to disable */
+    void setStripe(Sd2Card *card, uint32_t sectors = SD_STRIPE_SECTORS)
+    {
+      _pairCard = card;
+      _pairMirror = false;
+      _stripeSectors = sectors;
+    }
+    /* Mirror the volume on the card of this SD and another card (RAID-1),
+       initialized by begin() as with setStripe(). NULL to disable */
+    void setMirror(Sd2Card *card)
+    {
+      _pairCard = card;
+      _pairMirror = true;
+    }
+    /* Resynchronize a replaced card of a mirrored volume from the other one,
+       copied in the background by poll() */
+    bool resync(Sd2Card *card);
+    bool resyncing(void) const
+    {
+      return _mirror.resyncing();
+    }
+    /** Return true if a card of a mirrored volume failed and is left out */
+    bool degraded(void) const
+    {
+      return _pairMirror && _mirror.degraded();
+    }
+
+    /* Mount the volume on another block device, e.g. a layer over the card.
+       begin() does not initialize the card then, the block device does it
+       at mount. NULL to use the card */
+    void setBlockDevice(SdBlockDevice *dev)
+    {
+      _blockDev = dev;
+    }
+
     // set* have to be called before begin()
     void setDx(uint32_t data0, uint32_t data1 = PNUM_NOT_DEFINED, uint32_t data2 = PNUM_NOT_DEFINED, uint32_t data3 = PNUM_NOT_DEFINED)
     {
@@ -143,11 +244,29 @@ class SDClass {
       _card.setDxDIR(d0dir, d123dir);
     };
 #endif
-    static File open(const char *filepath, uint8_t mode = FA_READ);
-    static bool exists(const char *filepath);
-    static bool mkdir(const char *filepath);
-    static bool remove(const char *filepath);
-    static bool rmdir(const char *filepath);
+    File open(const char *filepath, uint8_t mode = FA_READ);
+    bool exists(const char *filepath);
+    bool mkdir(const char *filepath);
+    bool remove(const char *filepath);
+    bool rmdir(const char *filepath, bool recursive = false);
+#if SD_FS_RPATH
+    bool rmdirStart(const char *dirpath);
+    int rmdirStep(uint32_t count = SD_RMDIR_STEP);
+    bool chdir(const char *dirpath);
+#endif
+
+#if SD_TRACE_SIZE > 0
+    /* Block I/O trace of all the cards, recorded in RAM from traceStart() */
+    void traceStart(void)
+    {
+      BSP_SD_TraceStart();
+    }
+    void traceStop(void)
+    {
+      BSP_SD_TraceStop();
+    }
+    bool traceSave(const char *filepath);
+#endif
 
     File openRoot(void);
 
@@ -157,6 +276,19 @@ class SDClass {
     {
       return _fatFs.fatType();
     }
+    /* Sizes and alignments for the fastest transfers of the volume */
+    bool ioHints(SdIoHints *hints);
+#if SD_IO_STATS
+    /** \return I/O counters of the volume */
+    const SD_IoStats_t *ioStats(void) const
+    {
+      return _fatFs.ioStats();
+    }
+    void resetIoStats(void)
+    {
+      _fatFs.resetIoStats();
+    }
+#endif
     /** \return Pointer to SD card object. */
     Sd2Card *card()
     {
@@ -170,6 +302,36 @@ class SDClass {
   private:
     Sd2Card _card;
     SdFatFs _fatFs;
+    uint8_t _beginStep = SD_INIT_IDLE;
+
+    /* Block device of the volume if not the card, second card of a striped
+       or mirrored volume */
+    SdBlockDevice *_blockDev = NULL;
+    Sd2Card *_pairCard = NULL;
+    bool _pairMirror = false;
+    uint32_t _stripeSectors = SD_STRIPE_SECTORS;
+    SdStripeDevice _stripe;
+    SdMirrorDevice _mirror;
+
+    bool initDevice(void);
+
+    /* Hot-plug */
+    bool _hotPlug = false;
+    bool _present = false;
+    bool _notify = false;  /* Call back once mounted */
+    uint32_t _detect = SD_DETECT_NONE;
+    uint32_t _level = SD_DETECT_LEVEL;
+    volatile bool _detectPending = false;
+    volatile uint32_t _detectTick = 0;
+    void (*_detectCallback)(bool present) = NULL;
+
+    void armDetect(uint32_t detect, uint32_t level);
+    void cardDetect(void);
+
+    /* Detect pin interrupt of each device */
+    static SDClass *_devices[SD_MAX_DEVICES];
+    static void (*const _detectIRQ[SD_MAX_DEVICES])(void);
+    static void detectIRQ(uint8_t device);
 };
 
 extern SDClass SD;
@@ -36,23 +36,104 @@
 
 #include <Arduino.h>
 #include "Sd2Card.h"
+/* FatFs SD driver */
+#include "FatFs.h"
 
 /**
-  * @brief  Default constructor. Use default pins definition.
+  * @brief  Default constructor. Use default pins definition for the first
+  *         device, pins of other devices have to be set before init().
+  * @param  device: BSP SD device index (default 0). An index not below
+  *         SD_MAX_DEVICES makes the card invalid: init() always fails.
   */
-Sd2Card::Sd2Card()
+Sd2Card::Sd2Card(uint8_t device)
 {
-  setDx(SDX_D0, SDX_D1, SDX_D2, SDX_D3);
-  setCK(SDX_CK);
-  setCMD(SDX_CMD);
+  /* Pins set on an invalid card are ignored */
+  static SD_PinName_t invalidPins;
+
+  _device = (device < SD_MAX_DEVICES) ? device : SD_DEVICE_INVALID;
+  _pins = (device < SD_MAX_DEVICES) ? BSP_SD_GetPinNames(device) : &invalidPins;
+  if (_device == 0) {
+    setDx(SDX_D0, SDX_D1, SDX_D2, SDX_D3);
+    setCK(SDX_CK);
+    setCMD(SDX_CMD);
 #if defined(SDMMC1) || defined(SDMMC2)
-  setCKIN(SDX_CKIN);
-  setCDIR(SDX_CDIR);
-  setDxDIR(SDX_D0DIR, SDX_D123DIR);
+    setCKIN(SDX_CKIN);
+    setCDIR(SDX_CDIR);
+    setDxDIR(SDX_D0DIR, SDX_D123DIR);
 #endif
+  }
 }
 
 bool Sd2Card::init(uint32_t detect, uint32_t level)
+{
+  bool status;
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  forget();
+  status = setup(detect, level);
+  if (status == true) {
+    if (BSP_SD_Init() == MSD_OK) {
+      status = BSP_SD_GetCardInfo(&_SdCardInfo);
+    } else {
+      status = false;
+    }
+  }
+  if (status == true) {
+    identified();
+  }
+  return status;
+}
+
+/**
+  * @brief  Start the card initialization without blocking, initPoll() has to
+  *         be called until it does not return 1.
+  * @param  detect: detect pin number (default SD_DETECT_NONE)
+  * @param  level: detect pin level (default SD_DETECT_LEVEL)
+  * @retval true if started, false on error
+  */
+bool Sd2Card::initStart(uint32_t detect, uint32_t level)
+{
+  bool status;
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  forget();
+  status = setup(detect, level);
+  if (status == true) {
+    uint8_t sd_state = BSP_SD_InitStart();
+    status = (sd_state == MSD_OK) || (sd_state == MSD_BUSY);
+  }
+  return status;
+}
+
+/**
+  * @brief  Run the next step of the card initialization started by initStart()
+  * @retval 1 while in progress, 0 once done, -1 on error
+  */
+int Sd2Card::initPoll(void)
+{
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return -1;
+  }
+  switch (BSP_SD_InitPoll()) {
+    case MSD_BUSY:
+      return 1;
+    case MSD_OK:
+      if (!BSP_SD_GetCardInfo(&_SdCardInfo)) {
+        return -1;
+      }
+      identified();
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/**
+  * @brief  Configure the detect and transceiver pins if any
+  */
+bool Sd2Card::setup(uint32_t detect, uint32_t level)
 {
   bool status = true;
   if (detect != SD_DETECT_NONE) {
@@ -74,21 +155,496 @@ bool Sd2Card::init(uint32_t detect, uint32_t level)
     }
   }
 #endif
-  if (status == true) {
-    if (BSP_SD_Init() == MSD_OK) {
-      status = BSP_SD_GetCardInfo(&_SdCardInfo);
-    } else {
-      status = false;
-    }
-  }
   return status;
 }
 
 bool Sd2Card::deinit(void)
 {
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  /* Data in the card cache would be lost at power off */
+  (void)BSP_SD_CacheFlush(SD_EXT_REG_TIMEOUT);
+  forget();
+  if (_fastInit) {
+    return (BSP_SD_Suspend() == MSD_OK) ? true : false;
+  }
   return (BSP_SD_DeInit() == MSD_OK) ? true : false;
 }
 
+/**
+  * @brief  Initialize the card as FatFs does at mount, with the pins set
+  * @retval true once ready
+  */
+bool Sd2Card::initialize(void)
+{
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  if ((SD_Driver.disk_initialize(_device) & STA_NOINIT) || !BSP_SD_GetCardInfo(&_SdCardInfo)) {
+    return false;
+  }
+  identified();
+  return true;
+}
+
+/**
+  * @brief  Read the card features once identified, so that they are known
+  *         without sending commands, e.g. while queued tasks are pending
+  */
+void Sd2Card::identified(void)
+{
+  if (!_featuresValid && (_queueTasks == 0)) {
+    _featuresValid = readFeatures(&_features);
+  }
+}
+
+/**
+  * @brief  Forget the features of the card, another card can be identified
+  */
+void Sd2Card::forget(void)
+{
+  _featuresValid = false;
+  _perfReg = 0;
+}
+
+bool Sd2Card::isReady(void)
+{
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  return (SD_Driver.disk_status(_device) & STA_NOINIT) == 0;
+}
+
+bool Sd2Card::readBlocks(uint8_t *buf, uint32_t block, uint32_t count)
+{
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  return SD_Driver.disk_read(_device, buf, block, count) == RES_OK;
+}
+
+bool Sd2Card::writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count)
+{
+#if _USE_WRITE == 1
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  return SD_Driver.disk_write(_device, buf, block, count) == RES_OK;
+#else
+  UNUSED(buf);
+  UNUSED(block);
+  UNUSED(count);
+  return false;
+#endif
+}
+
+/**
+  * @brief  Erase blocks and wait for the card to be ready
+  * @param  block: first block
+  * @param  count: number of blocks
+  * @retval true on success
+  */
+bool Sd2Card::eraseBlocks(uint32_t block, uint32_t count)
+{
+  if (count == 0) {
+    return true;
+  }
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+  if (BSP_SD_Erase(block, block + count - 1) != MSD_OK) {
+    return false;
+  }
+  return waitReady(SD_ERASE_TIMEOUT);
+}
+
+/**
+  * @brief  Wait for the end of the card busy state
+  * @param  timeout: time in ms
+  * @retval true once ready, false on timeout
+  */
+bool Sd2Card::waitReady(uint32_t timeout)
+{
+  uint32_t start = millis();
+
+  while (BSP_SD_GetCardState() != SD_TRANSFER_OK) {
+    if ((millis() - start) >= timeout) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+  * @brief  Complete the pending writes, flushing the card cache if enabled
+  * @retval true on success
+  */
+bool Sd2Card::syncBlocks(void)
+{
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return false;
+  }
+#if _USE_IOCTL == 1
+  if (SD_Driver.disk_ioctl(_device, CTRL_SYNC, NULL) != RES_OK) {
+    return false;
+  }
+#endif
+  return BSP_SD_CacheFlush(SD_EXT_REG_TIMEOUT) == MSD_OK;
+}
+
+uint32_t Sd2Card::blockCount(void)
+{
+  BSP_SD_CardInfo info;
+  if (BSP_SD_SelectDevice(_device) != MSD_OK) {
+    return 0;
+  }
+  if (!BSP_SD_GetCardInfo(&info)) {
+    return 0;
+  }
+  return info.LogBlockNbr;
+}
+
+/**
+  * @brief  Size of an allocation unit from its SD Status code
+  * @param  code: AU_SIZE or UHS_AU_SIZE
+  * @retval size in sectors, 0 if not defined
+  */
+static uint32_t auSectors(uint8_t code)
+{
+  /* 16 KB to 4 MB, then 8, 12, 16, 24, 32 and 64 MB */
+  static const uint8_t large[6] = { 16, 24, 32, 48, 64, 128 };
+  if (code == 0) {
+    return 0;
+  }
+  return (code <= 9) ? (32UL << (code - 1)) : (large[code - 10] * 1024UL);
+}
+
+/**
+  * @brief  Get the performance and features of the card from its SD Status
+  *         and SCR registers, read once after the initialization
+  * @param  features: decoded registers
+  * @retval true on success
+  */
+bool Sd2Card::features(SdCardFeatures *features)
+{
+  if (!_featuresValid && (_queueTasks == 0)) {
+    BSP_SD_SelectDevice(_device);
+    _featuresValid = readFeatures(&_features);
+  }
+  if (_featuresValid) {
+    *features = _features;
+  }
+  return _featuresValid;
+}
+
+/**
+  * @brief  Read the SD Status, SCR and performance enhancement registers
+  * @param  features: decoded registers
+  * @retval true on success
+  */
+bool Sd2Card::readFeatures(SdCardFeatures *features)
+{
+  /* Registers in the card order, bit n of a 64 bytes register being in
+     byte (511 - n) / 8 */
+  uint8_t status[64];
+  uint8_t scr[8];
+
+  BSP_SD_SelectDevice(_device);
+  if ((BSP_SD_GetSDStatus(status) != MSD_OK) || (BSP_SD_GetSCR(scr) != MSD_OK)) {
+    return false;
+  }
+  static const uint8_t speedClasses[5] = { 0, 2, 4, 6, 10 };
+  features->speedClass = (status[8] < 5) ? speedClasses[status[8]] : 0;
+  features->auSectors = auSectors(status[10] >> 4);
+  features->eraseAUs = (status[11] << 8) | status[12];
+  features->eraseTimeout = status[13] >> 2;
+  features->eraseOffset = status[13] & 0x03;
+  features->uhsGrade = status[14] >> 4;
+  if (features->auSectors == 0) {
+    features->auSectors = auSectors(status[14] & 0x0F);
+  }
+  features->videoClass = status[15];
+  features->appClass = status[21] & 0x0F;
+
+  /* SD_SPEC, SD_SPEC3, SD_SPEC4 and SD_SPECX */
+  static const uint8_t specs[3] = { 10, 11, 20 };
+  uint8_t specx = ((scr[2] & 0x03) << 2) | (scr[3] >> 6);
+  features->specVersion = ((scr[0] & 0x0F) < 3) ? specs[scr[0] & 0x0F] : 0;
+  if (scr[2] & 0x80) {
+    features->specVersion = 30;
+    if (specx != 0) {
+      features->specVersion = 40 + (specx * 10);
+    } else if (scr[2] & 0x04) {
+      features->specVersion = 40;
+    }
+  }
+  features->busWidths = scr[1] & 0x0F;
+  features->cmdSupport = scr[3] & 0x0F;
+
+  uint8_t reg[SD_BLOCK_SIZE];
+  features->queueDepth = 0;
+  features->cache = false;
+  if (performance(reg)) {
+    if ((reg[SD_PERF_QUEUE_DEPTH] & 0x1F) != 0) {
+      features->queueDepth = (reg[SD_PERF_QUEUE_DEPTH] & 0x1F) + 1;
+    }
+    features->cache = (reg[SD_PERF_CACHE_SUPPORT] & 0x01) != 0;
+  }
+  return true;
+}
+
+/**
+  * @brief  Find the performance enhancement extension register of the card
+  *         in the general information, and read it
+  * @param  reg: SD_BLOCK_SIZE bytes, register content
+  * @retval true if the card has the register
+  */
+bool Sd2Card::performance(uint8_t *reg)
+{
+  uint8_t scr[8];
+  uint16_t length, next = 16;
+  uint32_t perfReg = 0;
+
+  if (_perfReg != 0) {
+    /* Found since the initialization */
+    return BSP_SD_ReadExtension(_perfReg, reg, SD_BLOCK_SIZE) == MSD_OK;
+  }
+  if ((BSP_SD_GetSCR(scr) != MSD_OK) || !(scr[3] & SD_CMD_SUPPORT_EXT_REG) ||
+      (BSP_SD_ReadExtension(SD_EXT_REG(0, 0, 0), reg, SD_BLOCK_SIZE) != MSD_OK)) {
+    return false;
+  }
+  /* Length and number of extensions, then each extension: function code,
+     next extension at 40, number of registers at 42, first one at 44 */
+  length = reg[2] | (reg[3] << 8);
+  for (uint8_t i = 0; i < reg[4]; i++) {
+    if ((next < 16) || ((next + 48U) > length) || ((next + 48U) > SD_BLOCK_SIZE)) {
+      break;
+    }
+    if ((((reg[next + 1] << 8) | reg[next]) == SD_FUNC_PERFORMANCE) && (reg[next + 42] != 0)) {
+      perfReg = reg[next + 44] | (reg[next + 45] << 8) | ((uint32_t)reg[next + 46] << 16) |
+                ((uint32_t)reg[next + 47] << 24);
+      break;
+    }
+    next = reg[next + 40] | (reg[next + 41] << 8);
+  }
+  if ((perfReg == 0) || (BSP_SD_ReadExtension(perfReg, reg, SD_BLOCK_SIZE) != MSD_OK)) {
+    return false;
+  }
+  _perfReg = perfReg;
+  return true;
+}
+
+/**
+  * @brief  Enable or disable the command queue of the card, in voluntary
+  *         mode: the ready tasks are executed in any order
+  * @param  enable: true to enable
+  * @retval true on success, false if not supported or tasks are queued
+  */
+bool Sd2Card::queueEnable(bool enable)
+{
+  uint8_t reg[SD_BLOCK_SIZE];
+  uint8_t depth;
+
+  BSP_SD_SelectDevice(_device);
+  if (_queueTasks != 0) {
+    return false;
+  }
+  if (!enable) {
+    if (BSP_SD_QueueDepth() == 0) {
+      return true;
+    }
+    if (_perfReg == 0) {
+      return false;
+    }
+    (void)BSP_SD_QueueSetDepth(0);
+    return (BSP_SD_WriteExtension(_perfReg + SD_PERF_QUEUE_ENABLE, 0) == MSD_OK) &&
+           waitReady(SD_EXT_REG_TIMEOUT);
+  }
+  if (!performance(reg) || ((reg[SD_PERF_QUEUE_DEPTH] & 0x1F) == 0)) {
+    return false;
+  }
+  depth = (reg[SD_PERF_QUEUE_DEPTH] & 0x1F) + 1;
+  if ((BSP_SD_WriteExtension(_perfReg + SD_PERF_QUEUE_ENABLE, 0x01) != MSD_OK) ||
+      !waitReady(SD_EXT_REG_TIMEOUT) ||
+      (BSP_SD_ReadExtension(_perfReg, reg, SD_BLOCK_SIZE) != MSD_OK) ||
+      !(reg[SD_PERF_QUEUE_ENABLE] & 0x01)) {
+    return false;
+  }
+  return BSP_SD_QueueSetDepth(depth) == MSD_OK;
+}
+
+/**
+  * @brief  Enable or disable the volatile write cache of the card: the
+  *         writes end once in the cache, syncBlocks() (f_sync() of FatFs)
+  *         flushes it
+  * @param  enable: true to enable
+  * @retval true on success, false if not supported or tasks are queued
+  */
+bool Sd2Card::cacheEnable(bool enable)
+{
+  uint8_t reg[SD_BLOCK_SIZE];
+
+  BSP_SD_SelectDevice(_device);
+  if (_queueTasks != 0) {
+    return false;
+  }
+  if (!enable) {
+    if (!BSP_SD_CacheEnabled()) {
+      return true;
+    }
+    if (_perfReg == 0) {
+      return false;
+    }
+    if (BSP_SD_CacheFlush(SD_EXT_REG_TIMEOUT) != MSD_OK) {
+      return false;
+    }
+    BSP_SD_CacheSetRegister(0);
+    return (BSP_SD_WriteExtension(_perfReg + SD_PERF_CACHE_ENABLE, 0) == MSD_OK) &&
+           waitReady(SD_EXT_REG_TIMEOUT);
+  }
+  if (!performance(reg) || !(reg[SD_PERF_CACHE_SUPPORT] & 0x01)) {
+    return false;
+  }
+  if ((BSP_SD_WriteExtension(_perfReg + SD_PERF_CACHE_ENABLE, 0x01) != MSD_OK) ||
+      !waitReady(SD_EXT_REG_TIMEOUT) ||
+      (BSP_SD_ReadExtension(_perfReg, reg, SD_BLOCK_SIZE) != MSD_OK) ||
+      !(reg[SD_PERF_CACHE_ENABLE] & 0x01)) {
+    return false;
+  }
+  BSP_SD_CacheSetRegister(_perfReg);
+  return true;
+}
+
+uint8_t Sd2Card::queueDepth(void)
+{
+  BSP_SD_SelectDevice(_device);
+  return (BSP_SD_QueueDepth() != 0) ? BSP_SD_QueueDepth() : SdBlockDevice::queueDepth();
+}
+
+/**
+  * @brief  Queue a read: the card fetches the data while the other tasks
+  *         are executed by queuePoll()
+  * @param  buf: data read, kept until done
+  * @param  block: first block
+  * @param  count: number of blocks, up to 65535
+  * @retval task number, -1 if the queue is full or on error
+  */
+int Sd2Card::queueRead(uint8_t *buf, uint32_t block, uint32_t count)
+{
+  int8_t task;
+
+  BSP_SD_SelectDevice(_device);
+  if (BSP_SD_QueueDepth() == 0) {
+    return SdBlockDevice::queueRead(buf, block, count);
+  }
+  task = BSP_SD_QueueSubmit(true, block, count);
+  if (task >= 0) {
+    _queueBuf[task] = buf;
+    _queueTasks |= 1UL << task;
+  }
+  return task;
+}
+
+int Sd2Card::queueWrite(const uint8_t *buf, uint32_t block, uint32_t count)
+{
+  int8_t task;
+
+  BSP_SD_SelectDevice(_device);
+  if (BSP_SD_QueueDepth() == 0) {
+    return SdBlockDevice::queueWrite(buf, block, count);
+  }
+  task = BSP_SD_QueueSubmit(false, block, count);
+  if (task >= 0) {
+    _queueBuf[task] = (uint8_t *)buf;
+    _queueTasks |= 1UL << task;
+  }
+  return task;
+}
+
+/**
+  * @brief  Execute the queued tasks ready in the card
+  * @param  failed: mask of the failed tasks, can be NULL
+  * @retval mask of the tasks done
+  */
+uint32_t Sd2Card::queuePoll(uint32_t *failed)
+{
+  uint32_t ready = 0, done, errors = 0;
+
+  BSP_SD_SelectDevice(_device);
+  if (_queueTasks == 0) {
+    return SdBlockDevice::queuePoll(failed);
+  }
+  /* Tasks aborted after an error, e.g. of a transfer through the queue */
+  done = _queueTasks & ~BSP_SD_QueueTasks();
+  errors = done;
+  if (BSP_SD_QueueStatus(&ready) != MSD_OK) {
+    (void)BSP_SD_QueueAbort();
+    errors = _queueTasks;
+    done = _queueTasks;
+    ready = 0;
+  }
+  for (uint8_t task = 0; task < SD_QUEUE_DEPTH; task++) {
+    if ((ready & _queueTasks) & (1UL << task)) {
+      /* Without waiting for the end of a previous write */
+      uint8_t status = BSP_SD_QueueExecute(task, (uint32_t *)_queueBuf[task], 0);
+      if (status == MSD_BUSY) {
+        break;
+      }
+      if (status != MSD_OK) {
+        errors |= 1UL << task;
+      }
+      done |= 1UL << task;
+    }
+  }
+  _queueTasks &= ~done;
+  if (failed != NULL) {
+    *failed = errors;
+  }
+  return done;
+}
+
+/**
+  * @brief  Quick read-only benchmark of the card, to check its class
+  * @param  buf: buffer of at least bufSize bytes
+  * @param  bufSize: size of the sequential reads, a multiple of 4096
+  * @param  readKBps: sequential read throughput
+  * @param  randomIops: random 4 KB reads per second
+  * @retval true on success
+  */
+bool Sd2Card::benchmark(uint8_t *buf, uint32_t bufSize, uint32_t *readKBps, uint32_t *randomIops)
+{
+  const uint32_t total = 1024UL * 1024UL;
+  const uint32_t randomCount = 100;
+  uint32_t blocks = blockCount();
+  uint32_t count = bufSize / SD_BLOCK_SIZE;
+  uint32_t seed = 12345;
+  uint32_t start, us;
+
+  if ((count == 0) || ((count % 8) != 0) || (blocks < (total / SD_BLOCK_SIZE))) {
+    return false;
+  }
+  start = micros();
+  for (uint32_t block = 0; block < (total / SD_BLOCK_SIZE); block += count) {
+    if (!readBlocks(buf, block, count)) {
+      return false;
+    }
+  }
+  us = micros() - start;
+  *readKBps = (us == 0) ? 0 : (uint32_t)(((uint64_t)total * 1000000UL / 1024UL) / us);
+
+  start = micros();
+  for (uint32_t i = 0; i < randomCount; i++) {
+    seed = (seed * 1103515245UL) + 12345UL;
+    if (!readBlocks(buf, ((seed >> 8) % (blocks / 8)) * 8, 8)) {
+      return false;
+    }
+  }
+  us = micros() - start;
+  *randomIops = (us == 0) ? 0 : (uint32_t)((uint64_t)randomCount * 1000000UL / us);
+  return true;
+}
+
 uint8_t Sd2Card::type(void) const
 {
   uint8_t cardType = SD_CARD_TYPE_UNK;
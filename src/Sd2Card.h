@@ -38,6 +38,7 @@
 #define Sd2Card_h
 
 #include "bsp_sd.h"
+#include "SdBlockDevice.h"
 
 // card types to match Arduino definition
 #define SD_CARD_TYPE_UNK      0
@@ -52,79 +53,210 @@
 /** High Capacity SD card */
 #define SD_CARD_TYPE_SECURED  4
 
-class Sd2Card {
+/* Device index of a card built with an index not below SD_MAX_DEVICES */
+#define SD_DEVICE_INVALID     0xFF
+
+/* Could be redefined in variant.h or using build_opt.h */
+/* Keep the card identified by deinit() to reuse it at next init() */
+#ifndef SD_FAST_INIT
+  #define SD_FAST_INIT          false
+#endif
+/* Time in ms to wait for the end of an erase */
+#ifndef SD_ERASE_TIMEOUT
+  #define SD_ERASE_TIMEOUT      30000U
+#endif
+/* Time in ms to wait for an extension register write (CMD49) */
+#ifndef SD_EXT_REG_TIMEOUT
+  #define SD_EXT_REG_TIMEOUT    1000U
+#endif
+
+/* Commands supported by the card (SCR CMD_SUPPORT) */
+#define SD_CMD_SUPPORT_SPEED_CLASS 0x01 /* CMD20 */
+#define SD_CMD_SUPPORT_BLOCK_COUNT 0x02 /* CMD23 */
+#define SD_CMD_SUPPORT_EXT_REG     0x04 /* CMD48/49 */
+#define SD_CMD_SUPPORT_EXT_REG_MB  0x08 /* CMD58/59 */
+
+/* Card performance and features, from the SD Status (ACMD13) and the SD
+   Configuration Register (ACMD51) */
+typedef struct {
+  uint8_t speedClass;   /* Speed class: 0, 2, 4, 6 or 10 */
+  uint8_t uhsGrade;     /* UHS speed grade: 0, 1 or 3 */
+  uint8_t videoClass;   /* Video speed class: 0, 6, 10, 30, 60 or 90 */
+  uint8_t appClass;     /* Application performance class: 0, 1 (A1) or 2 (A2) */
+  uint32_t auSectors;   /* Allocation unit size in sectors, 0 if not defined */
+  uint16_t eraseAUs;    /* Number of AUs erased in eraseTimeout */
+  uint8_t eraseTimeout; /* s, 0 if not supported */
+  uint8_t eraseOffset;  /* s */
+  uint8_t specVersion;  /* Physical layer specification version x 10 */
+  uint8_t busWidths;    /* Bit 0: 1 bit, bit 2: 4 bits */
+  uint8_t cmdSupport;   /* SD_CMD_SUPPORT_* */
+  uint8_t queueDepth;   /* Command queue depth (CMD44-47), 0 if not supported */
+  bool cache;           /* Volatile write cache */
+} SdCardFeatures;
+
+class Sd2Card : public SdBlockDevice {
   public:
-    Sd2Card();
+    Sd2Card(uint8_t device = 0);
 
     bool init(uint32_t detect = SD_DETECT_NONE, uint32_t level = SD_DETECT_LEVEL);
     bool deinit(void);
 
+    /* Non-blocking init: initPoll() returns 1 while in progress, 0 once
+       done and -1 on error */
+    bool initStart(uint32_t detect = SD_DETECT_NONE, uint32_t level = SD_DETECT_LEVEL);
+    int initPoll(void);
+    /** Return the HAL error code of the last failed operation */
+    uint32_t errorCode(void)
+    {
+      BSP_SD_SelectDevice(_device);
+      return BSP_SD_GetError();
+    }
+
     // set* have to be called before init()
     void setDx(uint32_t data0, uint32_t data1 = PNUM_NOT_DEFINED, uint32_t data2 = PNUM_NOT_DEFINED, uint32_t data3 = PNUM_NOT_DEFINED)
     {
-      SD_PinNames.pin_d0 = digitalPinToPinName(data0);
-      SD_PinNames.pin_d1 = digitalPinToPinName(data1);
-      SD_PinNames.pin_d2 = digitalPinToPinName(data2);
-      SD_PinNames.pin_d3 = digitalPinToPinName(data3);
+      _pins->pin_d0 = digitalPinToPinName(data0);
+      _pins->pin_d1 = digitalPinToPinName(data1);
+      _pins->pin_d2 = digitalPinToPinName(data2);
+      _pins->pin_d3 = digitalPinToPinName(data3);
     };
     void setCK(uint32_t ck)
     {
-      SD_PinNames.pin_ck = digitalPinToPinName(ck);
+      _pins->pin_ck = digitalPinToPinName(ck);
     };
     void setCMD(uint32_t cmd)
     {
-      SD_PinNames.pin_cmd = digitalPinToPinName(cmd);
+      _pins->pin_cmd = digitalPinToPinName(cmd);
     };
 
     void setDx(PinName data0, PinName data1 = NC, PinName data2 = NC, PinName data3 = NC)
     {
-      SD_PinNames.pin_d0 = data0;
-      SD_PinNames.pin_d1 = data1;
-      SD_PinNames.pin_d2 = data2;
-      SD_PinNames.pin_d3 = data3;
+      _pins->pin_d0 = data0;
+      _pins->pin_d1 = data1;
+      _pins->pin_d2 = data2;
+      _pins->pin_d3 = data3;
     };
     void setCK(PinName ck)
     {
-      SD_PinNames.pin_ck = ck;
+      _pins->pin_ck = ck;
     };
     void setCMD(PinName cmd)
     {
-      SD_PinNames.pin_cmd = cmd;
+      _pins->pin_cmd = cmd;
     };
 #if defined(SDMMC1) || defined(SDMMC2)
     void setCKIN(uint32_t ckin)
     {
-      SD_PinNames.pin_ckin = digitalPinToPinName(ckin);
+      _pins->pin_ckin = digitalPinToPinName(ckin);
     };
     void setCDIR(uint32_t cdir)
     {
-      SD_PinNames.pin_cdir = digitalPinToPinName(cdir);
+      _pins->pin_cdir = digitalPinToPinName(cdir);
     };
     void setDxDIR(uint32_t d0dir, uint32_t d123dir)
     {
-      SD_PinNames.pin_d0dir = digitalPinToPinName(d0dir);
-      SD_PinNames.pin_d123dir = digitalPinToPinName(d123dir);
+      _pins->pin_d0dir = digitalPinToPinName(d0dir);
+      _pins->pin_d123dir = digitalPinToPinName(d123dir);
     };
 
     void setCKIN(PinName ckin)
     {
-      SD_PinNames.pin_ckin = ckin;
+      _pins->pin_ckin = ckin;
     };
     void setCDIR(PinName cdir)
     {
-      SD_PinNames.pin_cdir = cdir;
+      _pins->pin_cdir = cdir;
     };
     void setDxDIR(PinName d0dir, PinName d123dir)
     {
-      SD_PinNames.pin_d0dir = d0dir;
-      SD_PinNames.pin_d123dir = d123dir;
+      _pins->pin_d0dir = d0dir;
+      _pins->pin_d123dir = d123dir;
     };
 #endif
+    /* When enabled, deinit() keeps the card identified and init() reuses it
+       if the same card is still present, skipping the card identification */
+    void setFastInit(bool enable)
+    {
+      _fastInit = enable;
+    };
+
     /** Return the card type: SD V1, SD V2 or SDHC */
     uint8_t type(void) const;
 
+    /* Performance and features of the initialized card, read once */
+    bool features(SdCardFeatures *features);
+    /* Quick read-only benchmark: sequential reads of bufSize bytes over
+       1 MB in KB/s and random 4 KB reads per second. buf holds at least
+       bufSize bytes, a multiple of 4096 */
+    bool benchmark(uint8_t *buf, uint32_t bufSize, uint32_t *readKBps, uint32_t *randomIops);
+    /* Command queue of the A2 cards (CMD44-47): once enabled, the queued
+       transfers of SdBlockDevice overlap the card access times, and the
+       other transfers go through the queue. Disable it with no queued task */
+    bool queueEnable(bool enable);
+    /* Volatile write cache of the card: once enabled, the writes end in
+       the cache and syncBlocks() flushes it, e.g. by File::flush() */
+    bool cacheEnable(bool enable);
+    bool cacheEnabled(void)
+    {
+      BSP_SD_SelectDevice(_device);
+      return BSP_SD_CacheEnabled();
+    }
+
+    /** Return the progress of initStart(): SD_INIT_* */
+    uint8_t initStep(void)
+    {
+      BSP_SD_SelectDevice(_device);
+      return BSP_SD_InitStep();
+    }
+    /* Card detect pin state and interrupt, see init() */
+    bool isDetected(void)
+    {
+      BSP_SD_SelectDevice(_device);
+      return (BSP_SD_IsDetected() == SD_PRESENT);
+    }
+    bool attachDetect(void (*callback)(void))
+    {
+      BSP_SD_SelectDevice(_device);
+      return (BSP_SD_DetectITConfig(callback) == MSD_OK);
+    }
+
+    /* Block device of the card, through the FatFs SD driver */
+    virtual bool initialize(void);
+    virtual bool isReady(void);
+    virtual bool readBlocks(uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool eraseBlocks(uint32_t block, uint32_t count);
+    virtual bool syncBlocks(void);
+    virtual uint32_t blockCount(void);
+    virtual uint8_t queueDepth(void);
+    virtual int queueRead(uint8_t *buf, uint32_t block, uint32_t count);
+    virtual int queueWrite(const uint8_t *buf, uint32_t block, uint32_t count);
+    virtual uint32_t queuePoll(uint32_t *failed = NULL);
+
+    /** Return the BSP SD device index, SD_DEVICE_INVALID if not valid */
+    uint8_t device(void) const
+    {
+      return _device;
+    }
+
   private:
     BSP_SD_CardInfo _SdCardInfo;
+    uint8_t _device;
+    SD_PinName_t *_pins;
+
+    bool setup(uint32_t detect, uint32_t level);
+    bool _fastInit = SD_FAST_INIT;
+    uint32_t _perfReg = 0;   /* Performance enhancement register, 0 if none */
+    SdCardFeatures _features;
+    bool _featuresValid = false;
+    uint32_t _queueTasks = 0;
+    uint8_t *_queueBuf[SD_QUEUE_DEPTH];
+
+    bool readFeatures(SdCardFeatures *features);
+    bool performance(uint8_t *reg);
+    void identified(void);
+    void forget(void);
+    bool waitReady(uint32_t timeout);
 
 };
 #endif  // sd2Card_h
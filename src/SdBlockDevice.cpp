@@ -0,0 +1,396 @@
+/**
+  ******************************************************************************
+  * @file    SdBlockDevice.cpp
+  * @brief   Striped and mirrored block devices
+ ******************************************************************************
+  * @attention
+  *
+  * <h2><center>&copy; COPYRIGHT(c) 2017 STMicroelectronics</center></h2>
+  *
+  * Redistribution and use in source and binary forms, with or without modification,
+  * are permitted provided that the following conditions are met:
+  *   1. Redistributions of source code must retain the above copyright notice,
+  *      this list of conditions and the following disclaimer.
+  *   2. Redistributions in binary form must reproduce the above copyright notice,
+  *      this list of conditions and the following disclaimer in the documentation
+  *      and/or other materials provided with the distribution.
+  *   3. Neither the name of STMicroelectronics nor the names of its contributors
+  *      may be used to endorse or promote products derived from this software
+  *      without specific prior written permission.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+  *
+  ******************************************************************************
+  */
+
+#include <stdlib.h>
+#include "SdBlockDevice.h"
+
+/**
+  * @brief  Constructor
+  * @param  dev0: first device
+  * @param  dev1: second device
+  * @param  stripe: stripe size in blocks (default SD_STRIPE_SECTORS)
+  */
+SdStripeDevice::SdStripeDevice(SdBlockDevice *dev0, SdBlockDevice *dev1, uint32_t stripe)
+{
+  setDevices(dev0, dev1, stripe);
+}
+
+/**
+  * @brief  Set the striped devices, before the volume is mounted
+  * @param  dev0: first device
+  * @param  dev1: second device
+  * @param  stripe: stripe size in blocks (default SD_STRIPE_SECTORS)
+  */
+void SdStripeDevice::setDevices(SdBlockDevice *dev0, SdBlockDevice *dev1, uint32_t stripe)
+{
+  _dev[0] = dev0;
+  _dev[1] = dev1;
+  _stripe = (stripe != 0) ? stripe : SD_STRIPE_SECTORS;
+}
+
+bool SdStripeDevice::initialize(void)
+{
+  bool status = (_dev[0] != NULL) && (_dev[1] != NULL);
+  /* Both devices are initialized even if the first one fails */
+  if (status) {
+    status = _dev[0]->initialize();
+    status = _dev[1]->initialize() && status;
+  }
+  return status;
+}
+
+bool SdStripeDevice::isReady(void)
+{
+  return (_dev[0] != NULL) && (_dev[1] != NULL) && _dev[0]->isReady() && _dev[1]->isReady();
+}
+
+/**
+  * @brief  Map a block to its device
+  * @param  block: block number, replaced by the device one
+  * @param  count: number of blocks, reduced to the end of the stripe
+  * @retval device of the block
+  */
+SdBlockDevice *SdStripeDevice::map(uint32_t *block, uint32_t *count) const
+{
+  uint32_t stripe = *block / _stripe;
+  uint32_t ofs = *block % _stripe;
+
+  if (*count > (_stripe - ofs)) {
+    *count = _stripe - ofs;
+  }
+  *block = ((stripe >> 1) * _stripe) + ofs;
+  return _dev[stripe & 1];
+}
+
+/**
+  * @brief  Read blocks, one transfer per stripe
+  */
+bool SdStripeDevice::readBlocks(uint8_t *buf, uint32_t block, uint32_t count)
+{
+  while (count > 0) {
+    uint32_t blk = block;
+    uint32_t n = count;
+    SdBlockDevice *dev = map(&blk, &n);
+    if (!dev->readBlocks(buf, blk, n)) {
+      return false;
+    }
+    buf += n * SD_BLOCK_SIZE;
+    block += n;
+    count -= n;
+  }
+  return true;
+}
+
+/**
+  * @brief  Write blocks, one transfer per stripe
+  */
+bool SdStripeDevice::writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count)
+{
+  while (count > 0) {
+    uint32_t blk = block;
+    uint32_t n = count;
+    SdBlockDevice *dev = map(&blk, &n);
+    if (!dev->writeBlocks(buf, blk, n)) {
+      return false;
+    }
+    buf += n * SD_BLOCK_SIZE;
+    block += n;
+    count -= n;
+  }
+  return true;
+}
+
+bool SdStripeDevice::eraseBlocks(uint32_t block, uint32_t count)
+{
+  while (count > 0) {
+    uint32_t blk = block;
+    uint32_t n = count;
+    SdBlockDevice *dev = map(&blk, &n);
+    if (!dev->eraseBlocks(blk, n)) {
+      return false;
+    }
+    block += n;
+    count -= n;
+  }
+  return true;
+}
+
+bool SdStripeDevice::syncBlocks(void)
+{
+  bool status = _dev[0]->syncBlocks();
+  return _dev[1]->syncBlocks() && status;
+}
+
+/**
+  * @brief  Get the size: twice the smallest device, in whole stripes
+  */
+uint32_t SdStripeDevice::blockCount(void)
+{
+  uint32_t count = _dev[0]->blockCount();
+  uint32_t count1 = _dev[1]->blockCount();
+
+  if (count1 < count) {
+    count = count1;
+  }
+  return (count / _stripe) * _stripe * 2;
+}
+
+/**
+  * @brief  Constructor
+  * @param  dev0: first device
+  * @param  dev1: second device
+  */
+SdMirrorDevice::SdMirrorDevice(SdBlockDevice *dev0, SdBlockDevice *dev1)
+{
+  setDevices(dev0, dev1);
+}
+
+/**
+  * @brief  Set the mirrored devices, before the volume is mounted. Both
+  *         devices are expected to hold the same data.
+  * @param  dev0: first device
+  * @param  dev1: second device
+  */
+void SdMirrorDevice::setDevices(SdBlockDevice *dev0, SdBlockDevice *dev1)
+{
+  resyncAbort();
+  _dev[0] = dev0;
+  _dev[1] = dev1;
+  _offline = 0;
+  _readNext = 0;
+}
+
+/**
+  * @brief  Initialize both devices. One device is enough to run, a device
+  *         not ready is left out until resynchronized.
+  */
+bool SdMirrorDevice::initialize(void)
+{
+  for (uint8_t i = 0; i < 2; i++) {
+    if (online(i) && !_dev[i]->initialize()) {
+      _offline |= (1 << i);
+    }
+  }
+  return online(0) || online(1);
+}
+
+bool SdMirrorDevice::isReady(void)
+{
+  return (online(0) && _dev[0]->isReady()) || (online(1) && _dev[1]->isReady());
+}
+
+/**
+  * @brief  Check if blocks of a device can be read: the device did not fail
+  *         and, if resynchronized, the blocks are already copied
+  */
+bool SdMirrorDevice::readable(uint8_t i, uint32_t block, uint32_t count) const
+{
+  if (!online(i)) {
+    return false;
+  }
+  return (i != _resync) || ((block + count) <= _resyncNext);
+}
+
+/**
+  * @brief  Read blocks from one device, alternating devices. After a write,
+  *         the first device is read first as it has been busy for longer.
+  *         A failed read is retried on the other device.
+  */
+bool SdMirrorDevice::readBlocks(uint8_t *buf, uint32_t block, uint32_t count)
+{
+  uint8_t i = _readNext;
+
+  _readNext = i ^ 1;
+  if (readable(i, block, count) && _dev[i]->readBlocks(buf, block, count)) {
+    return true;
+  }
+  i ^= 1;
+  return readable(i, block, count) && _dev[i]->readBlocks(buf, block, count);
+}
+
+/**
+  * @brief  Write blocks to both devices, a device failing is left out
+  */
+bool SdMirrorDevice::writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count)
+{
+  bool status = false;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!online(i)) {
+      continue;
+    }
+    if (_dev[i]->writeBlocks(buf, block, count)) {
+      status = true;
+    } else {
+      _offline |= (1 << i);
+      if (i == _resync) {
+        resyncAbort();
+      }
+    }
+  }
+  _readNext = 0;
+  return status;
+}
+
+bool SdMirrorDevice::eraseBlocks(uint32_t block, uint32_t count)
+{
+  bool status = false;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (online(i) && _dev[i]->eraseBlocks(block, count)) {
+      status = true;
+    }
+  }
+  return status;
+}
+
+bool SdMirrorDevice::syncBlocks(void)
+{
+  bool status = true;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (online(i) && !_dev[i]->syncBlocks()) {
+      status = false;
+    }
+  }
+  return status;
+}
+
+/**
+  * @brief  Get the size of the smallest device
+  */
+uint32_t SdMirrorDevice::blockCount(void)
+{
+  uint32_t count = 0;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (online(i)) {
+      uint32_t n = _dev[i]->blockCount();
+      if ((count == 0) || (n < count)) {
+        count = n;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+  * @brief  Start to copy a device from the other one, e.g. after it has been
+  *         replaced. Blocks are copied by resyncStep(), meanwhile writes go
+  *         to both devices and blocks not yet copied are read from the other
+  *         device only.
+  * @param  dev: device to resynchronize, initialized again
+  * @retval true if started
+  */
+bool SdMirrorDevice::resyncStart(SdBlockDevice *dev)
+{
+  uint8_t i = (dev == _dev[0]) ? 0 : 1;
+  uint32_t count;
+
+  if ((dev == NULL) || (dev != _dev[i]) || !online(i ^ 1)) {
+    return false;
+  }
+  resyncAbort();
+  if (!dev->initialize()) {
+    return false;
+  }
+  _resyncEnd = _dev[i ^ 1]->blockCount();
+  count = dev->blockCount();
+  if ((_resyncEnd == 0) || (count == 0)) {
+    return false;
+  }
+  if (count < _resyncEnd) {
+    _resyncEnd = count;
+  }
+  _resyncBuf = (uint8_t *)malloc(SD_RESYNC_STEP * SD_BLOCK_SIZE);
+  if (_resyncBuf == NULL) {
+    return false;
+  }
+  _resyncNext = 0;
+  _resync = i;
+  /* Written from now on, readable once copied */
+  _offline &= ~(1 << i);
+  return true;
+}
+
+/**
+  * @brief  Copy the next blocks of the resynchronization
+  * @param  count: maximum number of blocks to copy, up to SD_RESYNC_STEP
+  * @retval 1 while in progress, 0 once done, -1 on error
+  */
+int SdMirrorDevice::resyncStep(uint32_t count)
+{
+  uint8_t i = _resync;
+
+  if (i >= 2) {
+    return 0;
+  }
+  if ((count == 0) || (count > SD_RESYNC_STEP)) {
+    count = SD_RESYNC_STEP;
+  }
+  if (count > (_resyncEnd - _resyncNext)) {
+    count = _resyncEnd - _resyncNext;
+  }
+  if (count > 0) {
+    if (!_dev[i ^ 1]->readBlocks(_resyncBuf, _resyncNext, count) ||
+        !_dev[i]->writeBlocks(_resyncBuf, _resyncNext, count)) {
+      _offline |= (1 << i);
+      resyncAbort();
+      return -1;
+    }
+    _resyncNext += count;
+  }
+  if (_resyncNext >= _resyncEnd) {
+    /* Device fully readable */
+    resyncAbort();
+    return 0;
+  }
+  return 1;
+}
+
+/**
+  * @brief  Stop the resynchronization, a device not fully copied is left
+  *         out until a new resynchronization
+  */
+void SdMirrorDevice::resyncAbort(void)
+{
+  if (_resyncBuf != NULL) {
+    free(_resyncBuf);
+    _resyncBuf = NULL;
+  }
+  if ((_resync < 2) && (_resyncNext < _resyncEnd)) {
+    _offline |= (1 << _resync);
+  }
+  _resync = 2;
+}
@@ -0,0 +1,234 @@
+/**
+  ******************************************************************************
+  * @file    SdBlockDevice.h
+  * @brief   Block device interface beneath the FatFs volume
+ ******************************************************************************
+  * @attention
+  *
+  * <h2><center>&copy; COPYRIGHT(c) 2017 STMicroelectronics</center></h2>
+  *
+  * Redistribution and use in source and binary forms, with or without modification,
+  * are permitted provided that the following conditions are met:
+  *   1. Redistributions of source code must retain the above copyright notice,
+  *      this list of conditions and the following disclaimer.
+  *   2. Redistributions in binary form must reproduce the above copyright notice,
+  *      this list of conditions and the following disclaimer in the documentation
+  *      and/or other materials provided with the distribution.
+  *   3. Neither the name of STMicroelectronics nor the names of its contributors
+  *      may be used to endorse or promote products derived from this software
+  *      without specific prior written permission.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+  *
+  ******************************************************************************
+  */
+
+#ifndef SdBlockDevice_h
+#define SdBlockDevice_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Size in bytes of a block */
+#define SD_BLOCK_SIZE      512
+
+/* Could be redefined in variant.h or using build_opt.h */
+/* Default stripe size in blocks of SdStripeDevice */
+#ifndef SD_STRIPE_SECTORS
+  #define SD_STRIPE_SECTORS  64
+#endif
+/* Number of blocks copied by each SdMirrorDevice::resyncStep() */
+#ifndef SD_RESYNC_STEP
+  #define SD_RESYNC_STEP     16
+#endif
+/* Alignment in bytes of the buffers for the fastest transfers: word
+   accesses of the SDMMC FIFO, 32 (cache line) with a DMA and the D-cache */
+#ifndef SD_BUFFER_ALIGN
+  #define SD_BUFFER_ALIGN    4
+#endif
+
+/*
+ * Block device mounted by SdFatFs: an SD card (Sd2Card) or a layer over
+ * other block devices, e.g. striping or mirroring two cards.
+ */
+class SdBlockDevice {
+  public:
+    /* Initialize the device, return true once ready */
+    virtual bool initialize(void) = 0;
+    virtual bool isReady(void) = 0;
+
+    virtual bool readBlocks(uint8_t *buf, uint32_t block, uint32_t count) = 0;
+    virtual bool writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count) = 0;
+    /* Erase (trim) blocks no longer used, false if not supported */
+    virtual bool eraseBlocks(uint32_t block, uint32_t count)
+    {
+      (void)block;
+      (void)count;
+      return false;
+    }
+    /* Complete the pending writes */
+    virtual bool syncBlocks(void)
+    {
+      return true;
+    }
+
+    /* Geometry */
+    virtual uint32_t blockCount(void) = 0;
+    virtual uint32_t blockSize(void)
+    {
+      return SD_BLOCK_SIZE;
+    }
+    /** Return the erase block size in blocks */
+    virtual uint32_t eraseSize(void)
+    {
+      return 1;
+    }
+
+    /* Asynchronous transfers: readStart() or writeStart() returns true once
+       started, then transferPoll() returns 1 while in progress, 0 once done
+       and -1 on error. The buffer has to be kept until done. By default, the
+       transfer is done by the start function. */
+    virtual bool readStart(uint8_t *buf, uint32_t block, uint32_t count)
+    {
+      _transfer = readBlocks(buf, block, count) ? 0 : -1;
+      return true;
+    }
+    virtual bool writeStart(const uint8_t *buf, uint32_t block, uint32_t count)
+    {
+      _transfer = writeBlocks(buf, block, count) ? 0 : -1;
+      return true;
+    }
+    virtual int transferPoll(void)
+    {
+      return _transfer;
+    }
+
+    /* Queued transfers: queueRead() or queueWrite() returns the task number
+       of the transfer, or -1 if the queue is full or on error. queuePoll()
+       runs the transfers and returns the mask of the tasks done since the
+       previous call, the failed ones in failed. The buffers have to be kept
+       until done. By default, the queue holds one task done by the submit
+       function. */
+    virtual uint8_t queueDepth(void)
+    {
+      return 1;
+    }
+    virtual int queueRead(uint8_t *buf, uint32_t block, uint32_t count)
+    {
+      if (_queueDone != 0) {
+        return -1;
+      }
+      _queueDone = 1;
+      _queueFailed = readBlocks(buf, block, count) ? 0 : 1;
+      return 0;
+    }
+    virtual int queueWrite(const uint8_t *buf, uint32_t block, uint32_t count)
+    {
+      if (_queueDone != 0) {
+        return -1;
+      }
+      _queueDone = 1;
+      _queueFailed = writeBlocks(buf, block, count) ? 0 : 1;
+      return 0;
+    }
+    virtual uint32_t queuePoll(uint32_t *failed = NULL)
+    {
+      uint32_t done = _queueDone;
+      if (failed != NULL) {
+        *failed = _queueFailed;
+      }
+      _queueDone = 0;
+      _queueFailed = 0;
+      return done;
+    }
+
+  protected:
+    int _transfer = 0;
+    uint32_t _queueDone = 0;
+    uint32_t _queueFailed = 0;
+};
+
+/*
+ * Stripes over two devices (RAID-0): the device alternates stripes of each
+ * device, its size is twice the smallest one in whole stripes.
+ */
+class SdStripeDevice : public SdBlockDevice {
+  public:
+    SdStripeDevice(SdBlockDevice *dev0 = NULL, SdBlockDevice *dev1 = NULL,
+                   uint32_t stripe = SD_STRIPE_SECTORS);
+    void setDevices(SdBlockDevice *dev0, SdBlockDevice *dev1,
+                    uint32_t stripe = SD_STRIPE_SECTORS);
+
+    virtual bool initialize(void);
+    virtual bool isReady(void);
+    virtual bool readBlocks(uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool eraseBlocks(uint32_t block, uint32_t count);
+    virtual bool syncBlocks(void);
+    virtual uint32_t blockCount(void);
+
+  private:
+    SdBlockDevice *_dev[2];
+    uint32_t _stripe;
+
+    SdBlockDevice *map(uint32_t *block, uint32_t *count) const;
+};
+
+/*
+ * Mirror on two devices (RAID-1): writes go to both devices, reads alternate
+ * between them. A device failing is left out until resynchronized.
+ */
+class SdMirrorDevice : public SdBlockDevice {
+  public:
+    SdMirrorDevice(SdBlockDevice *dev0 = NULL, SdBlockDevice *dev1 = NULL);
+    void setDevices(SdBlockDevice *dev0, SdBlockDevice *dev1);
+
+    virtual bool initialize(void);
+    virtual bool isReady(void);
+    virtual bool readBlocks(uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool writeBlocks(const uint8_t *buf, uint32_t block, uint32_t count);
+    virtual bool eraseBlocks(uint32_t block, uint32_t count);
+    virtual bool syncBlocks(void);
+    virtual uint32_t blockCount(void);
+
+    /* Copy a device from the other one by steps, e.g. once replaced */
+    bool resyncStart(SdBlockDevice *dev);
+    int resyncStep(uint32_t count = SD_RESYNC_STEP);
+    void resyncAbort(void);
+    /** Return true while a device is resynchronized */
+    bool resyncing(void) const
+    {
+      return _resync < 2;
+    }
+    /** Return true if a device failed and is left out */
+    bool degraded(void) const
+    {
+      return _offline != 0;
+    }
+
+  private:
+    SdBlockDevice *_dev[2];
+    uint8_t _offline = 0;    /* Mask of the devices left out */
+    uint8_t _readNext = 0;   /* Device read next */
+    uint8_t _resync = 2;     /* Device resynchronized, if any */
+    uint32_t _resyncNext = 0;
+    uint32_t _resyncEnd = 0;
+    uint8_t *_resyncBuf = NULL;
+
+    bool online(uint8_t i) const
+    {
+      return (_dev[i] != NULL) && ((_offline & (1 << i)) == 0);
+    }
+    bool readable(uint8_t i, uint32_t block, uint32_t count) const;
+};
+
+#endif
@@ -35,15 +35,59 @@
   */
 
 #include <Arduino.h>
+#include <strings.h>
 #include "SdFatFs.h"
 
+SdFatFs *SdFatFs::_volumes[SD_VOLUMES] = {};
+
+const Diskio_drvTypeDef SdFatFs::_driver = {
+  SdFatFs::diskInitialize,
+  SdFatFs::diskStatus,
+  SdFatFs::diskRead,
+#if _USE_WRITE == 1
+  SdFatFs::diskWrite,
+#endif
+#if _USE_IOCTL == 1
+  SdFatFs::diskIoctl,
+#endif
+};
+
+/**
+  * @brief  Constructor
+  * @param  dev: block device of the volume, e.g. an Sd2Card
+  */
+SdFatFs::SdFatFs(SdBlockDevice *dev)
+{
+  _dev = dev;
+}
+
 bool SdFatFs::init(void)
 {
   bool status = false;
+  /* Driver logical unit: first free volume index */
+  for (_lun = 0; _lun < SD_VOLUMES; _lun++) {
+    if ((_volumes[_lun] == NULL) || (_volumes[_lun] == this)) {
+      break;
+    }
+  }
+  if ((_dev == NULL) || (_lun >= SD_VOLUMES)) {
+    return false;
+  }
   /*##-1- Link the SD disk I/O driver ########################################*/
-  if (FATFS_LinkDriver(&SD_Driver, _SDPath) == 0) {
+  if (FATFS_LinkDriverEx(&_driver, _SDPath, _lun) == 0) {
+    _volumes[_lun] = this;
+    _pdrv = _SDPath[0] - '0';
+#if SD_META_CACHE_SIZE > 0
+    _metaCount = 0;
+#endif
+    _mirrorCount = 0;
     /*##-2- Register the file system object to the FatFs module ##############*/
-    if (f_mount(&_SDFatFs, (TCHAR const *)_SDPath, 1) == FR_OK) {
+    invalidate();
+    if (f_mount(&_SDFatFs, (TCHAR const *)_SDPath, _lazyMount ? 0 : 1) == FR_OK) {
+      _mountPending = true;
+      if (!_lazyMount) {
+        mount();
+      }
       /* FatFs Initialization done */
       status = true;
     }
@@ -54,17 +98,42 @@ bool SdFatFs::init(void)
 bool SdFatFs::deinit(void)
 {
   bool status = false;
+  bool flushed;
+  invalidate();
+#if SD_FS_RPATH
+  removeAbort();
+#endif
+  /* Buffered sectors not written make the deinit fail, the volume is still
+     unregistered */
+  flushed = (metaFlush() == RES_OK);
+  flushed = (mirrorFlush() == RES_OK) && flushed;
+  scanAbort();
+  mapDeinit();
   /*##-1- Unregister the file system object to the FatFs module ##############*/
   if (f_unmount((TCHAR const *)_SDPath) == FR_OK) {
     /*##-2- Unlink the SD disk I/O driver ####################################*/
     if (FATFS_UnLinkDriver(_SDPath) == 0) {
       /* FatFs deInitialization done */
-      status = true;
+      _volumes[_lun] = NULL;
+      status = flushed;
     }
   }
   return status;
 }
 
+/**
+  * @brief  Drop the buffered FAT and directory sectors and the second FAT
+  *         range not yet written, so a following deinit() does not access
+  *         the card. To be used once the card has been removed.
+  */
+void SdFatFs::discard(void)
+{
+#if SD_META_CACHE_SIZE > 0
+  _metaCount = 0;
+#endif
+  _mirrorCount = 0;
+}
+
 uint8_t SdFatFs::fatType(void)
 {
   uint8_t fatType = FAT_TYPE_UNK;
@@ -88,3 +157,1425 @@ uint8_t SdFatFs::fatType(void)
   }
   return fatType;
 }
+
+/**
+  * @brief  Count the free clusters of the volume by steps. FatFs keeps the
+  *         count up to date once known, this is only needed when the volume
+  *         has no valid FSINFO. Allocations done between two steps are taken
+  *         into account when FAT sectors already counted are written.
+  *         The same pass builds the free clusters map if enabled.
+  * @param  count: maximum number of FAT sectors to read
+  * @retval true once the free clusters count (and map) is known
+  */
+bool SdFatFs::freeScan(uint32_t count)
+{
+  SD_Sector_t base;
+  uint32_t nsect;
+  bool known;
+
+  if (!mount()) {
+    return false;
+  }
+  known = (*freeClst() <= (_SDFatFs.n_fatent - 2));
+  if (known && ((_freeMap == NULL) || _mapValid)) {
+    scanAbort();
+    return true;
+  }
+  if (!scanRange(&base, &nsect)) {
+    /* FAT12 entries are across sectors, let FatFs count them */
+    DWORD nclst;
+    FATFS *fs;
+    return (f_getfree((const TCHAR *)_SDPath, &nclst, &fs) == FR_OK);
+  }
+  if (_scanBuf == NULL) {
+    _scanBuf = (BYTE *)malloc(sizeof(_SDFatFs.win));
+    if (_scanBuf == NULL) {
+      return false;
+    }
+    _scanSect = 0;
+    _scanFree = 0;
+    _scanCount = !known;
+  }
+  while ((count > 0) && (_scanSect < nsect)) {
+    uint32_t nfree;
+    if (disk_read(_pdrv, _scanBuf, base + _scanSect, 1) != RES_OK) {
+      scanAbort();
+      return false;
+    }
+    nfree = countFree(_scanBuf, _scanSect);
+    _scanFree += nfree;
+    if (_freeMap != NULL) {
+      /* A group is free if any of its sectors has a free cluster */
+      uint32_t group = _scanSect >> _mapShift;
+      if ((_scanSect & ((1UL << _mapShift) - 1)) == 0) {
+        _mapGroupFree = false;
+      }
+      _mapGroupFree |= (nfree > 0);
+      if ((((_scanSect + 1) >> _mapShift) != group) || ((_scanSect + 1) == nsect)) {
+        mapSet(group, _mapGroupFree);
+      }
+    }
+    _scanSect++;
+    count--;
+  }
+  if (_scanSect < nsect) {
+    return false;
+  }
+  /* Count may have been set meanwhile by f_getfree() */
+  if (_scanCount && (*freeClst() > (_SDFatFs.n_fatent - 2))) {
+    /* Add changes of the FatFs window not yet written */
+    if (_SDFatFs.wflag && (_SDFatFs.winsect >= base) && (_SDFatFs.winsect < (base + nsect))) {
+      uint32_t sect = _SDFatFs.winsect - base;
+      if (disk_read(_pdrv, _scanBuf, _SDFatFs.winsect, 1) != RES_OK) {
+        scanAbort();
+        return false;
+      }
+      _scanFree += countFree(_SDFatFs.win, sect) - countFree(_scanBuf, sect);
+    }
+    *freeClst() = _scanFree;
+    /* Update FSINFO on next sync */
+    _SDFatFs.fsi_flag |= 1;
+  }
+  _mapValid = true;
+  scanAbort();
+  return true;
+}
+
+/**
+  * @brief  Get the number of free clusters, counted at first call if unknown
+  * @retval number of free clusters (0 on error)
+  */
+uint32_t SdFatFs::freeClusterCount(void)
+{
+  if (!freeScan(UINT32_MAX)) {
+    return 0;
+  }
+  return *freeClst();
+}
+
+/**
+  * @brief  Get the free space of the volume
+  * @retval free space in bytes
+  */
+uint64_t SdFatFs::freeBytes(void)
+{
+  return (uint64_t)freeClusterCount() * _SDFatFs.csize * sizeof(_SDFatFs.win);
+}
+
+/**
+  * @brief  Mount the volume if not yet done, e.g. after a lazy mount, and
+  *         run the init steps needing it
+  * @retval true if the volume is mounted
+  */
+bool SdFatFs::mount(void)
+{
+  if (_SDFatFs.fs_type == 0) {
+    DIR dir;
+    if (f_opendir(&dir, (const TCHAR *)_SDPath) != FR_OK) {
+      return false;
+    }
+    f_closedir(&dir);
+  }
+  if (_mountPending) {
+    _mountPending = false;
+    mapInit();
+  }
+  return true;
+}
+
+/**
+  * @brief  Get the FatFs free clusters count, valid if not above the number
+  *         of clusters
+  */
+DWORD *SdFatFs::freeClst(void)
+{
+#if (_FATFS == 68300) || (_FATFS == 80286)
+  return &_SDFatFs.free_clst;
+#else
+  return &_SDFatFs.free_clust;
+#endif
+}
+
+/**
+  * @brief  Get the FatFs last allocated cluster, where allocation search starts
+  */
+DWORD *SdFatFs::lastClst(void)
+{
+#if (_FATFS == 68300) || (_FATFS == 80286)
+  return &_SDFatFs.last_clst;
+#else
+  return &_SDFatFs.last_clust;
+#endif
+}
+
+/**
+  * @brief  Get the sectors holding the clusters allocation status
+  * @param  base: first sector of the FAT or exFAT allocation bitmap
+  * @param  nsect: number of sectors
+  * @retval false if the allocation status can't be counted by sector (FAT12)
+  */
+bool SdFatFs::scanRange(SD_Sector_t *base, uint32_t *nsect) const
+{
+  uint32_t nbytes;
+  switch (_SDFatFs.fs_type) {
+    case FS_FAT16:
+      *base = _SDFatFs.fatbase;
+      nbytes = _SDFatFs.n_fatent * 2;
+      break;
+    case FS_FAT32:
+      *base = _SDFatFs.fatbase;
+      nbytes = _SDFatFs.n_fatent * 4;
+      break;
+#if SD_FS_EXFAT
+    case FS_EXFAT:
+      *base = _SDFatFs.bitbase;
+      nbytes = (_SDFatFs.n_fatent - 2 + 7) / 8;
+      break;
+#endif
+    default:
+      return false;
+  }
+  *nsect = (nbytes + sizeof(_SDFatFs.win) - 1) / sizeof(_SDFatFs.win);
+  return true;
+}
+
+/**
+  * @brief  Count free clusters in a FAT or exFAT allocation bitmap sector
+  * @param  buf: sector content
+  * @param  sect: sector index in the FAT or bitmap
+  * @retval number of free clusters
+  */
+uint32_t SdFatFs::countFree(const BYTE *buf, uint32_t sect) const
+{
+  uint32_t nfree = 0;
+  uint32_t clst;
+  switch (_SDFatFs.fs_type) {
+    case FS_FAT16:
+      clst = sect * (sizeof(_SDFatFs.win) / 2);
+      for (uint32_t i = 0; i < sizeof(_SDFatFs.win); i += 2, clst++) {
+        if ((clst >= 2) && (clst < _SDFatFs.n_fatent) && ((buf[i] | buf[i + 1]) == 0)) {
+          nfree++;
+        }
+      }
+      break;
+    case FS_FAT32:
+      clst = sect * (sizeof(_SDFatFs.win) / 4);
+      for (uint32_t i = 0; i < sizeof(_SDFatFs.win); i += 4, clst++) {
+        if ((clst >= 2) && (clst < _SDFatFs.n_fatent) &&
+            ((buf[i] | buf[i + 1] | buf[i + 2] | (buf[i + 3] & 0x0F)) == 0)) {
+          nfree++;
+        }
+      }
+      break;
+#if SD_FS_EXFAT
+    case FS_EXFAT:
+      clst = sect * (sizeof(_SDFatFs.win) * 8);
+      for (uint32_t i = 0; (i < sizeof(_SDFatFs.win)) && (clst < (_SDFatFs.n_fatent - 2)); i++) {
+        for (uint8_t bit = 0; (bit < 8) && (clst < (_SDFatFs.n_fatent - 2)); bit++, clst++) {
+          if ((buf[i] & (1 << bit)) == 0) {
+            nfree++;
+          }
+        }
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+  return nfree;
+}
+
+/**
+  * @brief  Stop counting free clusters
+  */
+void SdFatFs::scanAbort(void)
+{
+  if (_scanBuf != NULL) {
+    free(_scanBuf);
+    _scanBuf = NULL;
+  }
+}
+
+/**
+  * @brief  Called before sectors are written on the disk
+  * @param  buff: data to write
+  * @param  sector: first sector
+  * @param  count: number of sectors
+  */
+void SdFatFs::beforeWrite(const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  SD_Sector_t base;
+  uint32_t nsect;
+
+  if (((_scanBuf == NULL) && (_freeMap == NULL)) || !scanRange(&base, &nsect)) {
+    return;
+  }
+  for (UINT i = 0; i < count; i++) {
+    const BYTE *data = buff + (i * sizeof(_SDFatFs.win));
+    uint32_t sect = (sector + i) - base;
+    uint32_t nfree;
+    if (((sector + i) < base) || (sect >= nsect)) {
+      continue;
+    }
+    nfree = countFree(data, sect);
+    /* Update free clusters of FAT sectors already counted */
+    if ((_scanBuf != NULL) && _scanCount && (sect < _scanSect)) {
+      if (disk_read(_pdrv, _scanBuf, sector + i, 1) != RES_OK) {
+        scanAbort();
+      } else {
+        _scanFree += nfree - countFree(_scanBuf, sect);
+      }
+    }
+    /* Update the free clusters map of groups already scanned */
+    if ((_freeMap != NULL) && (_mapValid || (sect < _scanSect))) {
+      uint32_t group = sect >> _mapShift;
+      if (nfree > 0) {
+        mapSet(group, true);
+        _mapGroupFree = true;
+      } else if ((_mapShift == 0) ||
+                 (mapGet(group) && mapGroupFull(group, buff, sector, count))) {
+        mapSet(group, false);
+      }
+    }
+  }
+}
+
+/**
+  * @brief  Allocate the free clusters map within SD_FREE_MAP_SIZE bytes,
+  *         one bit per group of FAT sectors, and start counting it. All
+  *         groups are considered free until counted by freeScan() steps,
+  *         run by SDClass::poll() and before each allocation.
+  */
+void SdFatFs::mapInit(void)
+{
+  SD_Sector_t base;
+  uint32_t nsect;
+
+  mapDeinit();
+#if SD_FREE_MAP_SIZE > 0
+  if (scanRange(&base, &nsect)) {
+    _mapShift = 0;
+    while (((nsect + (1UL << _mapShift) - 1) >> _mapShift) > (SD_FREE_MAP_SIZE * 8UL)) {
+      _mapShift++;
+    }
+    _mapGroups = (nsect + (1UL << _mapShift) - 1) >> _mapShift;
+    _freeMap = (uint8_t *)malloc((_mapGroups + 7) / 8);
+    if (_freeMap != NULL) {
+      memset(_freeMap, 0xFF, (_mapGroups + 7) / 8);
+      (void)freeScan(0);
+    }
+  }
+#else
+  UNUSED(base);
+  UNUSED(nsect);
+#endif
+}
+
+/**
+  * @brief  Free the free clusters map
+  */
+void SdFatFs::mapDeinit(void)
+{
+  if (_freeMap != NULL) {
+    free(_freeMap);
+    _freeMap = NULL;
+  }
+  _mapValid = false;
+}
+
+/**
+  * @brief  Set the free state of a group in the free clusters map
+  * @param  group: group index
+  * @param  isFree: true if the group has at least one free cluster
+  */
+void SdFatFs::mapSet(uint32_t group, bool isFree)
+{
+  if (group < _mapGroups) {
+    if (isFree) {
+      _freeMap[group / 8] |= (1 << (group % 8));
+    } else {
+      _freeMap[group / 8] &= ~(1 << (group % 8));
+    }
+  }
+}
+
+/**
+  * @brief  Get the free state of a group in the free clusters map
+  * @param  group: group index
+  * @retval true if the group may have a free cluster
+  */
+bool SdFatFs::mapGet(uint32_t group) const
+{
+  return (group < _mapGroups) && ((_freeMap[group / 8] & (1 << (group % 8))) != 0);
+}
+
+/**
+  * @brief  Check that a group of several FAT sectors has no free cluster left,
+  *         once one of its sectors is full. The sectors being written are
+  *         checked from the written data, the other ones are read.
+  * @param  group: group index
+  * @param  buff: data being written
+  * @param  sector: first sector being written
+  * @param  count: number of sectors being written
+  * @retval true if the group is full, false if not or unknown
+  */
+bool SdFatFs::mapGroupFull(uint32_t group, const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  SD_Sector_t base;
+  uint32_t nsect;
+  uint32_t end;
+  BYTE *buf = _scanBuf;
+  bool full = true;
+
+  if (!scanRange(&base, &nsect)) {
+    return false;
+  }
+  if (buf == NULL) {
+    buf = (BYTE *)malloc(sizeof(_SDFatFs.win));
+    if (buf == NULL) {
+      return false;
+    }
+  }
+  end = (group + 1) << _mapShift;
+  if (end > nsect) {
+    end = nsect;
+  }
+  for (uint32_t sect = group << _mapShift; full && (sect < end); sect++) {
+    const BYTE *data = buf;
+    if (((base + sect) >= sector) && ((base + sect) < (sector + count))) {
+      data = buff + ((base + sect - sector) * sizeof(_SDFatFs.win));
+    } else if (disk_read(_pdrv, buf, base + sect, 1) != RES_OK) {
+      full = false;
+      break;
+    }
+    full = (countFree(data, sect) == 0);
+  }
+  if (buf != _scanBuf) {
+    free(buf);
+  }
+  return full;
+}
+
+/**
+  * @brief  Point the FatFs allocation start to the next group having free
+  *         clusters, so finding a free cluster does not read full FAT sectors.
+  *         To be called before clusters are allocated: file writes and
+  *         directory creations. Runs a step of the map count if not done.
+  */
+void SdFatFs::allocHint(void)
+{
+  uint32_t perSect;
+  uint32_t first = 0;
+  uint32_t clst;
+  uint32_t group;
+
+  if (!mount() || (_freeMap == NULL)) {
+    return;
+  }
+  if (_scanBuf != NULL) {
+    (void)freeScan();
+  }
+  switch (_SDFatFs.fs_type) {
+    case FS_FAT16:
+      perSect = sizeof(_SDFatFs.win) / 2;
+      break;
+#if SD_FS_EXFAT
+    case FS_EXFAT:
+      /* Bitmap starts at cluster 2 */
+      perSect = sizeof(_SDFatFs.win) * 8;
+      first = 2;
+      break;
+#endif
+    default:
+      perSect = sizeof(_SDFatFs.win) / 4;
+      break;
+  }
+  clst = *lastClst();
+  if ((clst < 2) || (clst >= _SDFatFs.n_fatent)) {
+    clst = 2;
+  }
+  group = ((clst - first) / perSect) >> _mapShift;
+  for (uint32_t i = 0; i < _mapGroups; i++) {
+    if (_freeMap[group / 8] & (1 << (group % 8))) {
+      if (i != 0) {
+        /* Allocation starts after the hinted cluster */
+        clst = ((group << _mapShift) * perSect) + first;
+        *lastClst() = (clst > 2) ? (clst - 1) : 1;
+      }
+      return;
+    }
+    group = (group + 1 < _mapGroups) ? (group + 1) : 0;
+  }
+}
+
+/**
+  * @brief  Disk I/O driver of the volume, forwarding to the SD driver
+  */
+DSTATUS SdFatFs::diskInitialize(BYTE lun)
+{
+  SdFatFs *vol = volume(lun);
+  return ((vol != NULL) && vol->_dev->initialize()) ? 0 : STA_NOINIT;
+}
+
+DSTATUS SdFatFs::diskStatus(BYTE lun)
+{
+  SdFatFs *vol = volume(lun);
+  return ((vol != NULL) && vol->_dev->isReady()) ? 0 : STA_NOINIT;
+}
+
+DRESULT SdFatFs::diskRead(BYTE lun, BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  SD_PROBE_SCOPE(SD_PROBE_DISK_READ);
+  SdFatFs *vol = volume(lun);
+
+  if (vol == NULL) {
+    return RES_NOTRDY;
+  }
+#if SD_META_CACHE_SIZE > 0
+  if ((count == 1) && (vol->metaFind(sector) >= 0)) {
+    vol->metaRead(buff, sector, count);
+#if SD_IO_STATS
+    vol->_ioStats.cacheHits++;
+    if (vol->_ioFile != NULL) {
+      vol->_ioFile->cacheHits++;
+    }
+#endif
+    return RES_OK;
+  }
+#endif
+  if (!vol->_dev->readBlocks(buff, sector, count)) {
+    return RES_ERROR;
+  }
+#if SD_IO_STATS
+  vol->ioCount(sector, count, false);
+#endif
+#if SD_META_CACHE_SIZE > 0
+  /* Buffered sectors are newer than the card ones */
+  vol->metaRead(buff, sector, count);
+#endif
+  return RES_OK;
+}
+
+#if _USE_WRITE == 1
+DRESULT SdFatFs::diskWrite(BYTE lun, const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  SD_PROBE_SCOPE(SD_PROBE_DISK_WRITE);
+  SdFatFs *vol = volume(lun);
+
+  if (vol == NULL) {
+    return RES_NOTRDY;
+  }
+  if (vol->mirrorWrite(buff, sector, count)) {
+    return RES_OK;
+  }
+  vol->beforeWrite(buff, sector, count);
+#if SD_META_CACHE_SIZE > 0
+  if (vol->metaWrite(buff, sector, count)) {
+    return RES_OK;
+  }
+#endif
+  return vol->blockWrite(buff, sector, count);
+}
+#endif
+
+#if _USE_IOCTL == 1
+DRESULT SdFatFs::diskIoctl(BYTE lun, BYTE cmd, void *buff)
+{
+  SdFatFs *vol = volume(lun);
+  DRESULT res = RES_OK;
+
+  if (vol == NULL) {
+    return RES_NOTRDY;
+  }
+  switch (cmd) {
+    case CTRL_SYNC:
+#if SD_IO_STATS
+      vol->_ioStats.syncs++;
+#endif
+      if (vol->metaFlush() != RES_OK) {
+        return RES_ERROR;
+      }
+      if ((vol->_mirrorMode == SD_FAT_MIRROR_SYNC) && (vol->mirrorFlush() != RES_OK)) {
+        return RES_ERROR;
+      }
+      if (!vol->_dev->syncBlocks()) {
+        res = RES_ERROR;
+      }
+      break;
+    case GET_SECTOR_COUNT:
+      *(SD_Sector_t *)buff = vol->_dev->blockCount();
+      if (*(SD_Sector_t *)buff == 0) {
+        res = RES_ERROR;
+      }
+      break;
+    case GET_SECTOR_SIZE:
+      *(WORD *)buff = vol->_dev->blockSize();
+      break;
+    case GET_BLOCK_SIZE:
+      *(DWORD *)buff = vol->_dev->eraseSize();
+      break;
+#if defined(CTRL_TRIM)
+    case CTRL_TRIM: {
+      SD_Sector_t *range = (SD_Sector_t *)buff;
+      if (!vol->_dev->eraseBlocks(range[0], range[1] - range[0] + 1)) {
+        res = RES_ERROR;
+      }
+      break;
+    }
+#endif
+    default:
+      res = RES_PARERR;
+      break;
+  }
+  return res;
+}
+#endif
+
+/**
+  * @brief  Write sectors to the block device
+  * @retval RES_OK on success
+  */
+DRESULT SdFatFs::blockWrite(const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  if (!_dev->writeBlocks(buff, sector, count)) {
+    return RES_ERROR;
+  }
+#if SD_IO_STATS
+  ioCount(sector, count, true);
+#endif
+  return RES_OK;
+}
+
+#if SD_IO_STATS
+/**
+  * @brief  Count sectors transferred with the block device
+  * @param  sector: first sector
+  * @param  count: number of sectors
+  * @param  write: true if written, false if read
+  * @retval None
+  */
+void SdFatFs::ioCount(SD_Sector_t sector, UINT count, bool write)
+{
+  SD_Sector_t fatEnd = _SDFatFs.fatbase + ((SD_Sector_t)_SDFatFs.fsize * _SDFatFs.n_fats);
+  SD_IoStats_t *targets[2] = { &_ioStats, _ioFile };
+  uint32_t fat = 0;
+
+  /* Sectors in the FAT copies */
+  if ((sector < fatEnd) && ((sector + count) > _SDFatFs.fatbase)) {
+    SD_Sector_t first = (sector > _SDFatFs.fatbase) ? sector : _SDFatFs.fatbase;
+    SD_Sector_t last = ((sector + count) < fatEnd) ? (sector + count) : fatEnd;
+    fat = (uint32_t)(last - first);
+  }
+  for (SD_IoStats_t *stats : targets) {
+    if (stats == NULL) {
+      continue;
+    }
+    if (write) {
+      stats->sectorsWritten += count;
+      stats->fatWrites += fat;
+    } else {
+      stats->sectorsRead += count;
+      stats->fatReads += fat;
+    }
+  }
+}
+
+/**
+  * @brief  Count a file call in the volume and file counters, and stop
+  *         counting the file sectors
+  * @param  call: SD_IO_READ, SD_IO_WRITE or SD_IO_SYNC
+  * @param  bytes: bytes read or written
+  * @retval None
+  */
+void SdFatFs::ioEnd(uint8_t call, uint32_t bytes)
+{
+  SD_IoStats_t *targets[2] = { &_ioStats, _ioFile };
+
+  for (SD_IoStats_t *stats : targets) {
+    if (stats == NULL) {
+      continue;
+    }
+    switch (call) {
+      case SD_IO_READ:
+        stats->readCalls++;
+        stats->bytesRead += bytes;
+        break;
+      case SD_IO_WRITE:
+        stats->writeCalls++;
+        stats->bytesWritten += bytes;
+        break;
+      default:
+        /* Volume syncs are counted by CTRL_SYNC */
+        if (stats == _ioFile) {
+          stats->syncs++;
+        }
+        break;
+    }
+  }
+  _ioFile = NULL;
+}
+
+/**
+  * @brief  Clear the I/O counters of the volume
+  * @retval None
+  */
+void SdFatFs::resetIoStats(void)
+{
+  memset(&_ioStats, 0, sizeof(_ioStats));
+}
+#endif
+
+/**
+  * @brief  Get the volume using a driver logical unit
+  */
+SdFatFs *SdFatFs::volume(BYTE lun)
+{
+  return (lun < SD_VOLUMES) ? _volumes[lun] : NULL;
+}
+
+/**
+  * @brief  Make the volume the FatFs current drive, so paths without drive
+  *         number refer to it
+  */
+void SdFatFs::select(void)
+{
+#if SD_FS_RPATH && (SD_VOLUMES >= 2)
+  f_chdrive((const TCHAR *)_SDPath);
+#endif
+}
+
+/**
+  * @brief  Write the buffered FAT and directory sectors to the card.
+  *         Done on each FatFs sync (file close or flush) and at deinit.
+  * @retval true on success
+  */
+bool SdFatFs::flush(void)
+{
+  return (metaFlush() == RES_OK);
+}
+
+/**
+  * @brief  Write the buffered sectors by ascending sector number, each range
+  *         of contiguous sectors (e.g. the updated part of each FAT copy)
+  *         with a single multi-block write
+  * @retval RES_OK on success, buffered sectors are kept on error
+  */
+DRESULT SdFatFs::metaFlush(void)
+{
+#if SD_META_CACHE_SIZE > 0
+  uint8_t i, j;
+
+  for (i = 0; (i + 1) < _metaCount; i++) {
+    uint8_t min = i;
+    for (j = i + 1; j < _metaCount; j++) {
+      if (_metaSect[j] < _metaSect[min]) {
+        min = j;
+      }
+    }
+    if (min != i) {
+      metaSwap(i, min);
+    }
+  }
+  for (i = 0; i < _metaCount; i += j) {
+    j = 1;
+    while (((i + j) < _metaCount) && (_metaSect[i + j] == (_metaSect[i] + j))) {
+      j++;
+    }
+    if (blockWrite(_metaBuf[i], _metaSect[i], j) != RES_OK) {
+      return RES_ERROR;
+    }
+  }
+  _metaCount = 0;
+#endif
+  return RES_OK;
+}
+
+/**
+  * @brief  Copy the sectors of the first FAT updated since the last call
+  *         to the second FAT, e.g. when the application is idle
+  * @retval true on success
+  */
+bool SdFatFs::mirrorFat(void)
+{
+  return ((metaFlush() == RES_OK) && (mirrorFlush() == RES_OK));
+}
+
+/**
+  * @brief  Skip the write of a second FAT sector done by FatFs along the
+  *         first FAT one when the second FAT is updated lazily. Only the
+  *         ranges of updated sectors are kept.
+  * @param  buff: data to write
+  * @param  sector: first sector
+  * @param  count: number of sectors
+  * @retval true if the write is skipped
+  */
+bool SdFatFs::mirrorWrite(const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  SD_Sector_t fat2 = _SDFatFs.fatbase + _SDFatFs.fsize;
+  uint32_t sect;
+
+  if ((_mirrorMode == SD_FAT_MIRROR_ALWAYS) || (buff != _SDFatFs.win) || (count != 1) ||
+      (_SDFatFs.n_fats != 2) || (sector < fat2) || (sector >= (fat2 + _SDFatFs.fsize))) {
+    return false;
+  }
+  sect = sector - fat2;
+  mirrorAdd(sect);
+  return true;
+}
+
+/**
+  * @brief  Add an updated FAT sector to the ranges to copy. A sector next to
+  *         a range extends it, otherwise a new range is used. Once all ranges
+  *         are used, the closest one is extended to the sector.
+  * @param  sect: sector index in the FAT
+  */
+void SdFatFs::mirrorAdd(uint32_t sect)
+{
+  MirrorRange *range = NULL;
+  uint32_t gap = UINT32_MAX;
+  uint8_t i;
+
+  for (i = 0; i < _mirrorCount; i++) {
+    MirrorRange *r = &_mirrorRanges[i];
+    uint32_t d = 0;
+    if ((sect + 1) < r->first) {
+      d = r->first - sect - 1;
+    } else if (sect > (r->last + 1)) {
+      d = sect - r->last - 1;
+    }
+    if (d < gap) {
+      gap = d;
+      range = r;
+    }
+  }
+  if ((gap > 0) && (_mirrorCount < SD_FAT_MIRROR_RANGES)) {
+    range = &_mirrorRanges[_mirrorCount++];
+    range->first = sect;
+    range->last = sect;
+    return;
+  }
+  if (sect < range->first) {
+    range->first = sect;
+  }
+  if (sect > range->last) {
+    range->last = sect;
+  }
+  /* Merge the ranges now overlapping or next to the extended one */
+  i = 0;
+  while (i < _mirrorCount) {
+    MirrorRange *r = &_mirrorRanges[i];
+    if ((r != range) && (r->first <= (range->last + 1)) && (range->first <= (r->last + 1))) {
+      if (r->first < range->first) {
+        range->first = r->first;
+      }
+      if (r->last > range->last) {
+        range->last = r->last;
+      }
+      /* Move the last range in place of the merged one */
+      _mirrorCount--;
+      if (range == &_mirrorRanges[_mirrorCount]) {
+        range = r;
+      }
+      *r = _mirrorRanges[_mirrorCount];
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+  * @brief  Copy the updated ranges of the first FAT to the second one by
+  *         multi-block reads and writes of SD_FAT_MIRROR_CHUNK sectors
+  * @retval RES_OK on success, the ranges not copied are kept on error
+  */
+DRESULT SdFatFs::mirrorFlush(void)
+{
+  SD_Sector_t fat2 = _SDFatFs.fatbase + _SDFatFs.fsize;
+  uint32_t chunk = 0;
+  BYTE *buf;
+
+  if (_mirrorCount == 0) {
+    return RES_OK;
+  }
+  for (uint8_t i = 0; i < _mirrorCount; i++) {
+    uint32_t n = _mirrorRanges[i].last - _mirrorRanges[i].first + 1;
+    if (n > chunk) {
+      chunk = n;
+    }
+  }
+  if (chunk > SD_FAT_MIRROR_CHUNK) {
+    chunk = SD_FAT_MIRROR_CHUNK;
+  }
+  buf = (BYTE *)malloc(chunk * sizeof(_SDFatFs.win));
+  if (buf == NULL) {
+    return RES_ERROR;
+  }
+  while (_mirrorCount > 0) {
+    MirrorRange *r = &_mirrorRanges[_mirrorCount - 1];
+    uint32_t n = r->last - r->first + 1;
+    if (n > chunk) {
+      n = chunk;
+    }
+    /* Read through the driver to get the buffered sectors */
+    if ((disk_read(_pdrv, buf, _SDFatFs.fatbase + r->first, n) != RES_OK) ||
+        (blockWrite(buf, fat2 + r->first, n) != RES_OK)) {
+      free(buf);
+      return RES_ERROR;
+    }
+#if SD_META_CACHE_SIZE > 0
+    metaDrop(fat2 + r->first, n);
+#endif
+    r->first += n;
+    if (r->first > r->last) {
+      _mirrorCount--;
+    }
+  }
+  free(buf);
+  return RES_OK;
+}
+
+#if SD_META_CACHE_SIZE > 0
+/**
+  * @brief  Find a buffered sector
+  * @param  sector: sector number
+  * @retval slot index, -1 if not buffered
+  */
+int SdFatFs::metaFind(SD_Sector_t sector) const
+{
+  for (uint8_t i = 0; i < _metaCount; i++) {
+    if (_metaSect[i] == sector) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+  * @brief  Buffer a sector written from the FatFs window. Other writes are
+  *         file data which supersede buffered sectors of reused clusters.
+  *         All sectors are flushed when no slot is left.
+  * @param  buff: data to write
+  * @param  sector: first sector
+  * @param  count: number of sectors
+  * @retval true if buffered, false if it has to be written to the card
+  */
+bool SdFatFs::metaWrite(const BYTE *buff, SD_Sector_t sector, UINT count)
+{
+  int slot;
+
+  if ((buff != _SDFatFs.win) || (count != 1)) {
+    metaDrop(sector, count);
+    return false;
+  }
+  slot = metaFind(sector);
+  if (slot < 0) {
+    if ((_metaCount == SD_META_CACHE_SIZE) && (metaFlush() != RES_OK)) {
+      return false;
+    }
+    slot = _metaCount++;
+    _metaSect[slot] = sector;
+  }
+  memcpy(_metaBuf[slot], buff, sizeof(_SDFatFs.win));
+  return true;
+}
+
+/**
+  * @brief  Copy the buffered sectors of a range read from the card
+  */
+void SdFatFs::metaRead(BYTE *buff, SD_Sector_t sector, UINT count) const
+{
+  for (uint8_t i = 0; i < _metaCount; i++) {
+    if ((_metaSect[i] >= sector) && (_metaSect[i] < (sector + count))) {
+      memcpy(buff + ((_metaSect[i] - sector) * sizeof(_SDFatFs.win)), _metaBuf[i], sizeof(_SDFatFs.win));
+    }
+  }
+}
+
+/**
+  * @brief  Forget the buffered sectors of a range written to the card
+  */
+void SdFatFs::metaDrop(SD_Sector_t sector, UINT count)
+{
+  uint8_t i = 0;
+  while (i < _metaCount) {
+    if ((_metaSect[i] >= sector) && (_metaSect[i] < (sector + count))) {
+      _metaCount--;
+      if (i != _metaCount) {
+        metaSwap(i, _metaCount);
+      }
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+  * @brief  Exchange two buffered sectors
+  */
+void SdFatFs::metaSwap(uint8_t a, uint8_t b)
+{
+  uint32_t *pa = (uint32_t *)_metaBuf[a];
+  uint32_t *pb = (uint32_t *)_metaBuf[b];
+  SD_Sector_t sect = _metaSect[a];
+
+  _metaSect[a] = _metaSect[b];
+  _metaSect[b] = sect;
+  for (size_t i = 0; i < (sizeof(_SDFatFs.win) / sizeof(uint32_t)); i++) {
+    uint32_t tmp = pa[i];
+    pa[i] = pb[i];
+    pb[i] = tmp;
+  }
+}
+#endif
+
+/**
+  * @brief  Resolve the parent directory of an absolute path using the path cache.
+  *         On success the FatFs current directory is temporarily set to the
+  *         parent directory and only the last path component is returned,
+  *         so FatFs does not walk the parent chain from the root again.
+  * @param  path: file or directory path
+  * @retval path to give to FatFs, release() has to be called once done
+  */
+const TCHAR *SdFatFs::lookup(const char *path)
+{
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+  const char *leaf = strrchr(path, '/');
+  PathCacheEntry *entry = NULL;
+  size_t len;
+#endif
+
+  select();
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+  _dirChanged = false;
+  /* Only paths with a parent directory other than root are cached */
+  if (!cacheable(path) || (leaf == path) || (leaf[1] == '\0')) {
+    return (const TCHAR *)path;
+  }
+  len = leaf - path;
+  if (len >= SD_PATH_CACHE_LEN) {
+    return (const TCHAR *)path;
+  }
+  getDir(&_savedDir);
+  entry = findPath(path, len);
+  if (entry == NULL) {
+    /* Open the parent starting from the deepest cached ancestor, if any */
+    char parent[SD_PATH_CACHE_LEN];
+    const char *sub = path;
+    DIR dir;
+    for (const char *p = leaf - 1; p > path; p--) {
+      if (*p == '/') {
+        PathCacheEntry *ancestor = findPath(path, p - path);
+        if (ancestor != NULL) {
+          setDir(&ancestor->dir);
+          sub = p + 1;
+          break;
+        }
+      }
+    }
+    memcpy(parent, sub, leaf - sub);
+    parent[leaf - sub] = '\0';
+    if (f_opendir(&dir, (const TCHAR *)parent) == FR_OK) {
+      DirContext ctx;
+      dirContext(&dir, &ctx);
+      f_closedir(&dir);
+      insertPath(path, len, &ctx);
+      entry = findPath(path, len);
+    }
+    setDir(&_savedDir);
+    if (entry == NULL) {
+      /* Let FatFs report the error on the full path */
+      return (const TCHAR *)path;
+    }
+  }
+  setDir(&entry->dir);
+  _dirChanged = true;
+  return (const TCHAR *)(leaf + 1);
+#else
+  return (const TCHAR *)path;
+#endif
+}
+
+/**
+  * @brief  Restore the FatFs current directory changed by lookup()
+  */
+void SdFatFs::release(void)
+{
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+  if (_dirChanged) {
+    setDir(&_savedDir);
+    _dirChanged = false;
+  }
+#endif
+}
+
+/**
+  * @brief  Drop path cache entries
+  * @param  path: removed directory path, all entries are dropped if NULL
+  *         or relative
+  */
+void SdFatFs::invalidate(const char *path)
+{
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+  size_t len = (path != NULL) ? strlen(path) : 0;
+  for (uint8_t i = 0; i < SD_PATH_CACHE_SIZE; i++) {
+    PathCacheEntry *entry = &_pathCache[i];
+    if ((path == NULL) || (path[0] != '/') ||
+        ((strncasecmp(entry->path, path, len) == 0) &&
+         ((entry->path[len] == '\0') || (entry->path[len] == '/')))) {
+      entry->path[0] = '\0';
+      entry->stamp = 0;
+    }
+  }
+#else
+  UNUSED(path);
+#endif
+}
+
+/**
+  * @brief  Create a directory and all its missing parents. The path is
+  *         walked once: each level is entered from its parent directory,
+  *         and created there if missing, starting from the deepest level of
+  *         an absolute path found in the path cache. Levels are added to the
+  *         cache on the way.
+  * @param  path: directory path
+  * @retval FR_OK if created or already existing, FR_EXIST if a file has the
+  *         name of the directory, else FatFs error
+  */
+FRESULT SdFatFs::mkdir(const char *path)
+{
+  FRESULT res = FR_OK;
+  size_t len = strlen(path);
+  char *buf = NULL;
+
+  if (len == 0) {
+    return FR_INVALID_NAME;
+  }
+  select();
+  allocHint();
+  buf = (char *)malloc(len + 1);
+  if (buf == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  memcpy(buf, path, len + 1);
+  /* Remove trailing separators */
+  while ((len > 1) && (buf[len - 1] == '/')) {
+    buf[--len] = '\0';
+  }
+#if SD_FS_RPATH
+  if (mount() && (strchr(buf, ':') == NULL)) {
+    DirContext savedDir;
+    DirContext ctx = {}; /* Root directory */
+    char *name = buf;
+    getDir(&savedDir);
+    if (buf[0] == '/') {
+      name++;
+#if SD_PATH_CACHE_SIZE > 0
+      /* Start from the deepest level already in the cache */
+      for (size_t i = len; i > 0; i--) {
+        if ((buf[i] == '/') || (buf[i] == '\0')) {
+          PathCacheEntry *entry = findPath(buf, i);
+          if (entry != NULL) {
+            ctx = entry->dir;
+            name = buf + i + ((i < len) ? 1 : 0);
+            break;
+          }
+        }
+      }
+#endif
+    } else {
+      /* Relative to the current directory */
+      ctx = savedDir;
+    }
+    setDir(&ctx);
+    while ((res == FR_OK) && (*name != '\0')) {
+      char *sep = strchr(name, '/');
+      if (sep != NULL) {
+        *sep = '\0';
+      }
+      if (*name != '\0') {
+        /* Enter the level, created if missing. Dot entries only move
+           through the hierarchy */
+        res = f_chdir((const TCHAR *)name);
+        if (((res == FR_NO_PATH) || (res == FR_NO_FILE)) &&
+            (strcmp(name, ".") != 0) && (strcmp(name, "..") != 0)) {
+          res = f_mkdir((const TCHAR *)name);
+          if (res == FR_OK) {
+            res = f_chdir((const TCHAR *)name);
+          } else if ((res == FR_EXIST) && (sep != NULL)) {
+            /* A file in the path */
+            res = FR_NO_PATH;
+          }
+        }
+#if SD_PATH_CACHE_SIZE > 0
+        if ((res == FR_OK) && (buf[0] == '/')) {
+          size_t plen = (name - buf) + strlen(name);
+          getDir(&ctx);
+          if (plen < SD_PATH_CACHE_LEN) {
+            insertPath(buf, plen, &ctx);
+          }
+        }
+#endif
+      }
+      if (sep == NULL) {
+        break;
+      }
+      *sep = '/';
+      name = sep + 1;
+    }
+    setDir(&savedDir);
+  } else
+#endif
+  {
+    /* Create each level from its full path */
+    for (char *p = buf + 1; res == FR_OK; p++) {
+      if ((*p == '/') || (*p == '\0')) {
+        char c = *p;
+        *p = '\0';
+        res = f_mkdir((const TCHAR *)buf);
+        if ((res == FR_EXIST) && (c != '\0')) {
+          res = FR_OK;
+        }
+        *p = c;
+        if (c == '\0') {
+          break;
+        }
+      }
+    }
+  }
+  free(buf);
+  return res;
+}
+
+#if SD_FS_RPATH
+/**
+  * @brief  Start the recursive removal of a directory and all its content.
+  *         Sub-directories are opened from their parent directory and entries
+  *         are removed by their name in the current directory, so no path is
+  *         resolved again from the root.
+  * @param  path: directory path
+  * @retval FatFs error if the directory can't be opened
+  */
+FRESULT SdFatFs::removeStart(const char *path)
+{
+  FRESULT res;
+
+  removeAbort();
+  _rmLevels = (RemoveLevel *)malloc(SD_REMOVE_DEPTH * sizeof(RemoveLevel));
+  _rmPath = (char *)malloc(strlen(path) + 1);
+  if ((_rmLevels == NULL) || (_rmPath == NULL)) {
+    removeAbort();
+    return FR_NOT_ENOUGH_CORE;
+  }
+  strcpy(_rmPath, path);
+  res = f_opendir(&_rmLevels[0].dir, lookup(path));
+  release();
+  if (res == FR_OK) {
+    /* The cached levels of the sub-tree become invalid as it is freed */
+    invalidate(_rmPath);
+    dirContext(&_rmLevels[0].dir, &_rmLevels[0].ctx);
+    _rmLevels[0].name[0] = '\0';
+    _rmDepth = 0;
+  } else {
+    removeAbort();
+  }
+  return res;
+}
+
+/**
+  * @brief  Run a part of the recursive removal started with removeStart()
+  * @param  count: maximum number of directory entries to process
+  * @param  done: set to true once the directory itself has been removed
+  * @retval FatFs error, the removal is stopped on error
+  */
+FRESULT SdFatFs::removeStep(uint32_t count, bool *done)
+{
+  FRESULT res = FR_OK;
+  DirContext savedDir;
+  FILINFO fno;
+
+  *done = false;
+  if (_rmDepth < 0) {
+    return FR_INVALID_OBJECT;
+  }
+  select();
+#if SD_USE_LFN && (_FATFS != 68300) && (_FATFS != 80286)
+  fno.lfname = NULL;
+  fno.lfsize = 0;
+#endif
+  getDir(&savedDir);
+  while ((res == FR_OK) && (count > 0) && (_rmDepth >= 0)) {
+    RemoveLevel *level = &_rmLevels[_rmDepth];
+    count--;
+    res = f_readdir(&level->dir, &fno);
+    if (res != FR_OK) {
+      break;
+    }
+    if (fno.fname[0] == '\0') {
+      /* End of directory: remove it from its parent */
+      f_closedir(&level->dir);
+      if (_rmDepth == 0) {
+        setDir(&savedDir);
+        res = f_unlink(lookup(_rmPath));
+        release();
+        invalidate(_rmPath);
+        *done = true;
+      } else {
+        setDir(&_rmLevels[_rmDepth - 1].ctx);
+        res = f_unlink((const TCHAR *)level->name);
+        /* Levels looked up again since the previous step */
+        invalidate(_rmPath);
+      }
+      _rmDepth--;
+      continue;
+    }
+    if ((strcmp(fno.fname, ".") == 0) || (strcmp(fno.fname, "..") == 0)) {
+      continue;
+    }
+    setDir(&level->ctx);
+    if (fno.fattrib & AM_DIR) {
+      /* Go down, keep the full name to remove it once empty: exFAT has no
+         short names */
+      RemoveLevel *child = NULL;
+      if (_rmDepth + 1 >= SD_REMOVE_DEPTH) {
+        res = FR_NOT_ENOUGH_CORE;
+        break;
+      }
+      child = &_rmLevels[_rmDepth + 1];
+      memcpy(child->name, fno.fname, sizeof(child->name));
+      res = f_opendir(&child->dir, (const TCHAR *)child->name);
+      if (res == FR_OK) {
+        dirContext(&child->dir, &child->ctx);
+        _rmDepth++;
+      }
+    } else {
+      res = f_unlink((const TCHAR *)fno.fname);
+    }
+  }
+  setDir(&savedDir);
+  if ((res != FR_OK) || *done) {
+    removeAbort();
+  }
+  return res;
+}
+
+/**
+  * @brief  Stop a recursive removal and free its resources
+  */
+void SdFatFs::removeAbort(void)
+{
+  if (_rmLevels != NULL) {
+    for (int8_t i = _rmDepth; i >= 0; i--) {
+      f_closedir(&_rmLevels[i].dir);
+    }
+    free(_rmLevels);
+    _rmLevels = NULL;
+  }
+  if (_rmPath != NULL) {
+    /* Sub-directories may have been removed */
+    invalidate(_rmPath);
+    free(_rmPath);
+    _rmPath = NULL;
+  }
+  _rmDepth = -1;
+}
+
+/**
+  * @brief  Get the FatFs current directory
+  * @param  ctx: current directory
+  */
+void SdFatFs::getDir(DirContext *ctx) const
+{
+  ctx->clust = _SDFatFs.cdir;
+#if SD_FS_EXFAT
+  ctx->c_scl = _SDFatFs.cdc_scl;
+  ctx->c_size = _SDFatFs.cdc_size;
+  ctx->c_ofs = _SDFatFs.cdc_ofs;
+#endif
+}
+
+/**
+  * @brief  Set the FatFs current directory
+  * @param  ctx: new current directory
+  */
+void SdFatFs::setDir(const DirContext *ctx)
+{
+  _SDFatFs.cdir = ctx->clust;
+#if SD_FS_EXFAT
+  _SDFatFs.cdc_scl = ctx->c_scl;
+  _SDFatFs.cdc_size = ctx->c_size;
+  _SDFatFs.cdc_ofs = ctx->c_ofs;
+#endif
+}
+
+/**
+  * @brief  Get the current directory context matching an opened directory,
+  *         as f_chdir() would set it
+  * @param  dir: opened directory
+  * @param  ctx: directory context
+  */
+void SdFatFs::dirContext(const DIR *dir, DirContext *ctx)
+{
+#if (_FATFS == 68300) || (_FATFS == 80286)
+  ctx->clust = dir->obj.sclust;
+#if SD_FS_EXFAT
+  ctx->c_scl = dir->obj.c_scl;
+  ctx->c_size = dir->obj.c_size;
+  ctx->c_ofs = dir->obj.c_ofs;
+#endif
+#else
+  ctx->clust = dir->sclust;
+#endif
+}
+#endif /* SD_FS_RPATH */
+
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+/**
+  * @brief  Check if the path cache can be used to resolve a path
+  * @param  path: file or directory path
+  * @retval true if the volume is mounted and the path absolute
+  */
+bool SdFatFs::cacheable(const char *path) const
+{
+  return (_SDFatFs.fs_type != 0) && (path[0] == '/') && (strchr(path, ':') == NULL);
+}
+
+/**
+  * @brief  Search a directory in the path cache
+  * @param  path: directory path
+  * @param  len: length of the directory path
+  * @retval cache entry or NULL if not found
+  */
+SdFatFs::PathCacheEntry *SdFatFs::findPath(const char *path, size_t len)
+{
+  for (uint8_t i = 0; i < SD_PATH_CACHE_SIZE; i++) {
+    PathCacheEntry *entry = &_pathCache[i];
+    if ((entry->path[0] != '\0') && (strlen(entry->path) == len) &&
+        (strncasecmp(entry->path, path, len) == 0)) {
+      entry->stamp = ++_pathStamp;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+  * @brief  Add a directory to the path cache, replacing the least recently used
+  * @param  path: directory path
+  * @param  len: length of the directory path
+  * @param  dir: directory context
+  */
+void SdFatFs::insertPath(const char *path, size_t len, const DirContext *dir)
+{
+  PathCacheEntry *entry = &_pathCache[0];
+  for (uint8_t i = 1; i < SD_PATH_CACHE_SIZE; i++) {
+    if (_pathCache[i].stamp < entry->stamp) {
+      entry = &_pathCache[i];
+    }
+  }
+  memcpy(entry->path, path, len);
+  entry->path[len] = '\0';
+  entry->dir = *dir;
+  entry->stamp = ++_pathStamp;
+}
+#endif
@@ -51,6 +51,115 @@
 #endif
 #define FAT_TYPE_UNK   0  // Unknown
 
+/* FatFs options depending on FatFs revision naming */
+#if defined(FF_FS_RPATH)
+  #define SD_FS_RPATH FF_FS_RPATH
+#elif defined(_FS_RPATH)
+  #define SD_FS_RPATH _FS_RPATH
+#else
+  #define SD_FS_RPATH 0
+#endif
+#if defined(FF_FS_EXFAT)
+  #define SD_FS_EXFAT FF_FS_EXFAT
+#elif defined(_FS_EXFAT)
+  #define SD_FS_EXFAT _FS_EXFAT
+#else
+  #define SD_FS_EXFAT 0
+#endif
+#if defined(FF_USE_LFN)
+  #define SD_USE_LFN FF_USE_LFN
+#elif defined(_USE_LFN)
+  #define SD_USE_LFN _USE_LFN
+#else
+  #define SD_USE_LFN 0
+#endif
+
+#if defined(FF_VOLUMES)
+  #define SD_VOLUMES FF_VOLUMES
+#elif defined(_VOLUMES)
+  #define SD_VOLUMES _VOLUMES
+#else
+  #define SD_VOLUMES 1
+#endif
+
+/* Sector number type of the disk I/O driver */
+#if (_FATFS == 80286)
+  typedef LBA_t SD_Sector_t;
+#else
+  typedef DWORD SD_Sector_t;
+#endif
+
+/* Second FAT copy update (setFatMirror()) */
+#define SD_FAT_MIRROR_ALWAYS 0 /* Written along the first one (FatFs default) */
+#define SD_FAT_MIRROR_SYNC   1 /* Written on each sync */
+#define SD_FAT_MIRROR_IDLE   2 /* Written by mirrorFat() and at deinit */
+
+/* Could be redefined in variant.h or using build_opt.h */
+/* Default update mode of the second FAT copy */
+#ifndef SD_FAT_MIRROR
+  #define SD_FAT_MIRROR      SD_FAT_MIRROR_ALWAYS
+#endif
+/* Number of FAT sectors copied by each multi-block write of mirrorFat() */
+#ifndef SD_FAT_MIRROR_CHUNK
+  #define SD_FAT_MIRROR_CHUNK 4
+#endif
+/* Number of ranges of updated FAT sectors kept until copied */
+#ifndef SD_FAT_MIRROR_RANGES
+  #define SD_FAT_MIRROR_RANGES 4
+#endif
+/* Mount the volume at first access instead of init() */
+#ifndef SD_LAZY_MOUNT
+  #define SD_LAZY_MOUNT      false
+#endif
+/* Number of FAT sectors read by each freeScan() by default */
+#ifndef SD_FREE_SCAN_STEP
+  #define SD_FREE_SCAN_STEP  8
+#endif
+/* RAM budget in bytes of the free clusters map (0 to disable) */
+#ifndef SD_FREE_MAP_SIZE
+  #define SD_FREE_MAP_SIZE   0
+#endif
+/* Number of FAT and directory sectors buffered until sync (0 to disable) */
+#ifndef SD_META_CACHE_SIZE
+  #define SD_META_CACHE_SIZE 0
+#endif
+/* Number of directory entries kept in the path cache (0 to disable) */
+#ifndef SD_PATH_CACHE_SIZE
+  #define SD_PATH_CACHE_SIZE 4
+#endif
+/* Maximum length of a cached directory path (including null char) */
+#ifndef SD_PATH_CACHE_LEN
+  #define SD_PATH_CACHE_LEN  48
+#endif
+/* Maximum directory depth handled by a recursive remove */
+#ifndef SD_REMOVE_DEPTH
+  #define SD_REMOVE_DEPTH    8
+#endif
+/* I/O counters of the volumes and files (0 to disable) */
+#ifndef SD_IO_STATS
+  #define SD_IO_STATS        0
+#endif
+
+/* I/O counters of a volume or of a file, the sectors of a file being the
+   ones transferred during its calls */
+typedef struct {
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  uint32_t readCalls;      /* f_read() */
+  uint32_t writeCalls;     /* f_write() */
+  uint32_t syncs;          /* f_sync() */
+  uint32_t sectorsRead;    /* From the block device */
+  uint32_t sectorsWritten; /* To the block device */
+  uint32_t cacheHits;      /* Sectors read from the metadata cache */
+  uint32_t fatReads;       /* FAT sectors read from the block device */
+  uint32_t fatWrites;      /* FAT sectors written to the block device */
+} SD_IoStats_t;
+
+/* File calls counted by SdFatFs::ioEnd() */
+#define SD_IO_READ  0
+#define SD_IO_WRITE 1
+#define SD_IO_SYNC  2
+
 /* To match Arduino definition*/
 #define   FILE_WRITE  FA_WRITE
 #define   FILE_READ   FA_READ
@@ -89,9 +198,29 @@ static inline uint8_t FAT_SECOND(uint16_t fatTime)
 
 class SdFatFs {
   public:
+    SdFatFs(SdBlockDevice *dev = NULL);
 
     bool init(void);
     bool deinit(void);
+    /* Drop the buffered writes, e.g. when the card has been removed */
+    void discard(void);
+
+    /* Block device of the volume, has to be set before init() */
+    void setDevice(SdBlockDevice *dev)
+    {
+      _dev = dev;
+    }
+    SdBlockDevice *device(void) const
+    {
+      return _dev;
+    }
+
+    /* When enabled, init() only registers the volume and FatFs mounts it at
+       first access. Has to be called before init() */
+    void setLazyMount(bool enable)
+    {
+      _lazyMount = enable;
+    }
 
     /** Return the FatFs type: 12, 16, 32 (0: unknown)*/
     uint8_t fatType(void);
@@ -107,13 +236,203 @@ class SdFatFs {
     {
       return (_SDFatFs.n_fatent - 2);
     }
+    /** \return The first sector of the first cluster. */
+    uint32_t dataStart(void) const
+    {
+      return (uint32_t)_SDFatFs.database;
+    }
 
     char *getRoot(void)
     {
       return _SDPath;
     };
+    void select(void);
+
+    /* Write the buffered FAT and directory sectors to the card */
+    bool flush(void);
+
+    /* Lazy update of the second FAT copy, mode could be changed at any time */
+    void setFatMirror(uint8_t mode)
+    {
+      _mirrorMode = mode;
+    }
+    bool mirrorFat(void);
+
+    /* Free space: counted once, then kept up to date by FatFs on each
+       cluster allocation or release */
+    bool freeScan(uint32_t count = SD_FREE_SCAN_STEP);
+    /** Return true while the free clusters are counted by freeScan() */
+    bool scanning(void) const
+    {
+      return _scanBuf != NULL;
+    }
+    uint32_t freeClusterCount(void);
+    uint64_t freeBytes(void);
+    void allocHint(void);
+
+    /* Path cache: resolve the parent directory of an absolute path from
+       its cached start cluster. Each lookup() must be paired with release() */
+    const TCHAR *lookup(const char *path);
+    void release(void);
+    void invalidate(const char *path = NULL);
+
+    /* Create a directory hierarchy */
+    FRESULT mkdir(const char *path);
+
+#if SD_IO_STATS
+    /* I/O counters of the volume. The counters of the file given to
+       ioBegin() are updated too, until ioEnd() counts its call */
+    const SD_IoStats_t *ioStats(void) const
+    {
+      return &_ioStats;
+    }
+    void resetIoStats(void);
+    void ioBegin(SD_IoStats_t *file)
+    {
+      _ioFile = file;
+    }
+    void ioEnd(uint8_t call, uint32_t bytes);
+#endif
+
+#if SD_FS_RPATH
+    /* Recursive remove of a directory, run by steps with removeStep() */
+    FRESULT removeStart(const char *path);
+    FRESULT removeStep(uint32_t count, bool *done);
+    void removeAbort(void);
+#endif
+
   private:
     FATFS _SDFatFs;  /* File system object for SD disk logical drive */
     char _SDPath[4]; /* SD disk logical drive path */
+    BYTE _pdrv = 0;  /* Physical drive number */
+    BYTE _lun = 0;   /* Driver logical unit, the volume index */
+    bool _lazyMount = SD_LAZY_MOUNT;
+    bool _mountPending = false; /* Init steps waiting for the volume mount */
+
+    bool mount(void);
+
+    SdBlockDevice *_dev = NULL;
+
+    DRESULT blockWrite(const BYTE *buff, SD_Sector_t sector, UINT count);
+
+#if SD_IO_STATS
+    SD_IoStats_t _ioStats = {};
+    SD_IoStats_t *_ioFile = NULL;
+
+    void ioCount(SD_Sector_t sector, UINT count, bool write);
+#endif
+
+    /* Free clusters count */
+    BYTE *_scanBuf = NULL;
+    uint32_t _scanSect = 0;  /* Next FAT (or exFAT bitmap) sector to count */
+    uint32_t _scanFree = 0;  /* Free clusters in the counted sectors */
+    bool _scanCount = false; /* Free clusters count is unknown */
+
+    /* Free clusters map: one bit per group of 2^_mapShift FAT sectors,
+       set if the group may have a free cluster */
+    uint8_t *_freeMap = NULL;
+    uint32_t _mapGroups = 0;
+    uint8_t _mapShift = 0;
+    bool _mapValid = false;     /* All groups counted */
+    bool _mapGroupFree = false; /* Group being counted has a free cluster */
+
+    DWORD *freeClst(void);
+    DWORD *lastClst(void);
+    void mapInit(void);
+    void mapDeinit(void);
+    void mapSet(uint32_t group, bool isFree);
+    bool mapGet(uint32_t group) const;
+    bool mapGroupFull(uint32_t group, const BYTE *buff, SD_Sector_t sector, UINT count);
+    bool scanRange(SD_Sector_t *base, uint32_t *nsect) const;
+    uint32_t countFree(const BYTE *buf, uint32_t sect) const;
+    void scanAbort(void);
+    void beforeWrite(const BYTE *buff, SD_Sector_t sector, UINT count);
+
+#if SD_META_CACHE_SIZE > 0
+    /* Metadata write-back: sectors written by FatFs from its window (FAT,
+       directory, FSINFO) are kept dirty until sync, sorted by sector */
+    BYTE _metaBuf[SD_META_CACHE_SIZE][sizeof(FATFS::win)] __attribute__((aligned(4)));
+    SD_Sector_t _metaSect[SD_META_CACHE_SIZE];
+    uint8_t _metaCount = 0;
+
+    int metaFind(SD_Sector_t sector) const;
+    bool metaWrite(const BYTE *buff, SD_Sector_t sector, UINT count);
+    void metaRead(BYTE *buff, SD_Sector_t sector, UINT count) const;
+    void metaDrop(SD_Sector_t sector, UINT count);
+    void metaSwap(uint8_t a, uint8_t b);
+#endif
+    DRESULT metaFlush(void);
+
+    /* Sectors of the first FAT not yet copied to the second one */
+    typedef struct {
+      uint32_t first;
+      uint32_t last;
+    } MirrorRange;
+
+    uint8_t _mirrorMode = SD_FAT_MIRROR;
+    MirrorRange _mirrorRanges[SD_FAT_MIRROR_RANGES];
+    uint8_t _mirrorCount = 0;
+
+    bool mirrorWrite(const BYTE *buff, SD_Sector_t sector, UINT count);
+    void mirrorAdd(uint32_t sect);
+    DRESULT mirrorFlush(void);
+
+    /* Disk I/O driver forwarding to the block device of the volume */
+    static SdFatFs *_volumes[SD_VOLUMES];
+    static SdFatFs *volume(BYTE lun);
+    static const Diskio_drvTypeDef _driver;
+    static DSTATUS diskInitialize(BYTE lun);
+    static DSTATUS diskStatus(BYTE lun);
+    static DRESULT diskRead(BYTE lun, BYTE *buff, SD_Sector_t sector, UINT count);
+#if _USE_WRITE == 1
+    static DRESULT diskWrite(BYTE lun, const BYTE *buff, SD_Sector_t sector, UINT count);
+#endif
+#if _USE_IOCTL == 1
+    static DRESULT diskIoctl(BYTE lun, BYTE cmd, void *buff);
+#endif
+
+#if SD_FS_RPATH
+    /* FatFs current directory (with containing directory for exFAT) */
+    typedef struct {
+      DWORD clust;
+#if SD_FS_EXFAT
+      DWORD c_scl;
+      DWORD c_size;
+      DWORD c_ofs;
+#endif
+    } DirContext;
+
+    typedef struct {
+      DIR dir;          /* Directory being removed */
+      DirContext ctx;   /* Directory as current directory */
+      /* Name in its parent, as read by f_readdir() */
+      char name[sizeof(FILINFO::fname)];
+    } RemoveLevel;
+
+    RemoveLevel *_rmLevels = NULL;
+    char *_rmPath = NULL;
+    int8_t _rmDepth = -1;
+
+    void getDir(DirContext *ctx) const;
+    void setDir(const DirContext *ctx);
+    static void dirContext(const DIR *dir, DirContext *ctx);
+#endif
+
+#if SD_FS_RPATH && (SD_PATH_CACHE_SIZE > 0)
+    typedef struct {
+      DirContext dir;  /* Cached directory */
+      uint32_t stamp;  /* Last use, for LRU replacement */
+      char path[SD_PATH_CACHE_LEN];
+    } PathCacheEntry;
+
+    PathCacheEntry _pathCache[SD_PATH_CACHE_SIZE] = {};
+    uint32_t _pathStamp = 0;
+    DirContext _savedDir = {};  /* Current directory saved by lookup() */
+    bool _dirChanged = false;
+
+    bool cacheable(const char *path) const;
+    PathCacheEntry *findPath(const char *path, size_t len);
+    void insertPath(const char *path, size_t len, const DirContext *dir);
+#endif
 };
 #endif  // sdFatFs_h
@@ -34,11 +34,15 @@
 */
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "bsp_sd.h"
 #include "core_debug.h"
 #include "interrupt.h"
 #include "PeripheralPins.h"
 #include "stm32yyxx_ll_gpio.h"
+#if (SD_TRACE_SIZE > 0) || SD_LATENCY_STATS
+  #include "wiring_time.h"
+#endif
 
 /* Definition for BSP SD */
 #if defined(SDMMC1) || defined(SDMMC2)
@@ -59,6 +63,49 @@
   #define SD_BUS_WIDE_4B           SDMMC_BUS_WIDE_4B
   #define SD_HW_FLOW_CTRL_ENABLE   SDMMC_HARDWARE_FLOW_CONTROL_ENABLE
   #define SD_HW_FLOW_CTRL_DISABLE  SDMMC_HARDWARE_FLOW_CONTROL_DISABLE
+  #define SD_LL_INIT               SDMMC_Init
+  #define SD_LL_POWER_ON           SDMMC_PowerState_ON
+  #define SD_LL_GET_RESPONSE       SDMMC_GetResponse
+  #define SD_RESP1                 SDMMC_RESP1
+  #define SD_RESP2                 SDMMC_RESP2
+  #define SD_RESP3                 SDMMC_RESP3
+  #define SD_RESP4                 SDMMC_RESP4
+  #define SD_DataInitTypeDef       SDMMC_DataInitTypeDef
+  #define SD_LL_CONFIG_DATA        SDMMC_ConfigData
+  #define SD_LL_READ_FIFO          SDMMC_ReadFIFO
+  #define SD_DATABLOCK_SIZE_8B     SDMMC_DATABLOCK_SIZE_8B
+  #define SD_DATABLOCK_SIZE_64B    SDMMC_DATABLOCK_SIZE_64B
+  #define SD_TRANSFER_DIR_TO_HOST  SDMMC_TRANSFER_DIR_TO_SDMMC
+  #define SD_TRANSFER_MODE_BLOCK   SDMMC_TRANSFER_MODE_BLOCK
+  #define SD_DPSM_ENABLE           SDMMC_DPSM_ENABLE
+  #define SD_FLAG_RXOVERR          SDMMC_FLAG_RXOVERR
+  #define SD_FLAG_DCRCFAIL         SDMMC_FLAG_DCRCFAIL
+  #define SD_FLAG_DTIMEOUT         SDMMC_FLAG_DTIMEOUT
+  #define SD_FLAG_DATAEND          SDMMC_FLAG_DATAEND
+  #define SD_FLAG_RXFIFOHF         SDMMC_FLAG_RXFIFOHF
+  #define SD_FLAG_RXFIFOE          SDMMC_FLAG_RXFIFOE
+  #define SD_STATIC_FLAGS          SDMMC_STATIC_FLAGS
+  #define SD_CmdInitTypeDef        SDMMC_CmdInitTypeDef
+  #define SD_LL_SEND_COMMAND       SDMMC_SendCommand
+  #define SD_LL_GET_COMMAND        SDMMC_GetCommandResponse
+  #define SD_LL_WRITE_FIFO         SDMMC_WriteFIFO
+  #define SD_RESPONSE_SHORT        SDMMC_RESPONSE_SHORT
+  #define SD_WAIT_NO               SDMMC_WAIT_NO
+  #define SD_CPSM_ENABLE           SDMMC_CPSM_ENABLE
+  #define SD_DATABLOCK_SIZE_512B   SDMMC_DATABLOCK_SIZE_512B
+  #define SD_TRANSFER_DIR_TO_CARD  SDMMC_TRANSFER_DIR_TO_CARD
+  #define SD_FLAG_TXUNDERR         SDMMC_FLAG_TXUNDERR
+  #define SD_FLAG_TXFIFOHE         SDMMC_FLAG_TXFIFOHE
+  #define SD_FLAG_CCRCFAIL         SDMMC_FLAG_CCRCFAIL
+  #define SD_FLAG_CMDREND          SDMMC_FLAG_CMDREND
+  #define SD_FLAG_CTIMEOUT         SDMMC_FLAG_CTIMEOUT
+  #define SD_STATIC_CMD_FLAGS      SDMMC_STATIC_CMD_FLAGS
+  #define SD_FLAG_CMDSENT          SDMMC_FLAG_CMDSENT
+  #define SD_RESPONSE_NO           SDMMC_RESPONSE_NO
+  #define SD_RESPONSE_LONG         SDMMC_RESPONSE_LONG
+  #if !defined(SD_INIT_CLK_DIV) && defined(SDMMC_INIT_CLK_DIV)
+    #define SD_INIT_CLK_DIV          SDMMC_INIT_CLK_DIV
+  #endif
 
   #ifndef SD_CLK_DIV
     #if defined(SDMMC_TRANSFER_CLK_DIV)
@@ -89,6 +136,49 @@
   #define SD_BUS_WIDE_4B           SDIO_BUS_WIDE_4B
   #define SD_HW_FLOW_CTRL_ENABLE   SDIO_HARDWARE_FLOW_CONTROL_ENABLE
   #define SD_HW_FLOW_CTRL_DISABLE  SDIO_HARDWARE_FLOW_CONTROL_DISABLE
+  #define SD_LL_INIT               SDIO_Init
+  #define SD_LL_POWER_ON           SDIO_PowerState_ON
+  #define SD_LL_GET_RESPONSE       SDIO_GetResponse
+  #define SD_RESP1                 SDIO_RESP1
+  #define SD_RESP2                 SDIO_RESP2
+  #define SD_RESP3                 SDIO_RESP3
+  #define SD_RESP4                 SDIO_RESP4
+  #define SD_DataInitTypeDef       SDIO_DataInitTypeDef
+  #define SD_LL_CONFIG_DATA        SDIO_ConfigData
+  #define SD_LL_READ_FIFO          SDIO_ReadFIFO
+  #define SD_DATABLOCK_SIZE_8B     SDIO_DATABLOCK_SIZE_8B
+  #define SD_DATABLOCK_SIZE_64B    SDIO_DATABLOCK_SIZE_64B
+  #define SD_TRANSFER_DIR_TO_HOST  SDIO_TRANSFER_DIR_TO_SDIO
+  #define SD_TRANSFER_MODE_BLOCK   SDIO_TRANSFER_MODE_BLOCK
+  #define SD_DPSM_ENABLE           SDIO_DPSM_ENABLE
+  #define SD_FLAG_RXOVERR          SDIO_FLAG_RXOVERR
+  #define SD_FLAG_DCRCFAIL         SDIO_FLAG_DCRCFAIL
+  #define SD_FLAG_DTIMEOUT         SDIO_FLAG_DTIMEOUT
+  #define SD_FLAG_DATAEND          SDIO_FLAG_DATAEND
+  #define SD_FLAG_RXFIFOHF         SDIO_FLAG_RXFIFOHF
+  #define SD_FLAG_RXFIFOE          SDIO_FLAG_RXFIFOE
+  #define SD_STATIC_FLAGS          SDIO_STATIC_FLAGS
+  #define SD_CmdInitTypeDef        SDIO_CmdInitTypeDef
+  #define SD_LL_SEND_COMMAND       SDIO_SendCommand
+  #define SD_LL_GET_COMMAND        SDIO_GetCommandResponse
+  #define SD_LL_WRITE_FIFO         SDIO_WriteFIFO
+  #define SD_RESPONSE_SHORT        SDIO_RESPONSE_SHORT
+  #define SD_WAIT_NO               SDIO_WAIT_NO
+  #define SD_CPSM_ENABLE           SDIO_CPSM_ENABLE
+  #define SD_DATABLOCK_SIZE_512B   SDIO_DATABLOCK_SIZE_512B
+  #define SD_TRANSFER_DIR_TO_CARD  SDIO_TRANSFER_DIR_TO_CARD
+  #define SD_FLAG_TXUNDERR         SDIO_FLAG_TXUNDERR
+  #define SD_FLAG_TXFIFOHE         SDIO_FLAG_TXFIFOHE
+  #define SD_FLAG_CCRCFAIL         SDIO_FLAG_CCRCFAIL
+  #define SD_FLAG_CMDREND          SDIO_FLAG_CMDREND
+  #define SD_FLAG_CTIMEOUT         SDIO_FLAG_CTIMEOUT
+  #define SD_STATIC_CMD_FLAGS      SDIO_STATIC_CMD_FLAGS
+  #define SD_FLAG_CMDSENT          SDIO_FLAG_CMDSENT
+  #define SD_RESPONSE_NO           SDIO_RESPONSE_NO
+  #define SD_RESPONSE_LONG         SDIO_RESPONSE_LONG
+  #if !defined(SD_INIT_CLK_DIV) && defined(SDIO_INIT_CLK_DIV)
+    #define SD_INIT_CLK_DIV          SDIO_INIT_CLK_DIV
+  #endif
   #ifndef SD_CLK_DIV
     #define SD_CLK_DIV               SDIO_TRANSFER_CLK_DIV
   #endif
@@ -100,37 +190,145 @@
   #define SD_HW_FLOW_CTRL          SD_HW_FLOW_CTRL_DISABLE
 #endif
 
+/* Clock divider of the card identification, up to 400 kHz */
+#ifndef SD_INIT_CLK_DIV
+  #define SD_INIT_CLK_DIV          0xFA
+#endif
+
 #ifndef SD_BUS_WIDE
   #define SD_BUS_WIDE              SD_BUS_WIDE_4B
 #endif
 
 /* BSP SD Private Variables */
-static SD_HandleTypeDef uSdHandle;
-static uint32_t SD_detect_ll_gpio_pin = LL_GPIO_PIN_ALL;
-static GPIO_TypeDef *SD_detect_gpio_port = GPIOA;
-static uint32_t SD_detect_level = SD_DETECT_LEVEL;
+typedef struct {
+  SD_HandleTypeDef handle;
+  SD_PinName_t pins;
+  uint32_t detect_ll_gpio_pin;
+  GPIO_TypeDef *detect_gpio_port;
+  uint32_t detect_level;
+  uint16_t detect_gpio_pin;
+  bool detect_it;
+  bool suspended;
+  uint8_t init_step;
+  uint32_t init_tick;
+  uint8_t scr[8];          /* SCR of the identified card, read once */
+  bool scr_valid;
+  uint32_t cache_reg;      /* Performance register of the enabled cache, 0 if disabled */
+  uint8_t queue_depth;     /* Command queue enabled with this depth, 0 if disabled */
+  bool queue_write;        /* Card programming a queued write */
+  uint32_t queue_tasks;    /* Queued tasks */
+  uint32_t queue_reads;    /* Queued tasks reading */
+  uint16_t queue_count[SD_QUEUE_DEPTH]; /* Blocks of each queued task */
+#if SD_LATENCY_STATS
+  bool write_pending;  /* Write timed until the card is ready */
+  uint32_t write_start;
+  uint32_t write_sector;
+#endif
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
-  static uint32_t SD_trans_en_ll_gpio_pin = LL_GPIO_PIN_ALL;
-  static GPIO_TypeDef *SD_trans_en_gpio_port = GPIOA;
-  static uint32_t SD_trans_sel_ll_gpio_pin = LL_GPIO_PIN_ALL;
-  static GPIO_TypeDef *SD_trans_sel_gpio_port = GPIOA;
-#endif
-#define SD_TRANSFER_OK                ((uint8_t)0x00)
-#define SD_TRANSFER_BUSY              ((uint8_t)0x01)
-SD_PinName_t SD_PinNames = {
-  .pin_d0 = NC,
-  .pin_d1 = NC,
-  .pin_d2 = NC,
-  .pin_d3 = NC,
-  .pin_cmd = NC,
-  .pin_ck = NC,
+  uint32_t trans_en_ll_gpio_pin;
+  GPIO_TypeDef *trans_en_gpio_port;
+  uint32_t trans_sel_ll_gpio_pin;
+  GPIO_TypeDef *trans_sel_gpio_port;
+#endif
+} SD_Device_t;
+
+static SD_Device_t SD_devices[SD_MAX_DEVICES] = {
+  [0 ... (SD_MAX_DEVICES - 1)] = {
+    .pins = {
+      .pin_d0 = NC,
+      .pin_d1 = NC,
+      .pin_d2 = NC,
+      .pin_d3 = NC,
+      .pin_cmd = NC,
+      .pin_ck = NC,
 #if defined(SDMMC1) || defined(SDMMC2)
-  .pin_ckin = NC,
-  .pin_cdir = NC,
-  .pin_d0dir = NC,
-  .pin_d123dir = NC
+      .pin_ckin = NC,
+      .pin_cdir = NC,
+      .pin_d0dir = NC,
+      .pin_d123dir = NC
+#endif
+    },
+    .detect_ll_gpio_pin = LL_GPIO_PIN_ALL,
+    .detect_gpio_port = GPIOA,
+    .detect_level = SD_DETECT_LEVEL,
+    .init_step = SD_INIT_IDLE,
+#if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
+    .trans_en_ll_gpio_pin = LL_GPIO_PIN_ALL,
+    .trans_en_gpio_port = GPIOA,
+    .trans_sel_ll_gpio_pin = LL_GPIO_PIN_ALL,
+    .trans_sel_gpio_port = GPIOA,
 #endif
+  }
 };
+/* Device used by the BSP functions, see BSP_SD_SelectDevice() */
+static SD_Device_t *SD_dev = &SD_devices[0];
+
+#if SD_TRACE_SIZE > 0
+/* Block I/O trace ring buffer */
+static SD_TraceRecord_t SD_trace[SD_TRACE_SIZE];
+static uint32_t SD_traceNext = 0;   /* Records since start, next one modulo size */
+static bool SD_traceOn = false;
+
+static SD_TraceRecord_t *SD_TraceBegin(uint8_t op, uint32_t sector, uint32_t count);
+static void SD_TraceEnd(SD_TraceRecord_t *record, uint8_t status);
+#define SD_TRACE_BEGIN(op, sector, count) \
+  SD_TraceRecord_t *trace = SD_TraceBegin(op, sector, count)
+#define SD_TRACE_END(status)   SD_TraceEnd(trace, status)
+#else
+#define SD_TRACE_BEGIN(op, sector, count)
+#define SD_TRACE_END(status)
+#endif
+
+#if SD_PROBES
+SD_Probe_t SD_probes[SD_PROBE_COUNT];
+#endif
+
+#if SD_LATENCY_STATS
+static SD_Latency_t SD_latency[SD_LATENCY_KINDS];
+static uint32_t SD_latencyThreshold = UINT32_MAX;
+static void (*SD_latencyCallback)(uint8_t kind, uint32_t sector, uint32_t us) = NULL;
+#endif
+
+static uint8_t SD_Configure(void);
+static uint32_t SD_Identify(void);
+static uint32_t SD_CheckCID(void);
+static uint8_t SD_ReadRegister(bool scr, uint8_t *data, uint32_t size);
+static uint32_t SD_SendCommand(uint8_t cmd, uint32_t arg, bool r1, uint32_t *response);
+static uint32_t SD_DataCommand(uint8_t cmd, uint32_t arg, bool read, uint8_t *data, uint32_t size, uint32_t block);
+static uint8_t SD_QueueTransfer(bool read, uint32_t *pData, uint32_t addr, uint32_t count, uint32_t Timeout);
+
+/**
+  * @brief  Select the SD card device used by the next BSP SD functions calls.
+  * @param  device: device index, from 0 to SD_MAX_DEVICES - 1
+  * @retval SD status
+  */
+uint8_t BSP_SD_SelectDevice(uint8_t device)
+{
+  if (device >= SD_MAX_DEVICES) {
+    return MSD_ERROR;
+  }
+  SD_dev = &SD_devices[device];
+  return MSD_OK;
+}
+
+/**
+  * @brief  Get the SD card device selected by BSP_SD_SelectDevice().
+  * @retval device index
+  */
+uint8_t BSP_SD_GetDevice(void)
+{
+  return (uint8_t)(SD_dev - SD_devices);
+}
+
+/**
+  * @brief  Get the pins of an SD card device, to be set before its init.
+  * @param  device: device index, from 0 to SD_MAX_DEVICES - 1
+  * @retval pointer to the device pins
+  */
+SD_PinName_t *BSP_SD_GetPinNames(uint8_t device)
+{
+  return &SD_devices[(device < SD_MAX_DEVICES) ? device : 0].pins;
+}
 
 #if defined(STM32_CORE_VERSION) && (STM32_CORE_VERSION > 0x02050000)
 /**
@@ -147,53 +345,58 @@ bool BSP_SD_GetInstance(void)
   SD_TypeDef *sd_ck = NP;
   bool res = true;
 
+  /* Only the first device has default pins */
+  if ((SD_dev != &SD_devices[0]) && (SD_dev->pins.pin_d0 == NC)) {
+    core_debug("ERROR: SD pins not defined\n");
+    return false;
+  }
   /* If a pin is not defined, use the first pin available in the associated PinMap_SD_* arrays */
-  if (SD_PinNames.pin_d0 == NC) {
-    SD_PinNames.pin_d0 = PinMap_SD_DATA0[0].pin;
+  if (SD_dev->pins.pin_d0 == NC) {
+    SD_dev->pins.pin_d0 = PinMap_SD_DATA0[0].pin;
 #if SD_BUS_WIDE == SD_BUS_WIDE_4B
-    SD_PinNames.pin_d1 = PinMap_SD_DATA1[0].pin;
-    SD_PinNames.pin_d2 = PinMap_SD_DATA2[0].pin;
-    SD_PinNames.pin_d3 = PinMap_SD_DATA3[0].pin;
+    SD_dev->pins.pin_d1 = PinMap_SD_DATA1[0].pin;
+    SD_dev->pins.pin_d2 = PinMap_SD_DATA2[0].pin;
+    SD_dev->pins.pin_d3 = PinMap_SD_DATA3[0].pin;
 #endif
   }
-  if (SD_PinNames.pin_cmd == NC) {
-    SD_PinNames.pin_cmd = PinMap_SD_CMD[0].pin;
+  if (SD_dev->pins.pin_cmd == NC) {
+    SD_dev->pins.pin_cmd = PinMap_SD_CMD[0].pin;
   }
-  if (SD_PinNames.pin_ck == NC) {
-    SD_PinNames.pin_ck = PinMap_SD_CK[0].pin;
+  if (SD_dev->pins.pin_ck == NC) {
+    SD_dev->pins.pin_ck = PinMap_SD_CK[0].pin;
   }
 #if defined(SDMMC1) || defined(SDMMC2)
 #if !defined(SDMMC_CKIN_NA)
-  if (SD_PinNames.pin_ckin == NC) {
-    SD_PinNames.pin_ckin = PinMap_SD_CKIN[0].pin;
+  if (SD_dev->pins.pin_ckin == NC) {
+    SD_dev->pins.pin_ckin = PinMap_SD_CKIN[0].pin;
   }
 #endif
 #if !defined(SDMMC_CDIR_NA)
-  if (SD_PinNames.pin_cdir == NC) {
-    SD_PinNames.pin_cdir = PinMap_SD_CDIR[0].pin;
+  if (SD_dev->pins.pin_cdir == NC) {
+    SD_dev->pins.pin_cdir = PinMap_SD_CDIR[0].pin;
   }
 #endif
 #if !defined(SDMMC_D0DIR_NA)
-  if (SD_PinNames.pin_d0dir == NC) {
-    SD_PinNames.pin_d0dir = PinMap_SD_D0DIR[0].pin;
+  if (SD_dev->pins.pin_d0dir == NC) {
+    SD_dev->pins.pin_d0dir = PinMap_SD_D0DIR[0].pin;
   }
 #endif
 #if !defined(SDMMC_D123DIR_NA)
-  if (SD_PinNames.pin_d123dir == NC) {
-    SD_PinNames.pin_d123dir = PinMap_SD_D123DIR[0].pin;
+  if (SD_dev->pins.pin_d123dir == NC) {
+    SD_dev->pins.pin_d123dir = PinMap_SD_D123DIR[0].pin;
   }
 #endif
 #endif /* SDMMC1 || SDMMC2 */
 
   /* Get SD instance from pins */
-  sd_d0 = pinmap_peripheral(SD_PinNames.pin_d0, PinMap_SD_DATA0);
+  sd_d0 = pinmap_peripheral(SD_dev->pins.pin_d0, PinMap_SD_DATA0);
 #if SD_BUS_WIDE == SD_BUS_WIDE_4B
-  sd_d1 = pinmap_peripheral(SD_PinNames.pin_d1, PinMap_SD_DATA1);
-  sd_d2 = pinmap_peripheral(SD_PinNames.pin_d2, PinMap_SD_DATA2);
-  sd_d3 = pinmap_peripheral(SD_PinNames.pin_d3, PinMap_SD_DATA3);
+  sd_d1 = pinmap_peripheral(SD_dev->pins.pin_d1, PinMap_SD_DATA1);
+  sd_d2 = pinmap_peripheral(SD_dev->pins.pin_d2, PinMap_SD_DATA2);
+  sd_d3 = pinmap_peripheral(SD_dev->pins.pin_d3, PinMap_SD_DATA3);
 #endif
-  sd_cmd = pinmap_peripheral(SD_PinNames.pin_cmd, PinMap_SD_CMD);
-  sd_ck = pinmap_peripheral(SD_PinNames.pin_ck, PinMap_SD_CK);
+  sd_cmd = pinmap_peripheral(SD_dev->pins.pin_cmd, PinMap_SD_CMD);
+  sd_ck = pinmap_peripheral(SD_dev->pins.pin_ck, PinMap_SD_CK);
 
   /* Pins Dx/cmd/CK must not be NP. */
   if (sd_d0 == NP ||
@@ -217,11 +420,11 @@ bool BSP_SD_GetInstance(void)
       core_debug("ERROR: SD pins mismatch\n");
       res = false;
     }
-    uSdHandle.Instance = sd_base;
+    SD_dev->handle.Instance = sd_base;
 #if defined(SDMMC1) || defined(SDMMC2)
 #if !defined(SDMMC_CKIN_NA)
-    if (res && (SD_PinNames.pin_ckin != NC)) {
-      SD_TypeDef *sd_ckin = pinmap_peripheral(SD_PinNames.pin_ckin, PinMap_SD_CKIN);
+    if (res && (SD_dev->pins.pin_ckin != NC)) {
+      SD_TypeDef *sd_ckin = pinmap_peripheral(SD_dev->pins.pin_ckin, PinMap_SD_CKIN);
       if (pinmap_merge_peripheral(sd_ckin, sd_base) == NP) {
         core_debug("ERROR: SD CKIN pin mismatch\n");
         res = false;
@@ -229,8 +432,8 @@ bool BSP_SD_GetInstance(void)
     }
 #endif
 #if !defined(SDMMC_CDIR_NA)
-    if ((res && SD_PinNames.pin_cdir != NC)) {
-      SD_TypeDef *sd_cdir = pinmap_peripheral(SD_PinNames.pin_cdir, PinMap_SD_CDIR);
+    if ((res && SD_dev->pins.pin_cdir != NC)) {
+      SD_TypeDef *sd_cdir = pinmap_peripheral(SD_dev->pins.pin_cdir, PinMap_SD_CDIR);
       if (pinmap_merge_peripheral(sd_cdir, sd_base) == NP) {
         core_debug("ERROR: SD CDIR pin mismatch\n");
         res = false;
@@ -238,8 +441,8 @@ bool BSP_SD_GetInstance(void)
     }
 #endif
 #if !defined(SDMMC_D0DIR_NA)
-    if (res && (SD_PinNames.pin_cdir != NC)) {
-      SD_TypeDef *sd_d0dir = pinmap_peripheral(SD_PinNames.pin_d0dir, PinMap_SD_D0DIR);
+    if (res && (SD_dev->pins.pin_cdir != NC)) {
+      SD_TypeDef *sd_d0dir = pinmap_peripheral(SD_dev->pins.pin_d0dir, PinMap_SD_D0DIR);
       if (pinmap_merge_peripheral(sd_d0dir, sd_base) == NP) {
         core_debug("ERROR: SD DODIR pin mismatch\n");
         res = false;
@@ -247,8 +450,8 @@ bool BSP_SD_GetInstance(void)
     }
 #endif
 #if !defined(SDMMC_D123DIR_NA)
-    if (res && (SD_PinNames.pin_cdir != NC)) {
-      SD_TypeDef *sd_d123dir = pinmap_peripheral(SD_PinNames.pin_d123dir, PinMap_SD_D123DIR);
+    if (res && (SD_dev->pins.pin_cdir != NC)) {
+      SD_TypeDef *sd_d123dir = pinmap_peripheral(SD_dev->pins.pin_d123dir, PinMap_SD_D123DIR);
       if (pinmap_merge_peripheral(sd_d123dir, sd_base) == NP) {
         core_debug("ERROR: SD D123DIR pin mismatch\n");
         res = false;
@@ -257,7 +460,7 @@ bool BSP_SD_GetInstance(void)
 #endif
 #endif /* SDMMC1 || SDMMC2 */
     /* Are all pins connected to the same SDx instance? */
-    if (uSdHandle.Instance == NP) {
+    if (SD_dev->handle.Instance == NP) {
       core_debug("ERROR: SD pins mismatch\n");
       res = false;
     }
@@ -267,71 +470,333 @@ bool BSP_SD_GetInstance(void)
 #endif /* STM32_CORE_VERSION && (STM32_CORE_VERSION > 0x02050000) */
 
 /**
-  * @brief  Initializes the SD card device with CS check if any.
+  * @brief  Configures the SD handle, the transceiver and the detect pin if any
   * @retval SD status
   */
-uint8_t BSP_SD_Init(void)
+static uint8_t SD_Configure(void)
 {
   uint8_t sd_state = MSD_OK;
 
-  /* Check if SD is not yet initialized */
-  if (uSdHandle.State == HAL_SD_STATE_RESET) {
-    /* uSD device interface configuration */
+  /* uSD device interface configuration */
 #if !defined(STM32_CORE_VERSION) || (STM32_CORE_VERSION <= 0x02050000)
-    uSdHandle.Instance = SD_INSTANCE;
+  SD_dev->handle.Instance = SD_INSTANCE;
 #else
-    if (!BSP_SD_GetInstance()) {
-      sd_state = MSD_ERROR;
-    }
+  if (!BSP_SD_GetInstance()) {
+    sd_state = MSD_ERROR;
+  }
 #endif /* !STM32_CORE_VERSION || (STM32_CORE_VERSION <= 0x02050000) */
 
-    uSdHandle.Init.ClockEdge           = SD_CLK_EDGE;
+  SD_dev->handle.Init.ClockEdge           = SD_CLK_EDGE;
 #if defined(SD_CLK_BYPASS)
-    uSdHandle.Init.ClockBypass         = SD_CLK_BYPASS;
+  SD_dev->handle.Init.ClockBypass         = SD_CLK_BYPASS;
 #endif
-    uSdHandle.Init.ClockPowerSave      = SD_CLK_PWR_SAVE;
-    uSdHandle.Init.BusWide             = SD_BUS_WIDE_4B;
-    uSdHandle.Init.HardwareFlowControl = SD_HW_FLOW_CTRL;
-    uSdHandle.Init.ClockDiv            = 0x08;
+  SD_dev->handle.Init.ClockPowerSave      = SD_CLK_PWR_SAVE;
+  SD_dev->handle.Init.BusWide             = SD_BUS_WIDE_4B;
+  SD_dev->handle.Init.HardwareFlowControl = SD_HW_FLOW_CTRL;
+  SD_dev->handle.Init.ClockDiv            = 0x08;
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
 #if defined(SDMMC_TRANSCEIVER_ENABLE)
-    uSdHandle.Init.Transceiver = SD_TRANSCEIVER_ENABLE;
+  SD_dev->handle.Init.Transceiver = SD_TRANSCEIVER_ENABLE;
 #else
-    uSdHandle.Init.TranceiverPresent   = SD_TRANSCEIVER_ENABLE;
+  SD_dev->handle.Init.TranceiverPresent   = SD_TRANSCEIVER_ENABLE;
 #endif
-    if (sd_state == MSD_OK) {
-      BSP_SD_Transceiver_MspInit(&uSdHandle, NULL);
-    }
+  if (sd_state == MSD_OK) {
+    BSP_SD_Transceiver_MspInit(&SD_dev->handle, NULL);
+  }
 #endif
 
-    if ((sd_state == MSD_OK) && (SD_detect_ll_gpio_pin != LL_GPIO_PIN_ALL)) {
-      /* Msp SD Detect pin initialization */
-      BSP_SD_Detect_MspInit(&uSdHandle, NULL);
-      if (BSP_SD_IsDetected() != SD_PRESENT) { /* Check if SD card is present */
-        sd_state = MSD_ERROR_SD_NOT_PRESENT;
-      }
+  if ((sd_state == MSD_OK) && (SD_dev->detect_ll_gpio_pin != LL_GPIO_PIN_ALL)) {
+    /* Msp SD Detect pin initialization */
+    BSP_SD_Detect_MspInit(&SD_dev->handle, NULL);
+    if (BSP_SD_IsDetected() != SD_PRESENT) { /* Check if SD card is present */
+      sd_state = MSD_ERROR_SD_NOT_PRESENT;
+    }
+  }
+  return sd_state;
+}
+
+/**
+  * @brief  Initializes the SD card device with CS check if any.
+  * @retval SD status
+  */
+uint8_t BSP_SD_Init(void)
+{
+  uint8_t sd_state = MSD_OK;
+
+  /* Check if the card suspended by BSP_SD_Suspend() is still there */
+  if (SD_dev->suspended) {
+    SD_dev->suspended = false;
+    SD_dev->handle.ErrorCode = HAL_SD_ERROR_NONE;
+    if (((SD_dev->detect_ll_gpio_pin != LL_GPIO_PIN_ALL) && (BSP_SD_IsDetected() != SD_PRESENT)) ||
+        (HAL_SD_GetCardState(&SD_dev->handle) != HAL_SD_CARD_TRANSFER) ||
+        (SD_dev->handle.ErrorCode != HAL_SD_ERROR_NONE) ||
+        (SD_CheckCID() != SDMMC_ERROR_NONE)) {
+      /* Another card or no card: identify it again */
+      BSP_SD_DeInit();
     }
+  }
+
+  /* Check if SD is not yet initialized */
+  if (SD_dev->handle.State == HAL_SD_STATE_RESET) {
+    sd_state = SD_Configure();
     if (sd_state == MSD_OK) {
       /* Msp SD initialization */
-      BSP_SD_MspInit(&uSdHandle, NULL);
+      BSP_SD_MspInit(&SD_dev->handle, NULL);
 
       /* HAL SD initialization */
-      if (HAL_SD_Init(&uSdHandle) != HAL_OK) {
+      if (HAL_SD_Init(&SD_dev->handle) != HAL_OK) {
         sd_state = MSD_ERROR;
       }
 
       /* Configure SD Bus width */
       if (sd_state == MSD_OK) {
         /* Enable wide operation */
-        if (HAL_SD_ConfigWideBusOperation(&uSdHandle, SD_BUS_WIDE) != HAL_OK) {
+        if (HAL_SD_ConfigWideBusOperation(&SD_dev->handle, SD_BUS_WIDE) != HAL_OK) {
           sd_state = MSD_ERROR;
         }
       }
     }
   }
+  SD_dev->init_step = (sd_state == MSD_OK) ? SD_INIT_DONE : SD_INIT_IDLE;
   return  sd_state;
 }
 
+/**
+  * @brief  Starts the SD card device initialization without blocking.
+  *         BSP_SD_InitPoll() has to be called until it does not return
+  *         MSD_BUSY, e.g. from loop() or a timer interrupt.
+  * @retval SD status: MSD_BUSY if started
+  */
+uint8_t BSP_SD_InitStart(void)
+{
+  uint8_t sd_state;
+  SD_InitTypeDef Init;
+
+#if !defined(USE_SD_TRANSCEIVER) || (USE_SD_TRANSCEIVER == 0U)
+  if (SD_dev->suspended || (SD_dev->handle.State != HAL_SD_STATE_RESET))
+#endif
+  {
+    /* Suspended card only needs a status command, transceiver needs the
+       HAL voltage switch: blocking init */
+    return BSP_SD_Init();
+  }
+  SD_dev->init_step = SD_INIT_IDLE;
+  sd_state = SD_Configure();
+  if (sd_state == MSD_OK) {
+    /* Msp SD initialization */
+    BSP_SD_MspInit(&SD_dev->handle, NULL);
+
+    /* Identification at a clock up to 400 kHz on 1 bit bus */
+    Init = SD_dev->handle.Init;
+    Init.BusWide             = SD_BUS_WIDE_1B;
+    Init.HardwareFlowControl = SD_HW_FLOW_CTRL_DISABLE;
+    Init.ClockDiv            = SD_INIT_CLK_DIV;
+    SD_LL_INIT(SD_dev->handle.Instance, Init);
+#if defined(__HAL_SD_DISABLE)
+    __HAL_SD_DISABLE(&SD_dev->handle);
+#endif
+    SD_LL_POWER_ON(SD_dev->handle.Instance);
+#if defined(__HAL_SD_ENABLE)
+    __HAL_SD_ENABLE(&SD_dev->handle);
+#endif
+    SD_dev->handle.ErrorCode = HAL_SD_ERROR_NONE;
+    SD_dev->init_tick = HAL_GetTick();
+    SD_dev->init_step = SD_INIT_POWER;
+    sd_state = MSD_BUSY;
+  }
+  return sd_state;
+}
+
+/**
+  * @brief  Runs the next step of the initialization started by
+  *         BSP_SD_InitStart(), each call sends at most a few commands.
+  * @retval SD status: MSD_BUSY while in progress, MSD_OK once initialized
+  */
+uint8_t BSP_SD_InitPoll(void)
+{
+  uint8_t sd_state = MSD_BUSY;
+  uint32_t errorstate = SDMMC_ERROR_NONE;
+  uint32_t response;
+
+  switch (SD_dev->init_step) {
+    case SD_INIT_POWER:
+      /* Wait for the card power up (at least 74 clock cycles) */
+      if ((HAL_GetTick() - SD_dev->init_tick) < 2U) {
+        break;
+      }
+      errorstate = SDMMC_CmdGoIdleState(SD_dev->handle.Instance);
+      if (errorstate == SDMMC_ERROR_NONE) {
+        /* Only cards compliant with version 2.00 or later answer CMD8 */
+        if (SDMMC_CmdOperCond(SD_dev->handle.Instance) == SDMMC_ERROR_NONE) {
+          SD_dev->handle.SdCard.CardVersion = CARD_V2_X;
+        } else {
+          SD_dev->handle.SdCard.CardVersion = CARD_V1_X;
+          errorstate = SDMMC_CmdGoIdleState(SD_dev->handle.Instance);
+        }
+      }
+      SD_dev->init_tick = HAL_GetTick();
+      SD_dev->init_step = SD_INIT_VOLTAGE;
+      break;
+    case SD_INIT_VOLTAGE:
+      /* One ACMD41 per call until the card is ready */
+      errorstate = SDMMC_CmdAppCommand(SD_dev->handle.Instance, 0);
+      if (errorstate == SDMMC_ERROR_NONE) {
+        errorstate = SDMMC_CmdAppOperCommand(SD_dev->handle.Instance, SDMMC_VOLTAGE_WINDOW_SD |
+                                             ((SD_dev->handle.SdCard.CardVersion == CARD_V2_X) ?
+                                              SDMMC_HIGH_CAPACITY : SDMMC_STD_CAPACITY));
+      }
+      if (errorstate == SDMMC_ERROR_NONE) {
+        response = SD_LL_GET_RESPONSE(SD_dev->handle.Instance, SD_RESP1);
+        if ((response & 0x80000000U) != 0U) {
+          SD_dev->handle.SdCard.CardType = ((response & SDMMC_HIGH_CAPACITY) != 0U) ? CARD_SDHC_SDXC : CARD_SDSC;
+          SD_dev->init_step = SD_INIT_IDENTIFY;
+        } else if ((HAL_GetTick() - SD_dev->init_tick) > SD_INIT_TIMEOUT) {
+          errorstate = HAL_SD_ERROR_TIMEOUT;
+        }
+      }
+      break;
+    case SD_INIT_IDENTIFY:
+      errorstate = SD_Identify();
+      if (errorstate == SDMMC_ERROR_NONE) {
+        SD_dev->init_step = SD_INIT_DONE;
+        sd_state = MSD_OK;
+      }
+      break;
+    case SD_INIT_DONE:
+      sd_state = MSD_OK;
+      break;
+    default:
+      sd_state = MSD_ERROR;
+      break;
+  }
+  if (errorstate != SDMMC_ERROR_NONE) {
+    SD_dev->handle.ErrorCode |= errorstate;
+    BSP_SD_DeInit();
+    sd_state = MSD_ERROR;
+  }
+  return sd_state;
+}
+
+/**
+  * @brief  Gets the progress of the initialization started by BSP_SD_InitStart().
+  * @retval SD_INIT_IDLE (not started or failed), SD_INIT_POWER,
+  *         SD_INIT_VOLTAGE, SD_INIT_IDENTIFY or SD_INIT_DONE
+  */
+uint8_t BSP_SD_InitStep(void)
+{
+  return SD_dev->init_step;
+}
+
+/**
+  * @brief  Identifies the ready card (CID, RCA, CSD), selects it and
+  *         switches to the data transfer bus width and clock.
+  * @retval SDMMC error state
+  */
+static uint32_t SD_Identify(void)
+{
+  SD_TypeDef *instance = SD_dev->handle.Instance;
+  HAL_SD_CardCSDTypeDef csd;
+  uint16_t rca = 0;
+  uint32_t errorstate;
+
+  errorstate = SDMMC_CmdSendCID(instance);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    return errorstate;
+  }
+  SD_dev->handle.CID[0] = SD_LL_GET_RESPONSE(instance, SD_RESP1);
+  SD_dev->handle.CID[1] = SD_LL_GET_RESPONSE(instance, SD_RESP2);
+  SD_dev->handle.CID[2] = SD_LL_GET_RESPONSE(instance, SD_RESP3);
+  SD_dev->handle.CID[3] = SD_LL_GET_RESPONSE(instance, SD_RESP4);
+
+  errorstate = SDMMC_CmdSetRelAdd(instance, &rca);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    return errorstate;
+  }
+  SD_dev->handle.SdCard.RelCardAdd = rca;
+
+  errorstate = SDMMC_CmdSendCSD(instance, (uint32_t)rca << 16U);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    return errorstate;
+  }
+  SD_dev->handle.CSD[0] = SD_LL_GET_RESPONSE(instance, SD_RESP1);
+  SD_dev->handle.CSD[1] = SD_LL_GET_RESPONSE(instance, SD_RESP2);
+  SD_dev->handle.CSD[2] = SD_LL_GET_RESPONSE(instance, SD_RESP3);
+  SD_dev->handle.CSD[3] = SD_LL_GET_RESPONSE(instance, SD_RESP4);
+  SD_dev->handle.SdCard.Class = SD_dev->handle.CSD[1] >> 20U;
+  /* Block number and size */
+  if (HAL_SD_GetCardCSD(&SD_dev->handle, &csd) != HAL_OK) {
+    return HAL_SD_ERROR_UNSUPPORTED_FEATURE;
+  }
+
+  errorstate = SDMMC_CmdSelDesel(instance, (uint32_t)rca << 16U);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    return errorstate;
+  }
+  SD_dev->handle.ErrorCode = HAL_SD_ERROR_NONE;
+  SD_dev->handle.Context = SD_CONTEXT_NONE;
+  SD_dev->handle.State = HAL_SD_STATE_READY;
+
+  /* Enable wide operation, with the transfer clock */
+  if (HAL_SD_ConfigWideBusOperation(&SD_dev->handle, SD_BUS_WIDE) != HAL_OK) {
+    return (SD_dev->handle.ErrorCode != HAL_SD_ERROR_NONE) ? SD_dev->handle.ErrorCode : HAL_SD_ERROR_UNSUPPORTED_FEATURE;
+  }
+  return SDMMC_ERROR_NONE;
+}
+
+/**
+  * @brief  Checks that the card kept by BSP_SD_Suspend() is the identified
+  *         one: its CID (CMD10, sent in stand-by state) is compared with the
+  *         one read at the identification, then the card is selected again.
+  * @retval SDMMC error state, SDMMC_ERROR_GENERAL_UNKNOWN_ERR for another card
+  */
+static uint32_t SD_CheckCID(void)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  SD_CmdInitTypeDef command;
+  uint32_t rca = (uint32_t)hsd->SdCard.RelCardAdd << 16U;
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t errorstate = SDMMC_ERROR_NONE;
+
+  /* Deselect: CMD7 with the RCA 0 has no response */
+  command.Argument         = 0U;
+  command.CmdIndex         = 7U;
+  command.Response         = SD_RESPONSE_NO;
+  command.WaitForInterrupt = SD_WAIT_NO;
+  command.CPSM             = SD_CPSM_ENABLE;
+  (void)SD_LL_SEND_COMMAND(hsd->Instance, &command);
+  while (!__HAL_SD_GET_FLAG(hsd, SD_FLAG_CMDSENT)) {
+    if ((HAL_GetTick() - tickstart) >= SDMMC_CMDTIMEOUT) {
+      return SDMMC_ERROR_CMD_RSP_TIMEOUT;
+    }
+  }
+  __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_CMD_FLAGS);
+
+  command.Argument         = rca;
+  command.CmdIndex         = 10U;
+  command.Response         = SD_RESPONSE_LONG;
+  (void)SD_LL_SEND_COMMAND(hsd->Instance, &command);
+  while (!__HAL_SD_GET_FLAG(hsd, SD_FLAG_CCRCFAIL | SD_FLAG_CMDREND | SD_FLAG_CTIMEOUT)) {
+    if ((HAL_GetTick() - tickstart) >= SDMMC_CMDTIMEOUT) {
+      return SDMMC_ERROR_CMD_RSP_TIMEOUT;
+    }
+  }
+  if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_CTIMEOUT)) {
+    errorstate = SDMMC_ERROR_CMD_RSP_TIMEOUT;
+  } else if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_CCRCFAIL)) {
+    errorstate = SDMMC_ERROR_CMD_CRC_FAIL;
+  } else if ((SD_LL_GET_RESPONSE(hsd->Instance, SD_RESP1) != hsd->CID[0]) ||
+             (SD_LL_GET_RESPONSE(hsd->Instance, SD_RESP2) != hsd->CID[1]) ||
+             (SD_LL_GET_RESPONSE(hsd->Instance, SD_RESP3) != hsd->CID[2]) ||
+             (SD_LL_GET_RESPONSE(hsd->Instance, SD_RESP4) != hsd->CID[3])) {
+    errorstate = SDMMC_ERROR_GENERAL_UNKNOWN_ERR;
+  }
+  __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_CMD_FLAGS);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    return errorstate;
+  }
+  return SDMMC_CmdSelDesel(hsd->Instance, rca);
+}
+
 /**
   * @brief  DeInitializes the SD card device.
   * @retval SD status
@@ -340,8 +805,16 @@ uint8_t BSP_SD_DeInit(void)
 {
   uint8_t sd_state = MSD_OK;
 
+  SD_dev->suspended = false;
+  SD_dev->init_step = SD_INIT_IDLE;
+  SD_dev->scr_valid = false;
+  /* The card cache and command queue are disabled by the next identification */
+  SD_dev->cache_reg = 0;
+  SD_dev->queue_depth = 0;
+  SD_dev->queue_tasks = 0;
+
 #if !defined(STM32_CORE_VERSION) || (STM32_CORE_VERSION <= 0x02050000)
-  uSdHandle.Instance = SD_INSTANCE;
+  SD_dev->handle.Instance = SD_INSTANCE;
 #else
   if (!BSP_SD_GetInstance()) {
     sd_state = MSD_ERROR;
@@ -349,23 +822,40 @@ uint8_t BSP_SD_DeInit(void)
 #endif
   {
     /* HAL SD deinitialization */
-    if (HAL_SD_DeInit(&uSdHandle) != HAL_OK) {
+    if (HAL_SD_DeInit(&SD_dev->handle) != HAL_OK) {
       sd_state = MSD_ERROR;
     }
 
     /* Msp SD deinitialization */
-    BSP_SD_MspDeInit(&uSdHandle, NULL);
+    BSP_SD_MspDeInit(&SD_dev->handle, NULL);
 
-    if (SD_detect_ll_gpio_pin != LL_GPIO_PIN_ALL) {
-      BSP_SD_Detect_MspDeInit(&uSdHandle, NULL);
+    /* Keep the detect pin to see the next card insertion */
+    if ((SD_dev->detect_ll_gpio_pin != LL_GPIO_PIN_ALL) && !SD_dev->detect_it) {
+      BSP_SD_Detect_MspDeInit(&SD_dev->handle, NULL);
     }
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
-    BSP_SD_Transceiver_MspDeInit(&uSdHandle, NULL);
+    BSP_SD_Transceiver_MspDeInit(&SD_dev->handle, NULL);
 #endif
   }
   return sd_state;
 }
 
+/**
+  * @brief  Release the SD card device keeping the card identified and
+  *         selected, so the next BSP_SD_Init() only checks with one command
+  *         that the same card is still present instead of identifying it.
+  *         Card information (CID, CSD, SCR, RCA, bus width) is kept.
+  * @retval SD status
+  */
+uint8_t BSP_SD_Suspend(void)
+{
+  if (SD_dev->handle.State != HAL_SD_STATE_READY) {
+    return BSP_SD_DeInit();
+  }
+  SD_dev->suspended = true;
+  return MSD_OK;
+}
+
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
 /**
   * @brief  Set the transceiver pin and port.
@@ -379,10 +869,10 @@ uint8_t BSP_SD_TransceiverPin(GPIO_TypeDef *enport, uint32_t enpin, GPIO_TypeDef
 {
   uint8_t sd_state = MSD_OK;
   if ((enport != 0) && (selport != 0)) {
-    SD_trans_en_ll_gpio_pin = enpin;
-    SD_trans_en_gpio_port = enport;
-    SD_trans_sel_ll_gpio_pin = selpin;
-    SD_trans_sel_gpio_port = selport;
+    SD_dev->trans_en_ll_gpio_pin = enpin;
+    SD_dev->trans_en_gpio_port = enport;
+    SD_dev->trans_sel_ll_gpio_pin = selpin;
+    SD_dev->trans_sel_gpio_port = selport;
   } else {
     sd_state = MSD_ERROR;
   }
@@ -402,15 +892,41 @@ uint8_t BSP_SD_DetectPin(PinName p, uint32_t level)
   GPIO_TypeDef *port = set_GPIO_Port_Clock(STM_PORT(p));
   uint32_t pin = STM_LL_GPIO_PIN(p);
   if (port != 0) {
-    SD_detect_ll_gpio_pin = pin;
-    SD_detect_gpio_port = port;
-    SD_detect_level = level;
+    SD_dev->detect_ll_gpio_pin = pin;
+    SD_dev->detect_gpio_port = port;
+    SD_dev->detect_gpio_pin = STM_GPIO_PIN(p);
+    SD_dev->detect_level = level;
   } else {
     sd_state = MSD_ERROR;
   }
   return sd_state;
 }
 
+/**
+  * @brief  Configures an interrupt on both edges of the detect pin, set by
+  *         BSP_SD_DetectPin(), to be notified of card insertion and removal.
+  *         The detect pin is then kept configured by BSP_SD_DeInit().
+  * @param  callback: function called from the interrupt, NULL to disable
+  * @retval SD status
+  */
+uint8_t BSP_SD_DetectITConfig(void (*callback)(void))
+{
+  if (SD_dev->detect_ll_gpio_pin == LL_GPIO_PIN_ALL) {
+    return MSD_ERROR;
+  }
+  if (callback == NULL) {
+    if (SD_dev->detect_it) {
+      stm32_interrupt_disable(SD_dev->detect_gpio_port, SD_dev->detect_gpio_pin);
+      SD_dev->detect_it = false;
+    }
+  } else {
+    BSP_SD_Detect_MspInit(&SD_dev->handle, NULL);
+    stm32_interrupt_enable(SD_dev->detect_gpio_port, SD_dev->detect_gpio_pin, callback, GPIO_MODE_IT_RISING_FALLING);
+    SD_dev->detect_it = true;
+  }
+  return MSD_OK;
+}
+
 /**
  * @brief  Detects if SD card is correctly plugged in the memory slot or not.
  * @retval Returns if SD is detected or not
@@ -418,7 +934,7 @@ uint8_t BSP_SD_DetectPin(PinName p, uint32_t level)
 uint8_t BSP_SD_IsDetected(void)
 {
   /* Check SD card detect pin */
-  return (LL_GPIO_IsInputPinSet(SD_detect_gpio_port, SD_detect_ll_gpio_pin) == SD_detect_level) ? SD_PRESENT : SD_NOT_PRESENT;
+  return (LL_GPIO_IsInputPinSet(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin) == SD_dev->detect_level) ? SD_PRESENT : SD_NOT_PRESENT;
 }
 
 /**
@@ -431,7 +947,19 @@ uint8_t BSP_SD_IsDetected(void)
   */
 uint8_t BSP_SD_ReadBlocks(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks, uint32_t Timeout)
 {
-  return (HAL_SD_ReadBlocks(&uSdHandle, (uint8_t *)pData, ReadAddr, NumOfBlocks, Timeout) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  uint8_t status;
+  SD_PROBE_START(SD_PROBE_BSP_READ);
+  SD_TRACE_BEGIN(SD_TRACE_READ, ReadAddr, NumOfBlocks);
+
+  if (SD_dev->queue_depth != 0) {
+    /* Once the command queue is enabled, the transfers go through it */
+    status = SD_QueueTransfer(true, pData, ReadAddr, NumOfBlocks, Timeout);
+  } else {
+    status = (HAL_SD_ReadBlocks(&SD_dev->handle, (uint8_t *)pData, ReadAddr, NumOfBlocks, Timeout) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  }
+  SD_TRACE_END(status);
+  SD_PROBE_STOP(SD_PROBE_BSP_READ);
+  return status;
 }
 
 /**
@@ -444,7 +972,30 @@ uint8_t BSP_SD_ReadBlocks(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBloc
   */
 uint8_t BSP_SD_WriteBlocks(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks, uint32_t Timeout)
 {
-  return (HAL_SD_WriteBlocks(&uSdHandle, (uint8_t *)pData, WriteAddr, NumOfBlocks, Timeout) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  uint8_t status;
+  SD_PROBE_START(SD_PROBE_BSP_WRITE);
+  SD_TRACE_BEGIN(SD_TRACE_WRITE, WriteAddr, NumOfBlocks);
+
+#if SD_LATENCY_STATS
+  SD_dev->write_start = micros();
+  SD_dev->write_sector = WriteAddr;
+#endif
+  if (SD_dev->queue_depth != 0) {
+    status = SD_QueueTransfer(false, pData, WriteAddr, NumOfBlocks, Timeout);
+  } else {
+    status = (HAL_SD_WriteBlocks(&SD_dev->handle, (uint8_t *)pData, WriteAddr, NumOfBlocks, Timeout) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  }
+  SD_TRACE_END(status);
+#if SD_LATENCY_STATS
+  if (status == MSD_OK) {
+    /* Recorded by BSP_SD_GetCardState() once programmed */
+    SD_dev->write_pending = true;
+  } else {
+    BSP_SD_LatencyRecord(SD_LATENCY_WRITE, WriteAddr, micros() - SD_dev->write_start);
+  }
+#endif
+  SD_PROBE_STOP(SD_PROBE_BSP_WRITE);
+  return status;
 }
 
 /**
@@ -455,7 +1006,628 @@ uint8_t BSP_SD_WriteBlocks(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBl
   */
 uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr)
 {
-  return (HAL_SD_Erase(&uSdHandle, StartAddr, EndAddr) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  uint8_t status;
+  SD_TRACE_BEGIN(SD_TRACE_ERASE, (uint32_t)StartAddr, (uint32_t)(EndAddr - StartAddr + 1));
+
+  status = (HAL_SD_Erase(&SD_dev->handle, StartAddr, EndAddr) != HAL_OK) ? MSD_ERROR : MSD_OK;
+  SD_TRACE_END(status);
+  return status;
+}
+
+#if SD_PROBES
+/**
+  * @brief  Enable the DWT cycle counter and clear the probes.
+  * @retval None
+  */
+void BSP_SD_ProbeReset(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+#if defined(__CORTEX_M) && (__CORTEX_M == 7U)
+  /* Unlock the DWT registers */
+  DWT->LAR = 0xC5ACCE55;
+#endif
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  for (uint8_t i = 0; i < SD_PROBE_COUNT; i++) {
+    SD_probes[i].count = 0;
+    SD_probes[i].min = UINT32_MAX;
+    SD_probes[i].max = 0;
+    SD_probes[i].total = 0;
+  }
+}
+
+/**
+  * @brief  Get the counters of a probe, in CPU cycles.
+  * @param  probe: SD_PROBE_* probe
+  * @retval probe counters, NULL if probe is invalid
+  */
+const SD_Probe_t *BSP_SD_GetProbe(uint8_t probe)
+{
+  return (probe < SD_PROBE_COUNT) ? &SD_probes[probe] : NULL;
+}
+
+/**
+  * @brief  Get the name of a probe, e.g. to print a report.
+  * @param  probe: SD_PROBE_* probe
+  * @retval name, NULL if probe is invalid
+  */
+const char *BSP_SD_ProbeName(uint8_t probe)
+{
+  static const char *const names[SD_PROBE_COUNT] = {
+    "File::read", "File::write", "f_read", "f_write",
+    "disk_read", "disk_write", "BSP_SD_ReadBlocks", "BSP_SD_WriteBlocks"
+  };
+  return (probe < SD_PROBE_COUNT) ? names[probe] : NULL;
+}
+#endif /* SD_PROBES */
+
+#if SD_TRACE_SIZE > 0
+/**
+  * @brief  Start recording the block I/O of all the devices, previous records
+  *         are cleared.
+  * @retval None
+  */
+void BSP_SD_TraceStart(void)
+{
+  SD_traceNext = 0;
+  SD_traceOn = true;
+}
+
+/**
+  * @brief  Stop recording the block I/O, records are kept.
+  * @retval None
+  */
+void BSP_SD_TraceStop(void)
+{
+  SD_traceOn = false;
+}
+
+/**
+  * @brief  Get the number of records in the trace buffer.
+  * @retval number of records, up to SD_TRACE_SIZE
+  */
+uint32_t BSP_SD_TraceCount(void)
+{
+  return (SD_traceNext < SD_TRACE_SIZE) ? SD_traceNext : SD_TRACE_SIZE;
+}
+
+/**
+  * @brief  Get the number of records overwritten since the trace start.
+  * @retval number of lost records
+  */
+uint32_t BSP_SD_TraceLost(void)
+{
+  return SD_traceNext - BSP_SD_TraceCount();
+}
+
+/**
+  * @brief  Get a record of the trace buffer.
+  * @param  index: record index, 0 being the oldest one
+  * @param  record: copy of the record
+  * @retval true if found, false otherwise
+  */
+bool BSP_SD_TraceGet(uint32_t index, SD_TraceRecord_t *record)
+{
+  if (index >= BSP_SD_TraceCount()) {
+    return false;
+  }
+  *record = SD_trace[(SD_traceNext - BSP_SD_TraceCount() + index) % SD_TRACE_SIZE];
+  return true;
+}
+
+/**
+  * @brief  Record the start of a block I/O.
+  * @param  op: SD_TRACE_* operation
+  * @param  sector: first sector
+  * @param  count: number of sectors
+  * @retval record to complete by SD_TraceEnd(), NULL if not recording
+  */
+static SD_TraceRecord_t *SD_TraceBegin(uint8_t op, uint32_t sector, uint32_t count)
+{
+  SD_TraceRecord_t *record;
+
+  if (!SD_traceOn) {
+    return NULL;
+  }
+  record = &SD_trace[SD_traceNext++ % SD_TRACE_SIZE];
+  record->op = op;
+  record->device = BSP_SD_GetDevice();
+  record->sector = sector;
+  record->count = (count > UINT16_MAX) ? UINT16_MAX : (uint16_t)count;
+  record->start = micros();
+  return record;
+}
+
+/**
+  * @brief  Record the end of a block I/O.
+  * @param  record: record returned by SD_TraceBegin()
+  * @param  status: SD status of the operation
+  * @retval None
+  */
+static void SD_TraceEnd(SD_TraceRecord_t *record, uint8_t status)
+{
+  if (record != NULL) {
+    record->end = micros();
+    if (status != MSD_OK) {
+      record->device |= SD_TRACE_FAILED;
+    }
+  }
+}
+#endif /* SD_TRACE_SIZE > 0 */
+
+/**
+  * @brief  Read the SD Status register (ACMD13) of the card.
+  * @param  status: 64 bytes, in the card order (bit 511 first)
+  * @retval SD status
+  */
+uint8_t BSP_SD_GetSDStatus(uint8_t *status)
+{
+  return SD_ReadRegister(false, status, 64U);
+}
+
+/**
+  * @brief  Read the SD Configuration Register (ACMD51) of the card.
+  * @param  scr: 8 bytes, in the card order (bit 63 first)
+  * @retval SD status
+  */
+uint8_t BSP_SD_GetSCR(uint8_t *scr)
+{
+  /* Read once per identification, as the CID and CSD */
+  if (!SD_dev->scr_valid) {
+    if (SD_ReadRegister(true, SD_dev->scr, 8U) != MSD_OK) {
+      return MSD_ERROR;
+    }
+    SD_dev->scr_valid = true;
+  }
+  memcpy(scr, SD_dev->scr, 8U);
+  return MSD_OK;
+}
+
+/**
+  * @brief  Read a register of the card sent on the data lines, the HAL
+  *         decoding only a part of the SD Status and not the SCR.
+  * @param  scr: true for the SCR (ACMD51), false for the SD Status (ACMD13)
+  * @param  data: register content
+  * @param  size: register size in bytes, 8 or 64
+  * @retval SD status
+  */
+static uint8_t SD_ReadRegister(bool scr, uint8_t *data, uint32_t size)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  uint32_t errorstate;
+
+  if (hsd->State != HAL_SD_STATE_READY) {
+    return MSD_ERROR;
+  }
+  errorstate = SDMMC_CmdBlockLength(hsd->Instance, size);
+  if (errorstate == SDMMC_ERROR_NONE) {
+    errorstate = SDMMC_CmdAppCommand(hsd->Instance, (uint32_t)(hsd->SdCard.RelCardAdd << 16U));
+  }
+  if (errorstate == SDMMC_ERROR_NONE) {
+    errorstate = SD_DataCommand(scr ? 51U : 13U, 0U, true, data, size,
+                                scr ? SD_DATABLOCK_SIZE_8B : SD_DATABLOCK_SIZE_64B);
+  }
+  /* Restore the block length of the data transfers */
+  (void)SDMMC_CmdBlockLength(hsd->Instance, BLOCKSIZE);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    hsd->ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Send a command with a short response, for the commands the HAL
+  *         does not provide.
+  * @param  cmd: command index
+  * @param  arg: command argument
+  * @param  r1: true to check the card status errors of a R1 response
+  * @param  response: response, can be NULL
+  * @retval SDMMC error state
+  */
+static uint32_t SD_SendCommand(uint8_t cmd, uint32_t arg, bool r1, uint32_t *response)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  SD_CmdInitTypeDef command;
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t resp;
+
+  command.Argument         = arg;
+  command.CmdIndex         = cmd;
+  command.Response         = SD_RESPONSE_SHORT;
+  command.WaitForInterrupt = SD_WAIT_NO;
+  command.CPSM             = SD_CPSM_ENABLE;
+  (void)SD_LL_SEND_COMMAND(hsd->Instance, &command);
+  while (!__HAL_SD_GET_FLAG(hsd, SD_FLAG_CCRCFAIL | SD_FLAG_CMDREND | SD_FLAG_CTIMEOUT)) {
+    if ((HAL_GetTick() - tickstart) >= SDMMC_CMDTIMEOUT) {
+      return SDMMC_ERROR_CMD_RSP_TIMEOUT;
+    }
+  }
+  if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_CTIMEOUT)) {
+    __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_CMD_FLAGS);
+    return SDMMC_ERROR_CMD_RSP_TIMEOUT;
+  }
+  if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_CCRCFAIL)) {
+    __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_CMD_FLAGS);
+    return SDMMC_ERROR_CMD_CRC_FAIL;
+  }
+  __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_CMD_FLAGS);
+  if (SD_LL_GET_COMMAND(hsd->Instance) != cmd) {
+    return SDMMC_ERROR_CMD_CRC_FAIL;
+  }
+  resp = SD_LL_GET_RESPONSE(hsd->Instance, SD_RESP1);
+  if (response != NULL) {
+    *response = resp;
+  }
+  return (r1 && ((resp & SDMMC_OCR_ERRORBITS) != 0U)) ? SDMMC_ERROR_GENERAL_UNKNOWN_ERR : SDMMC_ERROR_NONE;
+}
+
+/**
+  * @brief  Send a command with a R1 response and transfer its data by
+  *         polling the FIFO.
+  * @param  cmd: command index
+  * @param  arg: command argument
+  * @param  read: true to read from the card, false to write
+  * @param  data: data, any alignment
+  * @param  size: data size in bytes, a multiple of 32 to write
+  * @param  block: SD_DATABLOCK_SIZE_* of the data blocks
+  * @retval SDMMC error state
+  */
+static uint32_t SD_DataCommand(uint8_t cmd, uint32_t arg, bool read, uint8_t *data, uint32_t size, uint32_t block)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  SD_DataInitTypeDef config;
+  uint32_t errorstate;
+  uint32_t count = 0;
+  uint32_t word;
+  uint32_t tickstart = HAL_GetTick();
+
+  config.DataTimeOut   = SDMMC_DATATIMEOUT;
+  config.DataLength    = size;
+  config.DataBlockSize = block;
+  config.TransferDir   = read ? SD_TRANSFER_DIR_TO_HOST : SD_TRANSFER_DIR_TO_CARD;
+  config.TransferMode  = SD_TRANSFER_MODE_BLOCK;
+#if defined(SDMMC_CMD_CMDTRANS)
+  /* The data transfer is started by the command */
+  config.DPSM          = SDMMC_DPSM_DISABLE;
+  (void)SD_LL_CONFIG_DATA(hsd->Instance, &config);
+  __SDMMC_CMDTRANS_ENABLE(hsd->Instance);
+#else
+  config.DPSM          = SD_DPSM_ENABLE;
+  (void)SD_LL_CONFIG_DATA(hsd->Instance, &config);
+#endif
+  errorstate = SD_SendCommand(cmd, arg, true, NULL);
+  if (errorstate == SDMMC_ERROR_NONE) {
+    /* FIFO words hold the data bytes in the card order */
+    while (!__HAL_SD_GET_FLAG(hsd, SD_FLAG_RXOVERR | SD_FLAG_TXUNDERR | SD_FLAG_DCRCFAIL |
+                              SD_FLAG_DTIMEOUT | SD_FLAG_DATAEND)) {
+      if (read && __HAL_SD_GET_FLAG(hsd, SD_FLAG_RXFIFOHF) && ((count + 32U) <= size)) {
+        for (uint32_t i = 0; i < 8U; i++, count += 4U) {
+          word = SD_LL_READ_FIFO(hsd->Instance);
+          memcpy(&data[count], &word, 4U);
+        }
+      } else if (!read && __HAL_SD_GET_FLAG(hsd, SD_FLAG_TXFIFOHE) && ((count + 32U) <= size)) {
+        for (uint32_t i = 0; i < 8U; i++, count += 4U) {
+          memcpy(&word, &data[count], 4U);
+          (void)SD_LL_WRITE_FIFO(hsd->Instance, &word);
+        }
+      }
+      if ((HAL_GetTick() - tickstart) >= SDMMC_DATATIMEOUT) {
+        errorstate = SDMMC_ERROR_DATA_TIMEOUT;
+        break;
+      }
+    }
+    if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_DTIMEOUT)) {
+      errorstate = SDMMC_ERROR_DATA_TIMEOUT;
+    } else if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_DCRCFAIL)) {
+      errorstate = SDMMC_ERROR_DATA_CRC_FAIL;
+    } else if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_RXOVERR)) {
+      errorstate = SDMMC_ERROR_RX_OVERRUN;
+    } else if (__HAL_SD_GET_FLAG(hsd, SD_FLAG_TXUNDERR)) {
+      errorstate = SDMMC_ERROR_TX_UNDERRUN;
+    }
+    while (read && (errorstate == SDMMC_ERROR_NONE) && (count < size) && !__HAL_SD_GET_FLAG(hsd, SD_FLAG_RXFIFOE)) {
+      word = SD_LL_READ_FIFO(hsd->Instance);
+      memcpy(&data[count], &word, 4U);
+      count += 4U;
+    }
+    if ((errorstate == SDMMC_ERROR_NONE) && (count < size)) {
+      errorstate = SDMMC_ERROR_DATA_TIMEOUT;
+    }
+  }
+#if defined(SDMMC_CMD_CMDTRANS)
+  __SDMMC_CMDTRANS_DISABLE(hsd->Instance);
+#endif
+  __HAL_SD_CLEAR_FLAG(hsd, SD_STATIC_FLAGS);
+  return errorstate;
+}
+
+/**
+  * @brief  Read an extension register of the card (CMD48), e.g. of the
+  *         performance enhancement function, found in the general
+  *         information at SD_EXT_REG(0, 0, 0).
+  * @param  reg: register address, see SD_EXT_REG()
+  * @param  data: register content, 512 bytes
+  * @param  length: number of bytes to read, from 1 to 512
+  * @retval SD status
+  */
+uint8_t BSP_SD_ReadExtension(uint32_t reg, uint8_t *data, uint16_t length)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  uint32_t errorstate;
+
+  if ((hsd->State != HAL_SD_STATE_READY) || (length == 0U) || (length > BLOCKSIZE)) {
+    return MSD_ERROR;
+  }
+  /* FNO, page, offset and length - 1 */
+  errorstate = SD_DataCommand(48U, (((reg >> 18) & 0x0FU) << 27) | (((reg >> 9) & 0xFFU) << 18) |
+                              ((reg & 0x1FFU) << 9) | (length - 1U), true, data, BLOCKSIZE,
+                              SD_DATABLOCK_SIZE_512B);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    hsd->ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Write one byte of an extension register of the card (CMD49).
+  *         The card is busy until the register is set.
+  * @param  reg: register address, see SD_EXT_REG()
+  * @param  value: register byte
+  * @retval SD status
+  */
+uint8_t BSP_SD_WriteExtension(uint32_t reg, uint8_t value)
+{
+  SD_HandleTypeDef *hsd = &SD_dev->handle;
+  uint8_t block[BLOCKSIZE] = { value };
+  uint32_t errorstate;
+
+  if (hsd->State != HAL_SD_STATE_READY) {
+    return MSD_ERROR;
+  }
+  errorstate = SD_DataCommand(49U, (((reg >> 18) & 0x0FU) << 27) | (((reg >> 9) & 0xFFU) << 18) |
+                              ((reg & 0x1FFU) << 9), false, block, BLOCKSIZE, SD_DATABLOCK_SIZE_512B);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    hsd->ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Set the performance enhancement register once the card cache is
+  *         enabled in it, 0 once disabled. BSP_SD_CacheFlush() then flushes
+  *         the cache.
+  * @param  reg: register address, see SD_EXT_REG()
+  * @retval None
+  */
+void BSP_SD_CacheSetRegister(uint32_t reg)
+{
+  SD_dev->cache_reg = reg;
+}
+
+/**
+  * @brief  Check if the card cache is enabled.
+  * @retval true if enabled
+  */
+bool BSP_SD_CacheEnabled(void)
+{
+  return SD_dev->cache_reg != 0U;
+}
+
+/**
+  * @brief  Flush the card cache and wait for the end: the data written
+  *         before are then kept at power off. Nothing to do if the cache is
+  *         disabled.
+  * @param  Timeout: time in ms to wait for the end of the flush
+  * @retval SD status
+  */
+uint8_t BSP_SD_CacheFlush(uint32_t Timeout)
+{
+  uint8_t reg[BLOCKSIZE];
+  uint32_t tickstart = HAL_GetTick();
+
+  if (SD_dev->cache_reg == 0U) {
+    return MSD_OK;
+  }
+  if (BSP_SD_WriteExtension(SD_dev->cache_reg + SD_PERF_CACHE_FLUSH, 0x01) != MSD_OK) {
+    return MSD_ERROR;
+  }
+  while (HAL_SD_GetCardState(&SD_dev->handle) != HAL_SD_CARD_TRANSFER) {
+    if ((HAL_GetTick() - tickstart) >= Timeout) {
+      return MSD_ERROR;
+    }
+  }
+  /* The card clears the flush bit once done */
+  if ((BSP_SD_ReadExtension(SD_dev->cache_reg + SD_PERF_CACHE_FLUSH, reg, 1U) != MSD_OK) ||
+      (reg[0] & 0x01U)) {
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Set the depth of the command queue once enabled in the
+  *         performance enhancement register of the card, 0 once disabled.
+  *         The block transfers then go through the queue.
+  * @param  depth: number of tasks used, up to SD_QUEUE_DEPTH
+  * @retval SD status
+  */
+uint8_t BSP_SD_QueueSetDepth(uint8_t depth)
+{
+  if (SD_dev->queue_tasks != 0U) {
+    return MSD_BUSY;
+  }
+  SD_dev->queue_depth = (depth > SD_QUEUE_DEPTH) ? SD_QUEUE_DEPTH : depth;
+  SD_dev->queue_write = false;
+  return MSD_OK;
+}
+
+/**
+  * @brief  Get the depth of the command queue.
+  * @retval number of tasks, 0 if the command queue is disabled
+  */
+uint8_t BSP_SD_QueueDepth(void)
+{
+  return SD_dev->queue_depth;
+}
+
+/**
+  * @brief  Get the queued tasks, not executed yet.
+  * @retval mask of the tasks
+  */
+uint32_t BSP_SD_QueueTasks(void)
+{
+  return SD_dev->queue_tasks;
+}
+
+/**
+  * @brief  Queue a task (CMD44 and CMD45): the card prepares it while the
+  *         other tasks are executed.
+  * @param  read: true to read, false to write
+  * @param  sector: first sector
+  * @param  count: number of sectors, up to 65535
+  * @retval task number, -1 if the queue is full or on error
+  */
+int8_t BSP_SD_QueueSubmit(bool read, uint32_t sector, uint32_t count)
+{
+  uint32_t errorstate;
+  uint8_t task;
+
+  if ((count == 0U) || (count > UINT16_MAX)) {
+    return -1;
+  }
+  for (task = 0; (task < SD_dev->queue_depth) && (SD_dev->queue_tasks & (1UL << task)); task++) {
+  }
+  if (task >= SD_dev->queue_depth) {
+    return -1;
+  }
+  /* Direction, task ID and number of blocks, then the start block */
+  errorstate = SD_SendCommand(44U, (read ? (1UL << 30) : 0U) | ((uint32_t)task << 16) | count, true, NULL);
+  if (errorstate == SDMMC_ERROR_NONE) {
+    errorstate = SD_SendCommand(45U, sector, true, NULL);
+  }
+  if (errorstate != SDMMC_ERROR_NONE) {
+    SD_dev->handle.ErrorCode |= errorstate;
+    return -1;
+  }
+  SD_dev->queue_tasks |= 1UL << task;
+  if (read) {
+    SD_dev->queue_reads |= 1UL << task;
+  } else {
+    SD_dev->queue_reads &= ~(1UL << task);
+  }
+  SD_dev->queue_count[task] = (uint16_t)count;
+  return (int8_t)task;
+}
+
+/**
+  * @brief  Get the tasks ready for execution (CMD13 queue status).
+  * @param  ready: mask of the ready tasks
+  * @retval SD status
+  */
+uint8_t BSP_SD_QueueStatus(uint32_t *ready)
+{
+  uint32_t errorstate;
+
+  errorstate = SD_SendCommand(13U, (uint32_t)(SD_dev->handle.SdCard.RelCardAdd << 16U) | (1UL << 15),
+                              false, ready);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    SD_dev->handle.ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  *ready &= SD_dev->queue_tasks;
+  return MSD_OK;
+}
+
+/**
+  * @brief  Execute a ready task (CMD46 or CMD47), transferring its data.
+  * @param  task: task number returned by BSP_SD_QueueSubmit()
+  * @param  pData: data of the task
+  * @param  Timeout: time in ms to wait for the end of a previous write
+  * @retval SD status
+  */
+uint8_t BSP_SD_QueueExecute(uint8_t task, uint32_t *pData, uint32_t Timeout)
+{
+  uint32_t errorstate;
+  uint32_t tickstart = HAL_GetTick();
+  bool read;
+
+  if ((task >= SD_QUEUE_DEPTH) || !(SD_dev->queue_tasks & (1UL << task))) {
+    return MSD_ERROR;
+  }
+  /* Data lines busy while programming a write */
+  while (SD_dev->queue_write && (HAL_SD_GetCardState(&SD_dev->handle) != HAL_SD_CARD_TRANSFER)) {
+    if ((HAL_GetTick() - tickstart) >= Timeout) {
+      return MSD_BUSY;
+    }
+  }
+  read = (SD_dev->queue_reads & (1UL << task)) != 0U;
+  SD_dev->queue_tasks &= ~(1UL << task);
+  SD_dev->queue_write = !read;
+  errorstate = SD_DataCommand(read ? 46U : 47U, (uint32_t)task << 16, read, (uint8_t *)pData,
+                              (uint32_t)SD_dev->queue_count[task] * BLOCKSIZE, SD_DATABLOCK_SIZE_512B);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    SD_dev->handle.ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Abort all the queued tasks (CMD43), e.g. after an error.
+  * @retval SD status
+  */
+uint8_t BSP_SD_QueueAbort(void)
+{
+  uint32_t errorstate;
+
+  SD_dev->queue_tasks = 0;
+  errorstate = SD_SendCommand(43U, 1U, true, NULL);
+  if (errorstate != SDMMC_ERROR_NONE) {
+    SD_dev->handle.ErrorCode |= errorstate;
+    return MSD_ERROR;
+  }
+  return MSD_OK;
+}
+
+/**
+  * @brief  Transfer blocks through the command queue, waiting for the end.
+  * @param  read: true to read, false to write
+  * @param  pData: data
+  * @param  addr: first block
+  * @param  count: number of blocks
+  * @param  Timeout: time in ms to wait for each task
+  * @retval SD status
+  */
+static uint8_t SD_QueueTransfer(bool read, uint32_t *pData, uint32_t addr, uint32_t count, uint32_t Timeout)
+{
+  uint32_t ready = 0;
+  uint32_t tickstart;
+  uint32_t n;
+  int8_t task;
+
+  while (count != 0U) {
+    n = (count > UINT16_MAX) ? UINT16_MAX : count;
+    task = BSP_SD_QueueSubmit(read, addr, n);
+    if (task < 0) {
+      return MSD_ERROR;
+    }
+    tickstart = HAL_GetTick();
+    do {
+      if ((BSP_SD_QueueStatus(&ready) != MSD_OK) || ((HAL_GetTick() - tickstart) >= Timeout)) {
+        (void)BSP_SD_QueueAbort();
+        return MSD_ERROR;
+      }
+    } while (!(ready & (1UL << task)));
+    if (BSP_SD_QueueExecute((uint8_t)task, pData, Timeout) != MSD_OK) {
+      return MSD_ERROR;
+    }
+    pData += n * (BLOCKSIZE / sizeof(uint32_t));
+    addr += n;
+    count -= n;
+  }
+  return MSD_OK;
 }
 
 /**
@@ -475,33 +1647,33 @@ __weak void BSP_SD_MspInit(SD_HandleTypeDef *hsd, void *Params)
   }
 #else
   /* Configure SD GPIO pins */
-  pinmap_pinout(SD_PinNames.pin_d0, PinMap_SD_DATA0);
+  pinmap_pinout(SD_dev->pins.pin_d0, PinMap_SD_DATA0);
 #if SD_BUS_WIDE == SD_BUS_WIDE_4B
-  pinmap_pinout(SD_PinNames.pin_d1, PinMap_SD_DATA1);
-  pinmap_pinout(SD_PinNames.pin_d2, PinMap_SD_DATA2);
-  pinmap_pinout(SD_PinNames.pin_d3, PinMap_SD_DATA3);
+  pinmap_pinout(SD_dev->pins.pin_d1, PinMap_SD_DATA1);
+  pinmap_pinout(SD_dev->pins.pin_d2, PinMap_SD_DATA2);
+  pinmap_pinout(SD_dev->pins.pin_d3, PinMap_SD_DATA3);
 #endif
-  pinmap_pinout(SD_PinNames.pin_cmd, PinMap_SD_CMD);
-  pinmap_pinout(SD_PinNames.pin_ck, PinMap_SD_CK);
+  pinmap_pinout(SD_dev->pins.pin_cmd, PinMap_SD_CMD);
+  pinmap_pinout(SD_dev->pins.pin_ck, PinMap_SD_CK);
 #if defined(SDMMC1) || defined(SDMMC2)
 #if !defined(SDMMC_CKIN_NA)
-  if (SD_PinNames.pin_ckin != NC) {
-    pinmap_pinout(SD_PinNames.pin_ckin, PinMap_SD_CKIN);
+  if (SD_dev->pins.pin_ckin != NC) {
+    pinmap_pinout(SD_dev->pins.pin_ckin, PinMap_SD_CKIN);
   }
 #endif
 #if !defined(SDMMC_CDIR_NA)
-  if (SD_PinNames.pin_cdir != NC) {
-    pinmap_pinout(SD_PinNames.pin_cdir, PinMap_SD_CDIR);
+  if (SD_dev->pins.pin_cdir != NC) {
+    pinmap_pinout(SD_dev->pins.pin_cdir, PinMap_SD_CDIR);
   }
 #endif
 #if !defined(SDMMC_D0DIR_NA)
-  if (SD_PinNames.pin_d0dir != NC) {
-    pinmap_pinout(SD_PinNames.pin_d0dir, PinMap_SD_D0DIR);
+  if (SD_dev->pins.pin_d0dir != NC) {
+    pinmap_pinout(SD_dev->pins.pin_d0dir, PinMap_SD_D0DIR);
   }
 #endif
 #if !defined(SDMMC_D123DIR_NA)
-  if (SD_PinNames.pin_d123dir != NC) {
-    pinmap_pinout(SD_PinNames.pin_d123dir, PinMap_SD_D123DIR);
+  if (SD_dev->pins.pin_d123dir != NC) {
+    pinmap_pinout(SD_dev->pins.pin_d123dir, PinMap_SD_D123DIR);
   }
 #endif
 #endif /* SDMMC1 || SDMMC2 */
@@ -541,31 +1713,31 @@ __weak void BSP_SD_MspDeInit(SD_HandleTypeDef *hsd, void *Params)
     map++;
   }
 #else
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d0)), STM_GPIO_PIN(SD_PinNames.pin_d0));
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d1)), STM_GPIO_PIN(SD_PinNames.pin_d1));
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d2)), STM_GPIO_PIN(SD_PinNames.pin_d2));
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d3)), STM_GPIO_PIN(SD_PinNames.pin_d3));
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_cmd)), STM_GPIO_PIN(SD_PinNames.pin_cmd));
-  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_ck)), STM_GPIO_PIN(SD_PinNames.pin_ck));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d0)), STM_GPIO_PIN(SD_dev->pins.pin_d0));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d1)), STM_GPIO_PIN(SD_dev->pins.pin_d1));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d2)), STM_GPIO_PIN(SD_dev->pins.pin_d2));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d3)), STM_GPIO_PIN(SD_dev->pins.pin_d3));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_cmd)), STM_GPIO_PIN(SD_dev->pins.pin_cmd));
+  HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_ck)), STM_GPIO_PIN(SD_dev->pins.pin_ck));
 #if defined(SDMMC1) || defined(SDMMC2)
 #if !defined(SDMMC_CKIN_NA)
-  if (SD_PinNames.pin_ckin != NC) {
-    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_ckin)), STM_GPIO_PIN(SD_PinNames.pin_ckin));
+  if (SD_dev->pins.pin_ckin != NC) {
+    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_ckin)), STM_GPIO_PIN(SD_dev->pins.pin_ckin));
   }
 #endif
 #if !defined(SDMMC_CDIR_NA)
-  if (SD_PinNames.pin_cdir != NC) {
-    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_cdir)), STM_GPIO_PIN(SD_PinNames.pin_cdir));
+  if (SD_dev->pins.pin_cdir != NC) {
+    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_cdir)), STM_GPIO_PIN(SD_dev->pins.pin_cdir));
   }
 #endif
 #if !defined(SDMMC_D0DIR_NA)
-  if (SD_PinNames.pin_d0dir != NC) {
-    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d0dir)), STM_GPIO_PIN(SD_PinNames.pin_d0dir));
+  if (SD_dev->pins.pin_d0dir != NC) {
+    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d0dir)), STM_GPIO_PIN(SD_dev->pins.pin_d0dir));
   }
 #endif
 #if !defined(SDMMC_D123DIR_NA)
-  if (SD_PinNames.pin_d123dir != NC) {
-    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_PinNames.pin_d123dir)), STM_GPIO_PIN(SD_PinNames.pin_d123dir));
+  if (SD_dev->pins.pin_d123dir != NC) {
+    HAL_GPIO_DeInit((GPIO_TypeDef *)get_GPIO_Port(STM_PORT(SD_dev->pins.pin_d123dir)), STM_GPIO_PIN(SD_dev->pins.pin_d123dir));
   }
 #endif
 #endif /* SDMMC1 || SDMMC2 */
@@ -601,12 +1773,12 @@ __weak void BSP_SD_Detect_MspInit(SD_HandleTypeDef *hsd, void *Params)
 
   /* GPIO configuration in input for uSD_Detect signal */
 #ifdef LL_GPIO_SPEED_FREQ_VERY_HIGH
-  LL_GPIO_SetPinSpeed(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_VERY_HIGH);
+  LL_GPIO_SetPinSpeed(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_VERY_HIGH);
 #else
-  LL_GPIO_SetPinSpeed(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
+  LL_GPIO_SetPinSpeed(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
 #endif
-  LL_GPIO_SetPinMode(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_MODE_INPUT);
-  LL_GPIO_SetPinPull(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_PULL_UP);
+  LL_GPIO_SetPinMode(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_MODE_INPUT);
+  LL_GPIO_SetPinPull(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_PULL_UP);
 }
 
 /**
@@ -620,14 +1792,14 @@ __weak void BSP_SD_Detect_MspDeInit(SD_HandleTypeDef *hsd, void *Params)
   UNUSED(Params);
 
   /* GPIO configuration in analog to saves the consumption */
-  LL_GPIO_SetPinSpeed(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
+  LL_GPIO_SetPinSpeed(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
 #ifndef LL_GPIO_PULL_NO
   /* For STM32F1xx */
-  LL_GPIO_SetPinPull(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
+  LL_GPIO_SetPinPull(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
 #else
-  LL_GPIO_SetPinPull(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_PULL_NO);
+  LL_GPIO_SetPinPull(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_PULL_NO);
 #endif
-  LL_GPIO_SetPinMode(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
+  LL_GPIO_SetPinMode(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
 }
 
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
@@ -641,27 +1813,27 @@ __weak void BSP_SD_Transceiver_MspInit(SD_HandleTypeDef *hsd, void *Params)
   UNUSED(hsd);
   UNUSED(Params);
 
-  LL_GPIO_SetPinSpeed(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
-  LL_GPIO_SetPinMode(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_MODE_OUTPUT);
+  LL_GPIO_SetPinSpeed(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
+  LL_GPIO_SetPinMode(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_MODE_OUTPUT);
 #ifndef LL_GPIO_PULL_NO
   /* For STM32F1xx */
-  LL_GPIO_SetPinPull(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
+  LL_GPIO_SetPinPull(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
 #else
-  LL_GPIO_SetPinPull(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_PULL_NO);
+  LL_GPIO_SetPinPull(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_PULL_NO);
 #endif
-  LL_GPIO_SetPinSpeed(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
-  LL_GPIO_SetPinMode(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_MODE_OUTPUT);
+  LL_GPIO_SetPinSpeed(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_SPEED_FREQ_HIGH);
+  LL_GPIO_SetPinMode(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_MODE_OUTPUT);
 #ifndef LL_GPIO_PULL_NO
   /* For STM32F1xx */
-  LL_GPIO_SetPinPull(SD_detect_gpio_port, SD_detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
+  LL_GPIO_SetPinPull(SD_dev->detect_gpio_port, SD_dev->detect_ll_gpio_pin, LL_GPIO_MODE_FLOATING);
 #else
-  LL_GPIO_SetPinPull(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_PULL_NO);
+  LL_GPIO_SetPinPull(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_PULL_NO);
 #endif
   /* Enable the level shifter */
-  LL_GPIO_SetOutputPin(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin);
+  LL_GPIO_SetOutputPin(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin);
 
   /* By default start with the default voltage */
-  LL_GPIO_ResetOutputPin(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin);
+  LL_GPIO_ResetOutputPin(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin);
 }
 
 /**
@@ -674,13 +1846,13 @@ __weak void BSP_SD_Transceiver_MspDeInit(SD_HandleTypeDef *hsd, void *Params)
   UNUSED(hsd);
   UNUSED(Params);
 
-  LL_GPIO_SetPinSpeed(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
-  LL_GPIO_SetPinMode(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
-  LL_GPIO_SetPinPull(SD_trans_en_gpio_port, SD_trans_en_ll_gpio_pin, LL_GPIO_PULL_NO);
+  LL_GPIO_SetPinSpeed(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
+  LL_GPIO_SetPinMode(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
+  LL_GPIO_SetPinPull(SD_dev->trans_en_gpio_port, SD_dev->trans_en_ll_gpio_pin, LL_GPIO_PULL_NO);
 
-  LL_GPIO_SetPinSpeed(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
-  LL_GPIO_SetPinMode(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
-  LL_GPIO_SetPinPull(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin, LL_GPIO_PULL_NO);
+  LL_GPIO_SetPinSpeed(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_SPEED_FREQ_LOW);
+  LL_GPIO_SetPinMode(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_MODE_ANALOG);
+  LL_GPIO_SetPinPull(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin, LL_GPIO_PULL_NO);
 }
 
 /**
@@ -695,9 +1867,9 @@ __weak void BSP_SD_Transceiver_MspDeInit(SD_HandleTypeDef *hsd, void *Params)
 #endif
 {
   if (status == SET) {
-    LL_GPIO_SetOutputPin(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin);
+    LL_GPIO_SetOutputPin(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin);
   } else {
-    LL_GPIO_ResetOutputPin(SD_trans_sel_gpio_port, SD_trans_sel_ll_gpio_pin);
+    LL_GPIO_ResetOutputPin(SD_dev->trans_sel_gpio_port, SD_dev->trans_sel_ll_gpio_pin);
   }
 }
 #endif /* USE_SD_TRANSCEIVER && (USE_SD_TRANSCEIVER != 0U) */
@@ -711,7 +1883,112 @@ __weak void BSP_SD_Transceiver_MspDeInit(SD_HandleTypeDef *hsd, void *Params)
   */
 uint8_t BSP_SD_GetCardState(void)
 {
-  return ((HAL_SD_GetCardState(&uSdHandle) == HAL_SD_CARD_TRANSFER) ? SD_TRANSFER_OK : SD_TRANSFER_BUSY);
+  uint8_t state = (HAL_SD_GetCardState(&SD_dev->handle) == HAL_SD_CARD_TRANSFER) ? SD_TRANSFER_OK : SD_TRANSFER_BUSY;
+#if SD_LATENCY_STATS
+  if ((state == SD_TRANSFER_OK) && SD_dev->write_pending) {
+    SD_dev->write_pending = false;
+    BSP_SD_LatencyRecord(SD_LATENCY_WRITE, SD_dev->write_sector, micros() - SD_dev->write_start);
+  }
+#endif
+  return state;
+}
+
+#if SD_LATENCY_STATS
+/**
+  * @brief  Add a latency to a histogram and call the callback set by
+  *         BSP_SD_LatencyCallback() if over its threshold.
+  * @param  kind: SD_LATENCY_WRITE or SD_LATENCY_SYNC
+  * @param  sector: first sector written, 0 for a sync
+  * @param  us: latency in us
+  * @retval None
+  */
+void BSP_SD_LatencyRecord(uint8_t kind, uint32_t sector, uint32_t us)
+{
+  SD_Latency_t *latency;
+  uint32_t bucket = (us == 0) ? 0 : (32U - __builtin_clz(us));
+
+  if (kind >= SD_LATENCY_KINDS) {
+    return;
+  }
+  latency = &SD_latency[kind];
+  latency->count++;
+  latency->total += us;
+  if (us > latency->max) {
+    latency->max = us;
+  }
+  latency->buckets[(bucket < SD_LATENCY_BUCKETS) ? bucket : (SD_LATENCY_BUCKETS - 1)]++;
+  if ((us > SD_latencyThreshold) && (SD_latencyCallback != NULL)) {
+    SD_latencyCallback(kind, sector, us);
+  }
+}
+
+/**
+  * @brief  Get a latency histogram.
+  * @param  kind: SD_LATENCY_WRITE or SD_LATENCY_SYNC
+  * @retval histogram, NULL if kind is invalid
+  */
+const SD_Latency_t *BSP_SD_GetLatency(uint8_t kind)
+{
+  return (kind < SD_LATENCY_KINDS) ? &SD_latency[kind] : NULL;
+}
+
+/**
+  * @brief  Get a percentile of a latency histogram, e.g. 99 for the p99.
+  * @param  kind: SD_LATENCY_WRITE or SD_LATENCY_SYNC
+  * @param  percent: percentile, from 1 to 100
+  * @retval upper bound in us of the bucket holding the percentile, at most
+  *         the maximum latency, 0 if none recorded
+  */
+uint32_t BSP_SD_LatencyPercentile(uint8_t kind, uint8_t percent)
+{
+  const SD_Latency_t *latency = BSP_SD_GetLatency(kind);
+  uint64_t rank, seen = 0;
+
+  if ((latency == NULL) || (latency->count == 0)) {
+    return 0;
+  }
+  rank = (((uint64_t)latency->count * percent) + 99U) / 100U;
+  for (uint32_t bucket = 0; bucket < (SD_LATENCY_BUCKETS - 1); bucket++) {
+    seen += latency->buckets[bucket];
+    if (seen >= rank) {
+      uint32_t bound = (1UL << bucket) - 1U;
+      return (bound < latency->max) ? bound : latency->max;
+    }
+  }
+  return latency->max;
+}
+
+/**
+  * @brief  Clear the latency histograms.
+  * @retval None
+  */
+void BSP_SD_ResetLatency(void)
+{
+  memset(SD_latency, 0, sizeof(SD_latency));
+}
+
+/**
+  * @brief  Set a callback called when a latency is over a threshold, e.g. to
+  *         log slow writes of the card.
+  * @param  threshold: latency in us
+  * @param  callback: called with the histogram kind, the first sector
+  *         written (0 for a sync) and the latency in us, NULL to disable
+  * @retval None
+  */
+void BSP_SD_LatencyCallback(uint32_t threshold, void (*callback)(uint8_t kind, uint32_t sector, uint32_t us))
+{
+  SD_latencyThreshold = threshold;
+  SD_latencyCallback = callback;
+}
+#endif /* SD_LATENCY_STATS */
+
+/**
+  * @brief  Get the HAL error code of the last failed SD operation.
+  * @retval HAL_SD_ERROR_* flags
+  */
+uint32_t BSP_SD_GetError(void)
+{
+  return HAL_SD_GetError(&SD_dev->handle);
 }
 
 /**
@@ -722,7 +1999,7 @@ uint8_t BSP_SD_GetCardState(void)
 bool BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo)
 {
   /* Get SD card Information */
-  return (HAL_SD_GetCardInfo(&uSdHandle, CardInfo) == HAL_OK);
+  return (HAL_SD_GetCardInfo(&SD_dev->handle, CardInfo) == HAL_OK);
 }
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -67,19 +67,120 @@ Please update the core or install previous library version."
 #define MSD_OK                   ((uint8_t)0x00)
 #define MSD_ERROR                ((uint8_t)0x01)
 #define MSD_ERROR_SD_NOT_PRESENT ((uint8_t)0x02)
+#define MSD_BUSY                 ((uint8_t)0x03)
+
+/* Non-blocking initialization steps */
+#define SD_INIT_IDLE             ((uint8_t)0x00)
+#define SD_INIT_POWER            ((uint8_t)0x01) /* Card power up */
+#define SD_INIT_VOLTAGE          ((uint8_t)0x02) /* Waiting for card ready (ACMD41) */
+#define SD_INIT_IDENTIFY         ((uint8_t)0x03) /* Card identification */
+#define SD_INIT_MOUNT            ((uint8_t)0x04) /* Volume mount (SDClass) */
+#define SD_INIT_DONE             ((uint8_t)0x05)
 
 /* SD Exported Constants */
 #define SD_PRESENT               ((uint8_t)0x01)
 #define SD_NOT_PRESENT           ((uint8_t)0x00)
+#define SD_TRANSFER_OK           ((uint8_t)0x00)
+#define SD_TRANSFER_BUSY         ((uint8_t)0x01)
 #define SD_DETECT_NONE           NUM_DIGITAL_PINS
+/* Address of an extension register (CMD48/49): function, page and offset */
+#define SD_EXT_REG(fno, page, offset) \
+  (((uint32_t)(fno) << 18) | ((uint32_t)(page) << 9) | (uint32_t)(offset))
+/* Performance enhancement extension: function code and register offsets */
+#define SD_FUNC_PERFORMANCE      0x0002
+#define SD_PERF_CACHE_SUPPORT    4   /* Bit 0 */
+#define SD_PERF_QUEUE_DEPTH      6   /* Queue depth - 1, 0 if not supported */
+#define SD_PERF_CACHE_ENABLE     260 /* Bit 0 */
+#define SD_PERF_CACHE_FLUSH      261 /* Bit 0, cleared by the card once flushed */
+#define SD_PERF_QUEUE_ENABLE     262 /* Bit 0 */
 
 /* Could be redefined in variant.h or using build_opt.h */
+/* Number of SD card devices (SDMMC instances) which can be used at once */
+#ifndef SD_MAX_DEVICES
+#if defined(SDMMC2) && defined(STM32_CORE_VERSION) && (STM32_CORE_VERSION > 0x02050000)
+#define SD_MAX_DEVICES           2
+#else
+#define SD_MAX_DEVICES           1
+#endif
+#endif
 #ifndef SD_DETECT_LEVEL
 #define SD_DETECT_LEVEL          LOW
 #endif
+#ifndef SD_INIT_TIMEOUT
+#define SD_INIT_TIMEOUT          1000U /* ms, card power up */
+#endif
 #ifndef SD_DATATIMEOUT
 #define SD_DATATIMEOUT         100000000U
 #endif
+/* Maximum number of tasks of the command queue (CMD44-47), up to 32 */
+#ifndef SD_QUEUE_DEPTH
+#define SD_QUEUE_DEPTH           8
+#endif
+#if (SD_QUEUE_DEPTH < 1) || (SD_QUEUE_DEPTH > 32)
+#error "SD_QUEUE_DEPTH has to be from 1 to 32"
+#endif
+/* Number of records of the block I/O trace ring buffer, 0 to disable */
+#ifndef SD_TRACE_SIZE
+#define SD_TRACE_SIZE            0
+#endif
+
+/* Latency histograms of the card writes and of the file syncs, 0 to disable */
+#ifndef SD_LATENCY_STATS
+#define SD_LATENCY_STATS         0
+#endif
+
+/* Latency histograms */
+#define SD_LATENCY_WRITE         ((uint8_t)0x00) /* BSP_SD_WriteBlocks() to card ready */
+#define SD_LATENCY_SYNC          ((uint8_t)0x01) /* f_sync() of File::flush() and close() */
+#define SD_LATENCY_KINDS         2
+/* Bucket 0 counts latencies of 0 us, bucket n from 2^(n-1) to 2^n - 1 us */
+#define SD_LATENCY_BUCKETS       24
+
+typedef struct {
+  uint32_t count;
+  uint32_t max;    /* us */
+  uint64_t total;  /* us */
+  uint32_t buckets[SD_LATENCY_BUCKETS];
+} SD_Latency_t;
+
+/* Cycle counter (DWT CYCCNT) probes of the read and write paths, 0 to disable */
+#ifndef SD_PROBES
+#define SD_PROBES                0
+#endif
+
+/* Probes, from the Arduino API down to the BSP */
+#define SD_PROBE_FILE_READ       0 /* File::read() */
+#define SD_PROBE_FILE_WRITE      1 /* File::write() */
+#define SD_PROBE_F_READ          2 /* f_read() */
+#define SD_PROBE_F_WRITE         3 /* f_write() */
+#define SD_PROBE_DISK_READ       4 /* disk_read() of the FatFs driver */
+#define SD_PROBE_DISK_WRITE      5 /* disk_write() of the FatFs driver */
+#define SD_PROBE_BSP_READ        6 /* BSP_SD_ReadBlocks() */
+#define SD_PROBE_BSP_WRITE       7 /* BSP_SD_WriteBlocks() */
+#define SD_PROBE_COUNT           8
+
+typedef struct {
+  uint32_t count;
+  uint32_t min;    /* CPU cycles */
+  uint32_t max;
+  uint64_t total;
+} SD_Probe_t;
+
+/* Block I/O trace record operations */
+#define SD_TRACE_READ            ((uint8_t)'R')
+#define SD_TRACE_WRITE           ((uint8_t)'W')
+#define SD_TRACE_ERASE           ((uint8_t)'E')
+#define SD_TRACE_FAILED          ((uint8_t)0x80) /* Device flag */
+
+/* Block I/O trace record, times from micros() */
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint32_t sector;
+  uint16_t count;
+  uint8_t op;      /* SD_TRACE_* */
+  uint8_t device;  /* SD_TRACE_FAILED set on error */
+} SD_TraceRecord_t;
 
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
 #ifndef SD_TRANSCEIVER_EN
@@ -166,21 +267,64 @@ typedef struct {
 #endif
 } SD_PinName_t;
 
-extern SD_PinName_t SD_PinNames;
+/* Pins of the selected device, for backward compatibility */
+#define SD_PinNames (*BSP_SD_GetPinNames(BSP_SD_GetDevice()))
 
 /* SD Exported Functions */
+uint8_t BSP_SD_SelectDevice(uint8_t device);
+uint8_t BSP_SD_GetDevice(void);
+SD_PinName_t *BSP_SD_GetPinNames(uint8_t device);
 uint8_t BSP_SD_Init(void);
 uint8_t BSP_SD_DeInit(void);
+uint8_t BSP_SD_Suspend(void);
+uint8_t BSP_SD_InitStart(void);
+uint8_t BSP_SD_InitPoll(void);
+uint8_t BSP_SD_InitStep(void);
 #if defined(USE_SD_TRANSCEIVER) && (USE_SD_TRANSCEIVER != 0U)
 uint8_t BSP_SD_TransceiverPin(GPIO_TypeDef *enport, uint32_t enpin, GPIO_TypeDef *selport, uint32_t selpin);
 #endif
 uint8_t BSP_SD_DetectPin(PinName p, uint32_t level);
+uint8_t BSP_SD_DetectITConfig(void (*callback)(void));
 uint8_t BSP_SD_ReadBlocks(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks, uint32_t Timeout);
 uint8_t BSP_SD_WriteBlocks(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks, uint32_t Timeout);
 uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr);
 uint8_t BSP_SD_GetCardState(void);
 bool    BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo);
+uint32_t BSP_SD_GetError(void);
+uint8_t BSP_SD_GetSDStatus(uint8_t *status);
+uint8_t BSP_SD_GetSCR(uint8_t *scr);
+uint8_t BSP_SD_ReadExtension(uint32_t reg, uint8_t *data, uint16_t length);
+uint8_t BSP_SD_WriteExtension(uint32_t reg, uint8_t value);
+void    BSP_SD_CacheSetRegister(uint32_t reg);
+bool    BSP_SD_CacheEnabled(void);
+uint8_t BSP_SD_CacheFlush(uint32_t Timeout);
+uint8_t BSP_SD_QueueSetDepth(uint8_t depth);
+uint8_t BSP_SD_QueueDepth(void);
+uint32_t BSP_SD_QueueTasks(void);
+int8_t  BSP_SD_QueueSubmit(bool read, uint32_t sector, uint32_t count);
+uint8_t BSP_SD_QueueStatus(uint32_t *ready);
+uint8_t BSP_SD_QueueExecute(uint8_t task, uint32_t *pData, uint32_t Timeout);
+uint8_t BSP_SD_QueueAbort(void);
 uint8_t BSP_SD_IsDetected(void);
+#if SD_TRACE_SIZE > 0
+void    BSP_SD_TraceStart(void);
+void    BSP_SD_TraceStop(void);
+uint32_t BSP_SD_TraceCount(void);
+uint32_t BSP_SD_TraceLost(void);
+bool    BSP_SD_TraceGet(uint32_t index, SD_TraceRecord_t *record);
+#endif
+#if SD_PROBES
+void    BSP_SD_ProbeReset(void);
+const SD_Probe_t *BSP_SD_GetProbe(uint8_t probe);
+const char *BSP_SD_ProbeName(uint8_t probe);
+#endif
+#if SD_LATENCY_STATS
+void    BSP_SD_LatencyRecord(uint8_t kind, uint32_t sector, uint32_t us);
+const SD_Latency_t *BSP_SD_GetLatency(uint8_t kind);
+uint32_t BSP_SD_LatencyPercentile(uint8_t kind, uint8_t percent);
+void    BSP_SD_ResetLatency(void);
+void    BSP_SD_LatencyCallback(uint32_t threshold, void (*callback)(uint8_t kind, uint32_t sector, uint32_t us));
+#endif
 
 /* These __weak function can be surcharged by application code in case the current settings (e.g. DMA stream)
    need to be changed for specific needs */
@@ -193,8 +337,53 @@ void    BSP_SD_Transceiver_MspInit(SD_HandleTypeDef *hsd, void *Params);
 void    BSP_SD_Transceiver_MspDeInit(SD_HandleTypeDef *hsd, void *Params);
 #endif
 
+#if SD_PROBES
+#if !defined(DWT_CTRL_CYCCNTENA_Msk)
+#error "SD_PROBES requires the DWT cycle counter (Cortex-M3 and above)"
+#endif
+extern SD_Probe_t SD_probes[SD_PROBE_COUNT];
+
+static inline void SD_ProbeRecord(uint8_t probe, uint32_t cycles)
+{
+  SD_Probe_t *p = &SD_probes[probe];
+  p->count++;
+  p->total += cycles;
+  if (cycles < p->min) {
+    p->min = cycles;
+  }
+  if (cycles > p->max) {
+    p->max = cycles;
+  }
+}
+
+/* Time a part of a function, START declaring the start cycle */
+#define SD_PROBE_START(probe)    uint32_t sd_probe_##probe = DWT->CYCCNT
+#define SD_PROBE_STOP(probe)     SD_ProbeRecord(probe, DWT->CYCCNT - sd_probe_##probe)
+#else
+#define SD_PROBE_START(probe)
+#define SD_PROBE_STOP(probe)
+#endif
+
 #ifdef __cplusplus
 }
+
+#if SD_PROBES
+/* Time the rest of the enclosing scope */
+class SdProbeScope {
+  public:
+    SdProbeScope(uint8_t probe) : _probe(probe), _start(DWT->CYCCNT) {}
+    ~SdProbeScope()
+    {
+      SD_ProbeRecord(_probe, DWT->CYCCNT - _start);
+    }
+  private:
+    uint8_t _probe;
+    uint32_t _start;
+};
+#define SD_PROBE_SCOPE(probe)    SdProbeScope sd_probe_scope(probe)
+#else
+#define SD_PROBE_SCOPE(probe)
+#endif
 #endif
 
 #endif /* __BSP_SD_H */
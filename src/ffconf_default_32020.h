@@ -136,7 +136,7 @@
 /  This option has no effect when _LFN_UNICODE is 0. */
 
 
-#define _FS_RPATH       0/* 0 to 2 */
+#define _FS_RPATH       1/* 0 to 2 */
 /* The _FS_RPATH option configures relative path feature.
 /
 /   0: Disable relative path feature and remove related functions.
@@ -150,7 +150,7 @@
 / Drive/Volume Configurations
 /----------------------------------------------------------------------------*/
 
-#define _VOLUMES    1
+#define _VOLUMES    2
 /* Number of volumes (logical drives) to be used. */
 
 